@@ -81,9 +81,39 @@ uint Cluster::getMinimumClusterSize() const {
 
 void Cluster::calculate (Vector3D **clusterPoints, Vector3D **clusterNormals, uint *nofClusters) {
 
+	uint             i;
+	Vector3D         *cCenters;
+	Vector3D         *cNormals;
+
+	// conservative guess on size
+	cCenters = new Vector3D[this->getMaximumNofClusters()];
+	cNormals = new Vector3D[this->getMaximumNofClusters()];
+
+	this->calculate (cCenters, cNormals, nofClusters);
+
+	// allocate final array of clusters
+	this->clusterPoints  = new Vector3D [this->nofClusters];
+	this->clusterNormals = new Vector3D [this->nofClusters];
+	for (i = 0; i < this->nofClusters; i++) {
+		this->clusterPoints[i]  = cCenters[i];
+		this->clusterNormals[i] = cNormals[i];
+	}
+
+	// assign solution arrays to parameters (return values!)
+	*clusterPoints  = this->clusterPoints;
+	*clusterNormals = this->clusterNormals;
+
+	delete[] cCenters;
+	delete[] cNormals;
+
+}
+
+void Cluster::calculate (Vector3D *clusterPoints, Vector3D *clusterNormals, uint *nofClusters) {
+
 	uint             i,
 		             j,
-			         neighbourIndex;
+			         neighbourIndex,
+			         nofRowNeighbours;
 	Vector3D         *cCenters;
 	Vector3D         *cNormals;
 	uint             *neighbors;
@@ -91,16 +121,19 @@ void Cluster::calculate (Vector3D **clusterPoints, Vector3D **clusterNormals, ui
 	const Vector3D   *positions;
 	uint             *clusterSizes;
 	uint             index;
+	const NeighbourGraph *neighbourGraph;
+	const uint       *neighbourIndices;
 	
 	// remove the old solutions first
 	this->cleanUp();
 
 	parentIndices = new uint[nofPositions];
 
-	// conservative guess on size
-	cCenters = new Vector3D[nofPositions / minimumClusterSize];
-	cNormals = new Vector3D[nofPositions / minimumClusterSize];
+	// the cluster centers and normals are summed up in the result arrays
+	cCenters = clusterPoints;
+	cNormals = clusterNormals;
 	neighbors = new uint [nofPositions * minimumClusterSize];
+	clusterSizes = new uint[this->getMaximumNofClusters()];
 	
 
 	flags = new PositionFlags[nofPositions];
@@ -115,7 +148,8 @@ void Cluster::calculate (Vector3D **clusterPoints, Vector3D **clusterNormals, ui
 
 	positions = neighbourHood->getPositions();	
 
-	neighbourHood->setNofNeighbours (minimumClusterSize);
+	// the closest points of all positions, shared with the other users of the neighbourHood
+	neighbourGraph = neighbourHood->getNeighbourGraph (minimumClusterSize);
 
 	for (i = 0; i < nofPositions; i++) {
 		
@@ -123,11 +157,16 @@ void Cluster::calculate (Vector3D **clusterPoints, Vector3D **clusterNormals, ui
 
 			// find closest points and check if no surfel has already been included
 			// in a cluster
-			neighbourHood->setSourcePoint (positions[i]);			
+			neighbourIndices = &(neighbourGraph->indices[neighbourGraph->offsets[i]]);
+			// the row is shorter if there are fewer points than the minimum cluster size
+			nofRowNeighbours = neighbourGraph->offsets[i + 1] - neighbourGraph->offsets[i];
+			if (nofRowNeighbours > minimumClusterSize) {
+				nofRowNeighbours = minimumClusterSize;
+			}
 
-			for (j = 0; j < minimumClusterSize; j++) {	
+			for (j = 0; j < nofRowNeighbours; j++) {	
 				
-				neighbourIndex = neighbourHood->getNeighbourPositionIndex(j);
+				neighbourIndex = neighbourIndices[j];
 				if (flags[neighbourIndex] & CLUSTER_COVERED) {
 					flags[i] = CLUSTER_STRAY;
 					break;
@@ -137,8 +176,10 @@ void Cluster::calculate (Vector3D **clusterPoints, Vector3D **clusterNormals, ui
 			// mark all neighbors as already included in cluster
 			if (flags[i] != CLUSTER_STRAY) {
 				cCenters[this->nofClusters].makeZero();
-				for (j = 0; j < minimumClusterSize; j++) {
-					index = neighbourHood->getNeighbourPositionIndex(j);
+				cNormals[this->nofClusters].makeZero();
+				clusterSizes[this->nofClusters] = nofRowNeighbours;
+				for (j = 0; j < nofRowNeighbours; j++) {
+					index = neighbourIndices[j];
 					flags [index] = CLUSTER_COVERED;
 					parentIndices [index] = this->nofClusters;
 					cCenters[this->nofClusters] += positions[index];
@@ -149,25 +190,20 @@ void Cluster::calculate (Vector3D **clusterPoints, Vector3D **clusterNormals, ui
 			}
 			
 			// and store neighborhood
-			for (j = 0; j < minimumClusterSize; j++) {
-				neighbors[i * minimumClusterSize + j] = neighbourHood->getNeighbourPositionIndex(j);
+			for (j = 0; j < nofRowNeighbours; j++) {
+				neighbors[i * minimumClusterSize + j] = neighbourIndices[j];
 			}
 		}	
 	}
-	
-	// allocate final array of clusters
-	this->clusterPoints  = new Vector3D [this->nofClusters];
-	this->clusterNormals = new Vector3D [this->nofClusters];
-	
-	clusterSizes = new uint[this->nofClusters];	
-	for(i = 0; i < this->nofClusters; i++) {
-		clusterSizes[i] = minimumClusterSize;
-	}
 
 	// assign stray samples to cluster of closest point
 	for (i = 0; i < nofPositions; i++) {
 		if (flags[i] == CLUSTER_STRAY) {
-			for (j = 0; j < minimumClusterSize; j++) {
+			nofRowNeighbours = neighbourGraph->offsets[i + 1] - neighbourGraph->offsets[i];
+			if (nofRowNeighbours > minimumClusterSize) {
+				nofRowNeighbours = minimumClusterSize;
+			}
+			for (j = 0; j < nofRowNeighbours; j++) {
 				index = neighbors[i * minimumClusterSize + j];
 				if (flags[index] == CLUSTER_COVERED) {
 					parentIndices [i] = parentIndices [index];
@@ -183,19 +219,12 @@ void Cluster::calculate (Vector3D **clusterPoints, Vector3D **clusterNormals, ui
 	// normalize cluster centers and assign
 
 	for(i = 0; i < this->nofClusters; i++) {
-		this->clusterPoints[i] = cCenters[i] / clusterSizes[i];
+		cCenters[i] = cCenters[i] / clusterSizes[i];
 		cNormals[i].normalize();
-		this->clusterNormals[i] = cNormals[i];
 	}
 	
-	// assign solution arrays to parameters (return values!)
-	*clusterPoints  = this->clusterPoints;
-	*clusterNormals = this->clusterNormals;
 	*nofClusters = this->nofClusters;
 
-
-	delete[] cCenters;
-	delete[] cNormals;
 	delete[] neighbors;
 	delete[] clusterSizes;
 	delete[] flags;
@@ -203,6 +232,12 @@ void Cluster::calculate (Vector3D **clusterPoints, Vector3D **clusterNormals, ui
 }
 
 
+uint Cluster::getMaximumNofClusters() const {
+	// the points of a cluster are not shared with other clusters, and only a cluster of
+	// all points has fewer than minimumClusterSize points
+	return (nofPositions + minimumClusterSize - 1) / minimumClusterSize;
+}
+
 uint Cluster::getParentPositionIndex (const uint positionIndex) {
 	return parentIndices[positionIndex];
 }
@@ -140,6 +140,30 @@ public:
 	 */
 	void calculate (Vector3D **clusterPoints, Vector3D **clusterNormals, uint *nofClusters);
 
+	/**
+	 * Does the same as the other variant of <code>calculate</code>, but stores the cluster points and their
+	 * normals in the arrays provided by the caller, e.g. in memory which is released together with other arrays.
+	 * These arrays are neither kept nor <code>delete[]</code>d by this <code>Cluster</code>.
+	 *
+	 * @param clusterPoints
+	 *        an array of at least <code>getMaximumNofClusters</code> <code>Vector3D</code>s which receives the
+	 *        points which represent the clusters
+	 * @param clusterNormals
+	 *        an array of the same size which receives the corresponding normals
+	 * @param nofClusters
+	 *        the resulting number of clusters
+	 * @see #getMaximumNofClusters
+	 */
+	void calculate (Vector3D *clusterPoints, Vector3D *clusterNormals, uint *nofClusters);
+
+	/**
+	 * Returns the maximum number of clusters which <code>calculate</code> can generate, given the number of points
+	 * in the <code>neighbourHood</code> and the minimum cluster size.
+	 *
+	 * @return the maximum number of clusters
+	 */
+	uint getMaximumNofClusters() const;
+
 	/**
 	 * Returns the position index of the parent of the point specified by the <code>positionIndex</code>.
 	 *
@@ -178,7 +202,7 @@ private:
 	uint                *parentIndices;
 	
 	// removes the allocated resources:
-	// - clusterPoints, clusterNormals
+	// - clusterPoints, clusterNormals (only allocated by the first variant of calculate)
 	// - clusterIndex, clusterIndexBase, parentIndex
 	// - flags
 	void cleanUp();
@@ -0,0 +1,416 @@
+// Title:   DynamicKdTree.cpp
+//
+// This file is part of the Pointshop3D system.
+// See http://www.pointshop3d.com/ for more information.
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program; if not, write to the Free
+// Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+// MA 02111-1307, USA.
+//
+// Contact info@pointshop3d.com if any conditions of this
+// licensing are not clear to you.
+//
+
+#include "DynamicKdTree.h"
+#include <float.h>
+
+
+// ******************
+// global definitions
+// ******************
+
+/**
+ * Queue adapter for <code>KdTree::queryQueue</code>: inserts the points of a level with
+ * their ids into the query queue and skips the removed points.
+ */
+class LevelQueue {
+
+public:
+	PQueue				*queue;
+	const unsigned int	*ids;
+	const int			*levelOfId;		// 0 if the level has no removed positions
+
+	inline float getMaxWeight() {
+		return queue->getMaxWeight();
+	}
+
+	inline void insert(const int index, const float weight) {
+		unsigned int id = ids[index];
+		if (levelOfId == 0 || levelOfId[id] >= 0) {
+			queue->insert(id, weight);
+		}
+	}
+};
+
+DynamicKdTree::DynamicKdTree(const unsigned int maxBucketSize) {
+	m_nOfPositions	= 0;
+	m_bucketSize	= maxBucketSize > 0 ? maxBucketSize : 1;
+	m_nOfFoundNeighbours	= 0;
+	m_nOfNeighbours			= 0;
+	m_queryContext.neighbours = 0;
+	setNOfNeighbours(1);
+	m_buffer.reserve(DYNAMIC_KDTREE_BUFFER_SIZE);
+	// the trees keep a pointer to the positions of their level, so the levels must never move
+	m_levels.reserve(DYNAMIC_KDTREE_MAX_LEVELS);
+}
+
+DynamicKdTree::DynamicKdTree(const Vector3D *positions, const unsigned int nOfPositions, const unsigned int maxBucketSize) {
+	m_nOfPositions	= nOfPositions;
+	m_bucketSize	= maxBucketSize > 0 ? maxBucketSize : 1;
+	m_nOfFoundNeighbours	= 0;
+	m_nOfNeighbours			= 0;
+	m_queryContext.neighbours = 0;
+	setNOfNeighbours(1);
+	m_buffer.reserve(DYNAMIC_KDTREE_BUFFER_SIZE);
+	// the trees keep a pointer to the positions of their level, so the levels must never move
+	m_levels.reserve(DYNAMIC_KDTREE_MAX_LEVELS);
+	m_positions.assign(positions, positions + nOfPositions);
+	m_levelOfId.resize(nOfPositions, -1);
+	if (nOfPositions == 0) {
+		return;
+	}
+
+	// all positions go into the first level which can hold them
+	unsigned int level = 0;
+	while (((size_t)DYNAMIC_KDTREE_BUFFER_SIZE << level) < nOfPositions) {
+		level++;
+	}
+	std::vector<unsigned int> ids(nOfPositions);
+	for (unsigned int i=0; i<nOfPositions; i++) {
+		ids[i] = i;
+	}
+	buildLevel(level, ids);
+}
+
+DynamicKdTree::~DynamicKdTree() {
+	for (unsigned int i=0; i<m_levels.size(); i++) {
+		delete m_levels[i].tree;
+	}
+}
+
+unsigned int DynamicKdTree::insertPosition(const Vector3D &position) {
+	unsigned int id = (unsigned int)m_positions.size();
+
+	m_positions.push_back(position);
+	m_levelOfId.push_back(-1);
+	m_buffer.push_back(id);
+	m_nOfPositions++;
+	if (m_buffer.size() >= DYNAMIC_KDTREE_BUFFER_SIZE) {
+		flushBuffer();
+	}
+	return id;
+}
+
+void DynamicKdTree::removePosition(const unsigned int id) {
+	int level = m_levelOfId[id];
+
+	if (level == -2) {
+		return;
+	}
+	m_levelOfId[id] = -2;
+	m_nOfPositions--;
+
+	if (level == -1) {
+		for (unsigned int i=0; i<m_buffer.size(); i++) {
+			if (m_buffer[i] == id) {
+				m_buffer[i] = m_buffer.back();
+				m_buffer.pop_back();
+				break;
+			}
+		}
+		return;
+	}
+
+	// the position stays in its tree until more than half of the tree is removed
+	Level &l = m_levels[level];
+	l.nofRemoved++;
+	if (2 * l.nofRemoved > l.ids.size()) {
+		compactLevel(level);
+	}
+}
+
+void DynamicKdTree::queryPosition(const Vector3D &position) {
+	if (m_neighbours.size() == 0) {
+		return;
+	}
+	m_nOfFoundNeighbours = queryRange(position, FLT_MAX, m_queryContext);
+}
+
+void DynamicKdTree::queryRange(const Vector3D &position, const float maxSqrDistance) {
+	if (m_neighbours.size() == 0) {
+		return;
+	}
+	m_nOfFoundNeighbours = queryRange(position, maxSqrDistance, m_queryContext);
+}
+
+unsigned int DynamicKdTree::queryPosition(const Vector3D &position, KdQueryContext &context) const {
+	return queryRange(position, FLT_MAX, context);
+}
+
+unsigned int DynamicKdTree::queryRange(const Vector3D &position, const float maxSqrDistance, KdQueryContext &context) const {
+	PQueue *queue = &context.queue;
+	unsigned int i;
+
+	queue->init();
+	queue->insert(-1, maxSqrDistance);
+
+	for (i=0; i<m_buffer.size(); i++) {
+		float sqrDist = (m_positions[m_buffer[i]] - position).getSquaredLength();
+		if (sqrDist < queue->getMaxWeight()) {
+			queue->insert(m_buffer[i], sqrDist);
+		}
+	}
+
+	// all trees share the queue, so the neighbours found in the large trees prune the small ones
+	LevelQueue levelQueue;
+	levelQueue.queue = queue;
+	for (int level=(int)m_levels.size()-1; level>=0; level--) {
+		const Level &l = m_levels[level];
+		if (l.tree != 0) {
+			levelQueue.ids = &l.ids[0];
+			levelQueue.levelOfId = l.nofRemoved > 0 ? m_levelOfId.data() : 0;
+			l.tree->queryQueue(position, &levelQueue);
+		}
+	}
+
+	if (queue->getMax().index == -1) {
+		queue->removeMax();
+	}
+
+	unsigned int nOfFoundNeighbours = queue->getNofElements();
+
+	for(int j=nOfFoundNeighbours-1; j>=0; j--) {
+		context.neighbours[j] = queue->getMax();
+		queue->removeMax();
+	}
+
+	return nOfFoundNeighbours;
+}
+
+unsigned int DynamicKdTree::queryRadius(const Vector3D &position, const float sqrRadius, std::vector<Neighbour> &neighbours) const {
+	size_t nofNeighbours = neighbours.size();
+	Neighbour neighbour;
+	unsigned int i;
+
+	for (i=0; i<m_buffer.size(); i++) {
+		neighbour.weight = (m_positions[m_buffer[i]] - position).getSquaredLength();
+		if (neighbour.weight <= sqrRadius) {
+			neighbour.index = m_buffer[i];
+			neighbours.push_back(neighbour);
+		}
+	}
+
+	for (unsigned int level=0; level<m_levels.size(); level++) {
+		const Level &l = m_levels[level];
+		if (l.tree == 0) {
+			continue;
+		}
+		// the tree appends the indices of the level, which are replaced by the ids
+		size_t first = neighbours.size(),
+			   last = first;
+		l.tree->queryRadius(position, sqrRadius, neighbours);
+		for (size_t j=first; j<neighbours.size(); j++) {
+			unsigned int id = l.ids[neighbours[j].index];
+			if (m_levelOfId[id] >= 0) {
+				neighbours[last].index = id;
+				neighbours[last].weight = neighbours[j].weight;
+				last++;
+			}
+		}
+		neighbours.resize(last);
+	}
+
+	return (unsigned int)(neighbours.size() - nofNeighbours);
+}
+
+void DynamicKdTree::queryRadius(const Vector3D *positions, const unsigned int nofPositions, const float sqrRadius, std::vector<unsigned int> &offsets, std::vector<Neighbour> &neighbours) const {
+	if (offsets.size() == 0) {
+		offsets.push_back((unsigned int)neighbours.size());
+	}
+	for (unsigned int i=0; i<nofPositions; i++) {
+		queryRadius(positions[i], sqrRadius, neighbours);
+		offsets.push_back((unsigned int)neighbours.size());
+	}
+}
+
+unsigned int DynamicKdTree::countRadius(const Vector3D &position, const float sqrRadius, const unsigned int maxCount) const {
+	unsigned int count = 0,
+				 i;
+
+	for (i=0; i<m_buffer.size() && count<maxCount; i++) {
+		if ((m_positions[m_buffer[i]] - position).getSquaredLength() <= sqrRadius) {
+			count++;
+		}
+	}
+
+	std::vector<Neighbour> neighbours;
+	for (unsigned int level=0; level<m_levels.size() && count<maxCount; level++) {
+		const Level &l = m_levels[level];
+		if (l.tree == 0) {
+			continue;
+		}
+		if (l.nofRemoved == 0) {
+			count += l.tree->countRadius(position, sqrRadius, maxCount - count);
+		}
+		else {
+			// the tree would count the removed positions as well
+			neighbours.clear();
+			l.tree->queryRadius(position, sqrRadius, neighbours);
+			for (i=0; i<neighbours.size() && count<maxCount; i++) {
+				if (m_levelOfId[l.ids[neighbours[i].index]] >= 0) {
+					count++;
+				}
+			}
+		}
+	}
+
+	return count;
+}
+
+void DynamicKdTree::computeNeighbourGraph(const unsigned int nofNeighbours, NeighbourGraph &graph) const {
+	// every query finds the same number of neighbours, unless there are fewer points
+	unsigned int nofFound = (nofNeighbours < m_nOfPositions) ? nofNeighbours : m_nOfPositions,
+				 nofIds = (unsigned int)m_positions.size();
+	int i;
+
+	graph.nofNeighbours = nofNeighbours;
+	graph.offsets.resize(nofIds + 1);
+	graph.offsets[0] = 0;
+	for (i=0; i<(int)nofIds; i++) {
+		graph.offsets[i+1] = graph.offsets[i] + (m_levelOfId[i] != -2 ? nofFound : 0);
+	}
+	graph.indices.resize(graph.offsets[nofIds]);
+	graph.sqrDistances.resize(graph.offsets[nofIds]);
+	if (nofFound == 0) {
+		return;
+	}
+
+	#pragma omp parallel
+	{
+		KdQueryContext context;
+		std::vector<Neighbour> neighbours(nofFound);
+		context.queue.setSize(nofFound);
+		context.neighbours = &neighbours[0];
+
+		#pragma omp for schedule(dynamic, 1024)
+		for (i=0; i<(int)nofIds; i++) {
+			if (m_levelOfId[i] == -2) {
+				continue;
+			}
+			unsigned int n = queryPosition(m_positions[i], context);
+			unsigned int offset = graph.offsets[i];
+			for (unsigned int j=0; j<n; j++) {
+				graph.indices[offset + j] = neighbours[j].index;
+				graph.sqrDistances[offset + j] = neighbours[j].weight;
+			}
+		}
+	}
+}
+
+void DynamicKdTree::setNOfNeighbours (const unsigned int newNOfNeighbours) {
+	if (newNOfNeighbours != m_nOfNeighbours) {
+		m_nOfNeighbours = newNOfNeighbours;
+		m_queryContext.queue.setSize(m_nOfNeighbours);
+		m_neighbours.resize(m_nOfNeighbours);
+		m_queryContext.neighbours = m_nOfNeighbours > 0 ? &m_neighbours[0] : 0;
+		m_nOfFoundNeighbours = 0;
+	}
+}
+
+// ***************
+// private methods
+// ***************
+
+void DynamicKdTree::buildLevel(const unsigned int level, const std::vector<unsigned int> &ids) {
+	if (m_levels.size() <= level) {
+		Level empty;
+		empty.nofRemoved = 0;
+		empty.tree = 0;
+		m_levels.resize(level + 1, empty);
+	}
+	clearLevel(level);
+	if (ids.size() == 0) {
+		return;
+	}
+
+	Level &l = m_levels[level];
+	l.ids = ids;
+	l.positions.resize(ids.size());
+	for (unsigned int i=0; i<ids.size(); i++) {
+		l.positions[i] = m_positions[ids[i]];
+		m_levelOfId[ids[i]] = level;
+	}
+	l.tree = new KdTree(&l.positions[0], (unsigned int)ids.size(), m_bucketSize, true);
+}
+
+void DynamicKdTree::flushBuffer() {
+	std::vector<unsigned int> ids(m_buffer);
+	size_t capacity = DYNAMIC_KDTREE_BUFFER_SIZE;
+	unsigned int level = 0;
+
+	// like a binary counter: the buffer and the occupied lower levels are carried
+	// into the first level which can hold all of them
+	while (level < m_levels.size() && m_levels[level].tree != 0 && ids.size() + m_levels[level].ids.size() - m_levels[level].nofRemoved > capacity) {
+		Level &l = m_levels[level];
+		for (unsigned int i=0; i<l.ids.size(); i++) {
+			if (m_levelOfId[l.ids[i]] >= 0) {
+				ids.push_back(l.ids[i]);
+			}
+		}
+		clearLevel(level);
+		level++;
+		capacity <<= 1;
+	}
+	if (level < m_levels.size() && m_levels[level].tree != 0) {
+		// the level is not full, add its remaining positions
+		Level &l = m_levels[level];
+		for (unsigned int i=0; i<l.ids.size(); i++) {
+			if (m_levelOfId[l.ids[i]] >= 0) {
+				ids.push_back(l.ids[i]);
+			}
+		}
+	}
+	buildLevel(level, ids);
+	m_buffer.clear();
+}
+
+void DynamicKdTree::compactLevel(const unsigned int level) {
+	Level &l = m_levels[level];
+	std::vector<unsigned int> ids;
+
+	ids.reserve(l.ids.size() - l.nofRemoved);
+	for (unsigned int i=0; i<l.ids.size(); i++) {
+		if (m_levelOfId[l.ids[i]] >= 0) {
+			ids.push_back(l.ids[i]);
+		}
+	}
+	buildLevel(level, ids);
+}
+
+void DynamicKdTree::clearLevel(const unsigned int level) {
+	Level &l = m_levels[level];
+
+	delete l.tree;
+	l.tree = 0;
+	l.nofRemoved = 0;
+	l.ids.clear();
+	l.positions.clear();
+}
+
+// Some Emacs-Hints -- please don't remove:
+//
+//  Local Variables:
+//  mode:C++
+//  tab-width:4
+//  End:
@@ -0,0 +1,335 @@
+// Title:   DynamicKdTree.h
+//
+// This file is part of the Pointshop3D system.
+// See http://www.pointshop3d.com/ for more information.
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program; if not, write to the Free
+// Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+// MA 02111-1307, USA.
+//
+// Contact info@pointshop3d.com if any conditions of this
+// licensing are not clear to you.
+//
+
+#ifndef __DYNAMICKDTREE_H_
+#define __DYNAMICKDTREE_H_
+
+#include "kdTree.h"
+#include <vector>
+
+// number of inserted positions which are scanned linearly before they are put into a tree
+#define DYNAMIC_KDTREE_BUFFER_SIZE 64
+// 64 * 2^26 positions in the largest level are enough for unsigned int ids
+#define DYNAMIC_KDTREE_MAX_LEVELS 27
+
+/**
+ * A k-d tree which supports inserting and removing single positions, based on the
+ * logarithmic method: the positions are kept in a forest of static <code>KdTree</code>s,
+ * where tree i holds at most <code>DYNAMIC_KDTREE_BUFFER_SIZE * 2^i</code> positions,
+ * and a small buffer of positions not yet in any tree. When the buffer is full, it is
+ * merged with all the lower trees into the first empty tree, so an insertion costs
+ * amortized O(log^2 n) instead of a rebuild of all positions.
+ * Removed positions are only marked as deleted and skipped by the queries; a tree is
+ * rebuilt from its remaining positions as soon as more than half of them are deleted.
+ * <p>
+ * Every position gets an id, which stays valid until the position is removed, and the
+ * queries return these ids as neighbour indices. The trees only keep the position indices
+ * (see <code>KdTree::KdTree</code>), so each level holds a single copy of its positions.
+ * Like with <code>KdTree</code>, the queries with a caller owned <code>KdQueryContext</code>
+ * and the radius queries are const and thus reentrant, the others keep their result in
+ * this tree. <code>NeighbourHood</code> uses it with <code>NeighbourHood::DYNAMIC_KD_TREE</code>.
+ */
+class DynamicKdTree {
+
+public:
+	/**
+	 * Creates an empty dynamic k-d tree
+	 *
+	 * @param maxBucketSize
+	 *			number of points per bucket of the trees
+	 */
+	DynamicKdTree(const unsigned int maxBucketSize = 10);
+	/**
+	 * Creates a dynamic k-d tree from the positions, the ids of the positions are
+	 * 0..nOfPositions-1
+	 *
+	 * @param positions
+	 *			point positions
+	 * @param nOfPositions
+	 *			number of points
+	 * @param maxBucketSize
+	 *			number of points per bucket of the trees
+	 */
+	DynamicKdTree(const Vector3D *positions, const unsigned int nOfPositions, const unsigned int maxBucketSize = 10);
+	/**
+	 * Destructor
+	 */
+	~DynamicKdTree();
+
+	/**
+	 * inserts a position
+	 *
+	 * @param position
+	 *			the position to insert
+	 * @return the id of the inserted position
+	 */
+	unsigned int insertPosition(const Vector3D &position);
+	/**
+	 * removes a position, nothing happens if it has already been removed
+	 *
+	 * @param id
+	 *			the id of the position, as returned by <code>insertPosition</code>
+	 */
+	void removePosition(const unsigned int id);
+
+	/**
+	 * look for the nearest neighbours at <code>position</code>, see <code>KdTree::queryPosition</code>
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 */
+	void queryPosition(const Vector3D &position);
+	/**
+	 * look for the nearest neighbours with a maximal squared distance <code>maxSqrDistance</code>,
+	 * see <code>KdTree::queryRange</code>
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param maxSqrDistance
+	 *			the maximal squared distance of a nearest neighbour
+	 */
+	void queryRange(const Vector3D &position, const float maxSqrDistance);
+	/**
+	 * look for the nearest neighbours at <code>position</code>
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param context
+	 *			the queue and the output buffer of the query
+	 * @return the number of found neighbours, their indices are position ids
+	 */
+	unsigned int queryPosition(const Vector3D &position, KdQueryContext &context) const;
+	/**
+	 * look for the nearest neighbours with a maximal squared distance <code>maxSqrDistance</code>
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param maxSqrDistance
+	 *			the maximal squared distance of a nearest neighbour
+	 * @param context
+	 *			the queue and the output buffer of the query
+	 * @return the number of found neighbours, their indices are position ids
+	 */
+	unsigned int queryRange(const Vector3D &position, const float maxSqrDistance, KdQueryContext &context) const;
+	/**
+	 * look for all points within a squared distance of <code>sqrRadius</code>,
+	 * see <code>KdTree::queryRadius</code>
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param sqrRadius
+	 *			the squared search radius
+	 * @param neighbours
+	 *			the found points are appended with their ids, in no particular order
+	 * @return the number of found points
+	 */
+	unsigned int queryRadius(const Vector3D &position, const float sqrRadius, std::vector<Neighbour> &neighbours) const;
+	/**
+	 * look for the points within a squared distance of <code>sqrRadius</code> of each of the 
+	 * <code>positions</code>, the results have the same layout as those of <code>KdTree::queryRadius</code>
+	 *
+	 * @param positions
+	 *			the positions to query with
+	 * @param nofPositions
+	 *			the number of <code>positions</code>
+	 * @param sqrRadius
+	 *			the squared search radius
+	 * @param offsets
+	 *			the end of the neighbours of each query position is appended
+	 * @param neighbours
+	 *			the found points of all query positions are appended
+	 */
+	void queryRadius(const Vector3D *positions, const unsigned int nofPositions, const float sqrRadius, std::vector<unsigned int> &offsets, std::vector<Neighbour> &neighbours) const;
+	/**
+	 * counts the points within a squared distance of <code>sqrRadius</code>
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param sqrRadius
+	 *			the squared search radius
+	 * @param maxCount
+	 *			the search stops as soon as this many points are found
+	 * @return the number of found points, at most <code>maxCount</code>
+	 */
+	unsigned int countRadius(const Vector3D &position, const float sqrRadius, const unsigned int maxCount = UINT_MAX) const;
+	/**
+	 * computes the <code>nofNeighbours</code> nearest neighbours of all positions at once, 
+	 * see <code>KdTree::computeNeighbourGraph</code>. The graph has a row for each id,
+	 * the rows of the removed positions are empty.
+	 *
+	 * @param nofNeighbours
+	 *			the number of nearest neighbours per position
+	 * @param graph
+	 *			returns the neighbours of all positions
+	 */
+	void computeNeighbourGraph(const unsigned int nofNeighbours, NeighbourGraph &graph) const;
+
+	/**
+	 * set the number of nearest neighbours which have to be looked at for a query
+	 *
+	 * @params newNOfNeighbours
+	 *			the number of nearest neighbours
+	 */
+	void setNOfNeighbours (const unsigned int newNOfNeighbours);
+	/**
+	 * get the id of the i-th nearest neighbour to the query point
+	 * i must be smaller than the number of found neighbours
+	 *
+	 * @param i
+	 *			index of the nearest neighbour
+	 * @return the id of the i-th nearest neighbour
+	 */
+	inline unsigned int getNeighbourPositionIndex (const unsigned int i) const;
+	/** 
+	 * get the position of the i-th nearest neighbour
+	 * i must be smaller than the number of found neighbours
+	 *
+	 * @param i
+	 *			index of the nearest neighbour
+	 * @return the position of the i-th nearest neighbour
+	 */
+	inline Vector3D const& getNeighbourPosition(const unsigned int i) const;
+	/**
+	 * get the squared distance of the query point and its i-th nearest neighbour
+	 * i must be smaller than the number of found neighbours
+	 *
+	 * @param i
+	 *			index of the nearest neighbour
+	 * @return the squared distance to the i-th nearest neighbour
+	 */
+	inline float const& getSquaredDistance (const unsigned int i) const;
+	/**
+	 * get the number of found neighbours
+	 * Generally, this is equal to the number of query neighbours
+	 * except for range queries, where this number may be smaller than the number of query neigbhbours
+	 *
+	 * @return the number of found neighbours
+	 */
+	inline unsigned int const& getNOfFoundNeighbours() const;
+
+	/**
+	 * @param id
+	 *			the id of a position
+	 * @return the position
+	 */
+	inline const Vector3D &getPosition(const unsigned int id) const;
+	/**
+	 * @param id
+	 *			the id of a position
+	 * @return true, if the position has been removed
+	 */
+	inline bool isRemoved(const unsigned int id) const;
+	/**
+	 * @return the number of positions which have not been removed
+	 */
+	inline unsigned int getNOfPositions() const;
+	/**
+	 * @return the number of ids given out so far, i.e. the first id of the next insertion
+	 */
+	inline unsigned int getNOfIds() const;
+	/**
+	 * @return the positions by id, including the removed ones; the array moves when
+	 *		   a position is inserted
+	 */
+	inline const Vector3D *getPositions() const;
+
+private:
+
+	// a static tree of the forest, it owns the positions its index only tree refers to
+	typedef struct level {
+		std::vector<Vector3D>		positions;
+		std::vector<unsigned int>	ids;			// the id of each position of the tree
+		unsigned int				nofRemoved;		// number of removed positions still in the tree
+		KdTree						*tree;			// 0 if the level is empty
+	} Level;
+
+	std::vector<Vector3D>		m_positions;		// the positions by id
+	std::vector<int>			m_levelOfId;		// level of each id, -1 for the buffer, -2 if removed
+	std::vector<unsigned int>	m_buffer;			// the ids of the positions not yet in a tree
+	std::vector<Level>			m_levels;
+	unsigned int				m_nOfPositions,
+								m_bucketSize;
+	std::vector<Neighbour>		m_neighbours;		// the result of the last query with the state of this tree
+	unsigned int				m_nOfFoundNeighbours,
+								m_nOfNeighbours;
+	KdQueryContext				m_queryContext;
+
+	// builds the tree of level from the ids, which must not be removed
+	void buildLevel(const unsigned int level, const std::vector<unsigned int> &ids);
+	// merges the buffer and the lower levels into the first level which can hold them
+	void flushBuffer();
+	// rebuilds a level without its removed positions
+	void compactLevel(const unsigned int level);
+	// deletes the tree of level and marks it as empty
+	void clearLevel(const unsigned int level);
+
+	// not copyable, the levels own their trees
+	DynamicKdTree(const DynamicKdTree &);
+	DynamicKdTree &operator=(const DynamicKdTree &);
+};
+
+inline unsigned int DynamicKdTree::getNeighbourPositionIndex (const unsigned int neighbourIndex) const {
+	return m_neighbours[neighbourIndex].index;
+}
+
+inline Vector3D const& DynamicKdTree::getNeighbourPosition(const unsigned int neighbourIndex) const {
+	return m_positions[m_neighbours[neighbourIndex].index];
+}
+
+inline float const& DynamicKdTree::getSquaredDistance (const unsigned int neighbourIndex) const {
+	return m_neighbours[neighbourIndex].weight;
+}
+
+inline unsigned int const& DynamicKdTree::getNOfFoundNeighbours() const {
+	return m_nOfFoundNeighbours;
+}
+
+inline const Vector3D &DynamicKdTree::getPosition(const unsigned int id) const {
+	return m_positions[id];
+}
+
+inline bool DynamicKdTree::isRemoved(const unsigned int id) const {
+	return m_levelOfId[id] == -2;
+}
+
+inline unsigned int DynamicKdTree::getNOfPositions() const {
+	return m_nOfPositions;
+}
+
+inline unsigned int DynamicKdTree::getNOfIds() const {
+	return (unsigned int)m_positions.size();
+}
+
+inline const Vector3D *DynamicKdTree::getPositions() const {
+	return m_positions.size() > 0 ? &m_positions[0] : 0;
+}
+
+#endif
+
+// Some Emacs-Hints -- please don't remove:
+//
+//  Local Variables:
+//  mode:C++
+//  tab-width:4
+//  End:
@@ -0,0 +1,420 @@
+// Title:   FlatKdTree.cpp
+// Created: Mon Oct 19 10:12:44 2026
+// Authors: Richard Keiser, Oliver Knoll, Mark Pauly, Matthias Zwicker
+//
+// Copyright (c) 2001, 2002, 2003 Computer Graphics Lab, ETH Zurich
+//
+// This file is part of the Pointshop3D system.
+// See http://www.pointshop3d.com/ for more information.
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program; if not, write to the Free
+// Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+// MA 02111-1307, USA.
+//
+// Contact info@pointshop3d.com if any conditions of this
+// licensing are not clear to you.
+//
+
+#include "FlatKdTree.h"
+#include <float.h>
+
+
+// ******************
+// global definitions
+// ******************
+
+FlatKdTree::FlatKdTree(const Vector3D *positions, const unsigned int nOfPositions, const unsigned int maxBucketSize) {
+	m_positions		= positions;
+	m_nOfPositions	= nOfPositions;
+	m_bucketSize	= maxBucketSize > 0 ? maxBucketSize : 1;
+	m_nOfFoundNeighbours	= 0;
+	m_nOfNeighbours			= 0;
+	m_queryContext.neighbours = 0;
+	setNOfNeighbours(1);
+
+	m_x.resize(nOfPositions);
+	m_y.resize(nOfPositions);
+	m_z.resize(nOfPositions);
+	m_indices.resize(nOfPositions);
+	if (nOfPositions == 0) {
+		return;
+	}
+
+	// the tree is built on a temporary copy of the points, which is permuted by the splits
+	KdTreePoint *points = new KdTreePoint[nOfPositions];
+	for (unsigned int i=0; i<nOfPositions; i++) {
+		points[i].pos = positions[i];
+		points[i].index = i;
+	}
+	Vector3D maximum, minimum;
+	KdTree::getSpread(points, nOfPositions, maximum, minimum);
+	m_boundingBoxLowCorner = minimum;
+	m_boundingBoxHighCorner = maximum;
+
+	m_nodes.reserve(4 * (nOfPositions / m_bucketSize + 1));
+	createTree(points, 0, nOfPositions, maximum, minimum);
+
+	// the leaves are consecutive runs of the permuted points
+	for (unsigned int i=0; i<nOfPositions; i++) {
+		m_x[i] = points[i].pos[0];
+		m_y[i] = points[i].pos[1];
+		m_z[i] = points[i].pos[2];
+		m_indices[i] = points[i].index;
+	}
+	delete[] points;
+}
+
+
+FlatKdTree::~FlatKdTree() {
+}
+
+void FlatKdTree::queryPosition(const Vector3D &position) {
+	if (m_neighbours.size() == 0) {
+		return;
+	}
+	m_nOfFoundNeighbours = queryRange(position, FLT_MAX, m_queryContext);
+}
+
+void FlatKdTree::queryRange(const Vector3D &position, const float maxSqrDistance) {
+	if (m_neighbours.size() == 0) {
+		return;
+	}
+	m_nOfFoundNeighbours = queryRange(position, maxSqrDistance, m_queryContext);
+}
+
+unsigned int FlatKdTree::queryPosition(const Vector3D &position, KdQueryContext &context) const {
+	return queryRange(position, FLT_MAX, context);
+}
+
+unsigned int FlatKdTree::queryRange(const Vector3D &position, const float maxSqrDistance, KdQueryContext &context) const {
+	if (m_nodes.size() == 0) {
+		return 0;
+	}
+
+	PQueue *queue = &context.queue;
+	Vector3D queryOffsets(0,0,0);
+
+	float sqrDist = computeBoxSqrDistance(position, m_boundingBoxLowCorner, m_boundingBoxHighCorner, queryOffsets);
+
+	if (sqrDist > maxSqrDistance) {
+		return 0;
+	}
+
+	queue->init();
+	queue->insert(-1, maxSqrDistance);
+
+	queryNode(0, sqrDist, queue, position, queryOffsets);
+
+	if (queue->getMax().index == -1) {
+		queue->removeMax();
+	}
+
+	unsigned int nOfFoundNeighbours = queue->getNofElements();
+
+	for(int i=nOfFoundNeighbours-1; i>=0; i--) {
+		context.neighbours[i] = queue->getMax();
+		queue->removeMax();
+	}
+
+	return nOfFoundNeighbours;
+}
+
+unsigned int FlatKdTree::queryRadius(const Vector3D &position, const float sqrRadius, std::vector<Neighbour> &neighbours) const {
+	if (m_nodes.size() == 0) {
+		return 0;
+	}
+
+	Vector3D queryOffsets(0,0,0);
+	size_t nofNeighbours = neighbours.size();
+
+	float sqrDist = computeBoxSqrDistance(position, m_boundingBoxLowCorner, m_boundingBoxHighCorner, queryOffsets);
+	if (sqrDist > sqrRadius) {
+		return 0;
+	}
+	queryRadiusNode(0, sqrDist, sqrRadius, position, queryOffsets, neighbours);
+
+	return (unsigned int)(neighbours.size() - nofNeighbours);
+}
+
+void FlatKdTree::queryRadius(const Vector3D *positions, const unsigned int nofPositions, const float sqrRadius, std::vector<unsigned int> &offsets, std::vector<Neighbour> &neighbours) const {
+	if (offsets.size() == 0) {
+		offsets.push_back((unsigned int)neighbours.size());
+	}
+	for (unsigned int i=0; i<nofPositions; i++) {
+		queryRadius(positions[i], sqrRadius, neighbours);
+		offsets.push_back((unsigned int)neighbours.size());
+	}
+}
+
+unsigned int FlatKdTree::countRadius(const Vector3D &position, const float sqrRadius, const unsigned int maxCount) const {
+	if (m_nodes.size() == 0 || maxCount == 0) {
+		return 0;
+	}
+
+	Vector3D queryOffsets(0,0,0);
+	unsigned int count = 0;
+
+	float sqrDist = computeBoxSqrDistance(position, m_boundingBoxLowCorner, m_boundingBoxHighCorner, queryOffsets);
+	if (sqrDist > sqrRadius) {
+		return 0;
+	}
+	countRadiusNode(0, sqrDist, sqrRadius, position, queryOffsets, count, maxCount);
+
+	return count;
+}
+
+void FlatKdTree::computeNeighbourGraph(const unsigned int nofNeighbours, NeighbourGraph &graph) const {
+	// every query finds the same number of neighbours, unless there are fewer points
+	unsigned int nofFound = (nofNeighbours < m_nOfPositions) ? nofNeighbours : m_nOfPositions;
+	int i;
+
+	graph.nofNeighbours = nofNeighbours;
+	graph.offsets.resize(m_nOfPositions + 1);
+	graph.indices.resize(m_nOfPositions * nofFound);
+	graph.sqrDistances.resize(m_nOfPositions * nofFound);
+	for (i=0; i<=(int)m_nOfPositions; i++) {
+		graph.offsets[i] = i * nofFound;
+	}
+	if (nofFound == 0) {
+		return;
+	}
+
+	#pragma omp parallel
+	{
+		KdQueryContext context;
+		std::vector<Neighbour> neighbours(nofFound);
+		context.queue.setSize(nofFound);
+		context.neighbours = &neighbours[0];
+
+		// the points are queried in the order of the leaves, so consecutive queries visit the same nodes
+		#pragma omp for schedule(dynamic, 1024)
+		for (i=0; i<(int)m_nOfPositions; i++) {
+			unsigned int n = queryPosition(m_positions[m_indices[i]], context);
+			unsigned int offset = graph.offsets[m_indices[i]];
+			for (unsigned int j=0; j<n; j++) {
+				graph.indices[offset + j] = neighbours[j].index;
+				graph.sqrDistances[offset + j] = neighbours[j].weight;
+			}
+		}
+	}
+}
+
+void FlatKdTree::setNOfNeighbours (const unsigned int newNOfNeighbours) {
+	if (newNOfNeighbours != m_nOfNeighbours) {
+		m_nOfNeighbours = newNOfNeighbours;
+		m_queryContext.queue.setSize(m_nOfNeighbours);
+		m_neighbours.resize(m_nOfNeighbours);
+		m_queryContext.neighbours = m_nOfNeighbours > 0 ? &m_neighbours[0] : 0;
+		m_nOfFoundNeighbours = 0;
+	}
+}
+
+// ***************
+// private methods
+// ***************
+
+unsigned int FlatKdTree::createTree(KdTreePoint *points, const int start, const int end, Vector3D &maximum, Vector3D &minimum) {
+	unsigned int nodeIndex = (unsigned int)m_nodes.size();
+	FlatKdNode node;
+
+	if (end-start <= (int)m_bucketSize) {
+		node.firstPoint = start;
+		node.info = ((end-start) << 2) | FLAT_KDNODE_LEAF;
+		m_nodes.push_back(node);
+		return nodeIndex;
+	}
+	// the inner node is completed once the index of its high child is known
+	node.cutVal = 0.0f;
+	node.info = 0;
+	m_nodes.push_back(node);
+
+	unsigned char dim;
+	float cutVal;
+	int mid;
+	KdTree::splitPoints(points+start, end-start, maximum, minimum, dim, cutVal, mid);
+	mid += start;
+
+	// the low child directly follows its parent
+	float oldMax = maximum[dim];
+	maximum[dim] = cutVal;
+	createTree(points, start, mid, maximum, minimum);
+	maximum[dim] = oldMax;
+
+	float oldMin = minimum[dim];
+	minimum[dim] = cutVal;
+	unsigned int rightChild = createTree(points, mid, end, maximum, minimum);
+	minimum[dim] = oldMin;
+
+	m_nodes[nodeIndex].cutVal = cutVal;
+	m_nodes[nodeIndex].info = (rightChild << 2) | dim;
+	return nodeIndex;
+}
+
+void FlatKdTree::queryNode(const unsigned int nodeIndex, float rd, PQueue *queue, const Vector3D &queryPosition, Vector3D &queryOffsets) const {
+	const FlatKdNode &node = m_nodes[nodeIndex];
+	unsigned int dim = node.info & 3;
+
+	if (dim != FLAT_KDNODE_LEAF) {
+		unsigned int nearChild = nodeIndex + 1,
+					 farChild = node.info >> 2;
+		float old_off = queryOffsets[dim];
+		float new_off = queryPosition[dim] - node.cutVal;
+		if (new_off >= 0) {
+			nearChild = farChild;
+			farChild = nodeIndex + 1;
+		}
+		queryNode(nearChild, rd, queue, queryPosition, queryOffsets);
+		rd = rd - SQR(old_off) + SQR(new_off);
+		if (rd < queue->getMaxWeight()) {
+			queryOffsets[dim] = new_off;
+			queryNode(farChild, rd, queue, queryPosition, queryOffsets);
+			queryOffsets[dim] = old_off;
+		}
+	}
+	else {
+		unsigned int nOfPoints = node.info >> 2;
+		const float *x = m_x.data() + node.firstPoint,
+					*y = m_y.data() + node.firstPoint,
+					*z = m_z.data() + node.firstPoint;
+		const unsigned int *indices = m_indices.data() + node.firstPoint;
+		float qx = queryPosition[0],
+			  qy = queryPosition[1],
+			  qz = queryPosition[2];
+		float sqrDist[FLAT_KDTREE_LEAF_BLOCK];
+
+		for (unsigned int block=0; block<nOfPoints; block+=FLAT_KDTREE_LEAF_BLOCK) {
+			unsigned int n = nOfPoints - block < FLAT_KDTREE_LEAF_BLOCK ? nOfPoints - block : FLAT_KDTREE_LEAF_BLOCK;
+			// no dependencies between the points, so this loop vectorizes
+			for (unsigned int i=0; i<n; i++) {
+				float dx = x[block+i] - qx,
+					  dy = y[block+i] - qy,
+					  dz = z[block+i] - qz;
+				sqrDist[i] = dx*dx + dy*dy + dz*dz;
+			}
+			for (unsigned int i=0; i<n; i++) {
+				if (sqrDist[i] < queue->getMaxWeight()) {
+					queue->insert(indices[block+i], sqrDist[i]);
+				}
+			}
+		}
+	}
+}
+
+void FlatKdTree::queryRadiusNode(const unsigned int nodeIndex, float rd, const float sqrRadius, const Vector3D &queryPosition, Vector3D &queryOffsets, std::vector<Neighbour> &neighbours) const {
+	const FlatKdNode &node = m_nodes[nodeIndex];
+	unsigned int dim = node.info & 3;
+
+	if (dim != FLAT_KDNODE_LEAF) {
+		unsigned int nearChild = nodeIndex + 1,
+					 farChild = node.info >> 2;
+		float old_off = queryOffsets[dim];
+		float new_off = queryPosition[dim] - node.cutVal;
+		if (new_off >= 0) {
+			nearChild = farChild;
+			farChild = nodeIndex + 1;
+		}
+		queryRadiusNode(nearChild, rd, sqrRadius, queryPosition, queryOffsets, neighbours);
+		rd = rd - SQR(old_off) + SQR(new_off);
+		if (rd <= sqrRadius) {
+			queryOffsets[dim] = new_off;
+			queryRadiusNode(farChild, rd, sqrRadius, queryPosition, queryOffsets, neighbours);
+			queryOffsets[dim] = old_off;
+		}
+	}
+	else {
+		unsigned int first = node.firstPoint,
+					 last = first + (node.info >> 2);
+		Neighbour neighbour;
+		for (unsigned int i=first; i<last; i++) {
+			float dx = m_x[i] - queryPosition[0],
+				  dy = m_y[i] - queryPosition[1],
+				  dz = m_z[i] - queryPosition[2];
+			neighbour.weight = dx*dx + dy*dy + dz*dz;
+			if (neighbour.weight <= sqrRadius) {
+				neighbour.index = m_indices[i];
+				neighbours.push_back(neighbour);
+			}
+		}
+	}
+}
+
+bool FlatKdTree::countRadiusNode(const unsigned int nodeIndex, float rd, const float sqrRadius, const Vector3D &queryPosition, Vector3D &queryOffsets, unsigned int &count, const unsigned int maxCount) const {
+	const FlatKdNode &node = m_nodes[nodeIndex];
+	unsigned int dim = node.info & 3;
+
+	if (dim != FLAT_KDNODE_LEAF) {
+		unsigned int nearChild = nodeIndex + 1,
+					 farChild = node.info >> 2;
+		float old_off = queryOffsets[dim];
+		float new_off = queryPosition[dim] - node.cutVal;
+		if (new_off >= 0) {
+			nearChild = farChild;
+			farChild = nodeIndex + 1;
+		}
+		if (countRadiusNode(nearChild, rd, sqrRadius, queryPosition, queryOffsets, count, maxCount)) {
+			return true;
+		}
+		rd = rd - SQR(old_off) + SQR(new_off);
+		if (rd <= sqrRadius) {
+			queryOffsets[dim] = new_off;
+			bool isDone = countRadiusNode(farChild, rd, sqrRadius, queryPosition, queryOffsets, count, maxCount);
+			queryOffsets[dim] = old_off;
+			return isDone;
+		}
+	}
+	else {
+		unsigned int first = node.firstPoint,
+					 last = first + (node.info >> 2);
+		for (unsigned int i=first; i<last; i++) {
+			float dx = m_x[i] - queryPosition[0],
+				  dy = m_y[i] - queryPosition[1],
+				  dz = m_z[i] - queryPosition[2];
+			if (dx*dx + dy*dy + dz*dz <= sqrRadius) {
+				count++;
+				if (count >= maxCount) {
+					return true;
+				}
+			}
+		}
+	}
+
+	return false;
+}
+
+inline float FlatKdTree::computeBoxSqrDistance(const Vector3D &q, const Vector3D &lo, const Vector3D &hi, Vector3D &offset) const {
+	float dist = 0.0;
+	float t;
+
+	for (int d=0; d<3; d++) {
+		if (q[d] < lo[d]) {
+			t = lo[d] - q[d];
+			offset[d] = t;
+			dist += t*t;
+		}
+		else if (q[d] > hi[d]) {
+			t = q[d] - hi[d];
+			offset[d] = t;
+			dist += t*t;
+		}
+	}
+
+	return dist;
+}
+
+// Some Emacs-Hints -- please don't remove:
+//
+//  Local Variables:
+//  mode:C++
+//  tab-width:4
+//  End:
@@ -0,0 +1,300 @@
+// Title:   FlatKdTree.h
+// Created: Mon Oct 19 10:12:44 2026
+// Authors: Richard Keiser, Oliver Knoll, Mark Pauly, Matthias Zwicker
+//
+// Copyright (c) 2001, 2002, 2003 Computer Graphics Lab, ETH Zurich
+//
+// This file is part of the Pointshop3D system.
+// See http://www.pointshop3d.com/ for more information.
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program; if not, write to the Free
+// Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+// MA 02111-1307, USA.
+//
+// Contact info@pointshop3d.com if any conditions of this
+// licensing are not clear to you.
+//
+
+#ifndef __FLATKDTREE_H_
+#define __FLATKDTREE_H_
+
+#include "kdTree.h"
+#include <vector>
+
+// number of leaf points whose distances are computed in one block
+#define FLAT_KDTREE_LEAF_BLOCK 16
+
+/**
+ * Node of a flat kd tree, 8 bytes. The left child of an inner node is always the
+ * next node in the node array, only the index of the right child is stored.
+ * The lowest two bits of <code>info</code> hold the split dimension of an inner node,
+ * or 3 for a leaf.
+ */
+typedef struct flatKdNode {
+	union {
+		float			cutVal;			// inner node: the cut value
+		unsigned int	firstPoint;		// leaf: position of the first point in the bucket arrays
+	};
+	unsigned int		info;			// inner node: (right child << 2) | dim, leaf: (nofPoints << 2) | 3
+} FlatKdNode;
+
+#define FLAT_KDNODE_LEAF 3
+
+/**
+ * A k-d tree with the same sliding midpoint splitting rule and the same queries as
+ * <code>KdTree</code>, but with a pointer free memory layout: the nodes are stored in one
+ * contiguous array in depth first order, and the points of the leaf buckets are stored
+ * as consecutive runs of separate x, y and z coordinate arrays. The distances of a
+ * bucket are computed in one loop over these arrays, before they are inserted into the
+ * query queue. Like with <code>KdTree</code>, the queries with a caller owned
+ * <code>KdQueryContext</code> and the radius queries are const and thus reentrant,
+ * the others keep their result in this tree. <code>NeighbourHood</code> uses it with
+ * <code>NeighbourHood::FLAT_KD_TREE</code>.
+ */
+class FlatKdTree {
+
+public:
+	/**
+	 * Creates a flat k-d tree from the positions
+	 *
+	 * @param positions
+	 *			point positions
+	 * @param nOfPositions
+	 *			number of points
+	 * @param maxBucketSize
+	 *			number of points per bucket
+	 */
+	FlatKdTree(const Vector3D *positions, const unsigned int nOfPositions, const unsigned int maxBucketSize);
+	/**
+	 * Destructor
+	 */
+	~FlatKdTree();
+
+	/**
+	 * look for the nearest neighbours at <code>position</code>, see <code>KdTree::queryPosition</code>
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 */
+	void queryPosition(const Vector3D &position);
+	/**
+	 * look for the nearest neighbours with a maximal squared distance <code>maxSqrDistance</code>,
+	 * see <code>KdTree::queryRange</code>
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param maxSqrDistance
+	 *			the maximal squared distance of a nearest neighbour
+	 */
+	void queryRange(const Vector3D &position, const float maxSqrDistance);
+	/**
+	 * look for the nearest neighbours at <code>position</code>
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param context
+	 *			the queue and the output buffer of the query
+	 * @return the number of found neighbours, which are stored in <code>context.neighbours</code>
+	 */
+	unsigned int queryPosition(const Vector3D &position, KdQueryContext &context) const;
+	/**
+	 * look for the nearest neighbours with a maximal squared distance <code>maxSqrDistance</code>
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param maxSqrDistance
+	 *			the maximal squared distance of a nearest neighbour
+	 * @param context
+	 *			the queue and the output buffer of the query
+	 * @return the number of found neighbours, which are stored in <code>context.neighbours</code>
+	 */
+	unsigned int queryRange(const Vector3D &position, const float maxSqrDistance, KdQueryContext &context) const;
+	/**
+	 * look for all points within a squared distance of <code>sqrRadius</code>,
+	 * see <code>KdTree::queryRadius</code>
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param sqrRadius
+	 *			the squared search radius
+	 * @param neighbours
+	 *			the found points are appended, in no particular order
+	 * @return the number of found points
+	 */
+	unsigned int queryRadius(const Vector3D &position, const float sqrRadius, std::vector<Neighbour> &neighbours) const;
+	/**
+	 * look for the points within a squared distance of <code>sqrRadius</code> of each of the 
+	 * <code>positions</code>, the results have the same layout as those of <code>KdTree::queryRadius</code>
+	 *
+	 * @param positions
+	 *			the positions to query with
+	 * @param nofPositions
+	 *			the number of <code>positions</code>
+	 * @param sqrRadius
+	 *			the squared search radius
+	 * @param offsets
+	 *			the end of the neighbours of each query position is appended
+	 * @param neighbours
+	 *			the found points of all query positions are appended
+	 */
+	void queryRadius(const Vector3D *positions, const unsigned int nofPositions, const float sqrRadius, std::vector<unsigned int> &offsets, std::vector<Neighbour> &neighbours) const;
+	/**
+	 * counts the points within a squared distance of <code>sqrRadius</code>
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param sqrRadius
+	 *			the squared search radius
+	 * @param maxCount
+	 *			the search stops as soon as this many points are found
+	 * @return the number of found points, at most <code>maxCount</code>
+	 */
+	unsigned int countRadius(const Vector3D &position, const float sqrRadius, const unsigned int maxCount = UINT_MAX) const;
+
+	/**
+	 * computes the <code>nofNeighbours</code> nearest neighbours of all positions of this tree
+	 * at once, see <code>KdTree::computeNeighbourGraph</code>
+	 *
+	 * @param nofNeighbours
+	 *			the number of nearest neighbours per position
+	 * @param graph
+	 *			returns the neighbours of all positions
+	 */
+	void computeNeighbourGraph(const unsigned int nofNeighbours, NeighbourGraph &graph) const;
+
+	/**
+	 * set the number of nearest neighbours which have to be looked at for a query
+	 *
+	 * @params newNOfNeighbours
+	 *			the number of nearest neighbours
+	 */
+	void setNOfNeighbours (const unsigned int newNOfNeighbours);
+	/**
+	 * get the index of the i-th nearest neighbour to the query point
+	 * i must be smaller than the number of found neighbours
+	 *
+	 * @param i
+	 *			index of the nearest neighbour
+	 * @return the index of the i-th nearest neighbour
+	 */
+	inline unsigned int getNeighbourPositionIndex (const unsigned int i) const;
+	/** 
+	 * get the position of the i-th nearest neighbour
+	 * i must be smaller than the number of found neighbours
+	 *
+	 * @param i
+	 *			index of the nearest neighbour
+	 * @return the position of the i-th nearest neighbour
+	 */
+	inline Vector3D const& getNeighbourPosition(const unsigned int i) const;
+	/**
+	 * get the squared distance of the query point and its i-th nearest neighbour
+	 * i must be smaller than the number of found neighbours
+	 *
+	 * @param i
+	 *			index of the nearest neighbour
+	 * @return the squared distance to the i-th nearest neighbour
+	 */
+	inline float const& getSquaredDistance (const unsigned int i) const;
+	/**
+	 * get the number of found neighbours
+	 * Generally, this is equal to the number of query neighbours
+	 * except for range queries, where this number may be smaller than the number of query neigbhbours
+	 *
+	 * @return the number of found neighbours
+	 */
+	inline unsigned int const& getNOfFoundNeighbours() const;
+	/**
+	 * get the number of query neighbors
+	 * Generally, this is equal to the number of found neighbours
+	 * except for range queries, where this number may be larger than the number of found neigbhbours
+	 *
+	 * @return the number of query neighbours
+	 */
+	inline unsigned int const& getNOfQueryNeighbours() const;
+
+	/**
+	 * @return the number of points in this tree
+	 */
+	inline unsigned int getNOfPositions() const;
+	/**
+	 * @return the number of nodes, including the leaves
+	 */
+	inline unsigned int getNOfNodes() const;
+
+private:
+
+	const Vector3D*				m_positions;
+	unsigned int				m_nOfPositions,
+								m_bucketSize;
+	std::vector<FlatKdNode>		m_nodes;			// all nodes in depth first order
+	std::vector<float>			m_x,				// the coordinates of the points, ordered by leaf
+								m_y,
+								m_z;
+	std::vector<unsigned int>	m_indices;			// the position index of each point in the bucket arrays
+	Vector3D					m_boundingBoxLowCorner;
+	Vector3D					m_boundingBoxHighCorner;
+	std::vector<Neighbour>		m_neighbours;		// the result of the last query with the state of this tree
+	unsigned int				m_nOfFoundNeighbours,
+								m_nOfNeighbours;
+	KdQueryContext				m_queryContext;
+
+	// appends the subtree of points[start..end-1] to the node array, returns the index of its root
+	unsigned int createTree(KdTreePoint *points, const int start, const int end, Vector3D &maximum, Vector3D &minimum);
+	// traverses the subtree with root nodeIndex, rd is the squared distance of the query to the node box
+	void queryNode(const unsigned int nodeIndex, float rd, PQueue *queue, const Vector3D &queryPosition, Vector3D &queryOffsets) const;
+	// appends the points of the subtree with root nodeIndex within sqrRadius of the query
+	void queryRadiusNode(const unsigned int nodeIndex, float rd, const float sqrRadius, const Vector3D &queryPosition, Vector3D &queryOffsets, std::vector<Neighbour> &neighbours) const;
+	// counts the points of the subtree with root nodeIndex within sqrRadius, returns true once maxCount is reached
+	bool countRadiusNode(const unsigned int nodeIndex, float rd, const float sqrRadius, const Vector3D &queryPosition, Vector3D &queryOffsets, unsigned int &count, const unsigned int maxCount) const;
+	// squared distance of q to the box lo, hi, with the distance in each dimension in offset
+	inline float computeBoxSqrDistance(const Vector3D &q, const Vector3D &lo, const Vector3D &hi, Vector3D &offset) const;
+};
+
+inline unsigned int FlatKdTree::getNeighbourPositionIndex (const unsigned int neighbourIndex) const {
+	return m_neighbours[neighbourIndex].index;
+}
+
+inline Vector3D const& FlatKdTree::getNeighbourPosition(const unsigned int neighbourIndex) const {
+	return m_positions[m_neighbours[neighbourIndex].index];
+}
+
+inline float const& FlatKdTree::getSquaredDistance (const unsigned int neighbourIndex) const {
+	return m_neighbours[neighbourIndex].weight;
+}
+
+inline unsigned int const& FlatKdTree::getNOfFoundNeighbours() const {
+	return m_nOfFoundNeighbours;
+}
+
+inline unsigned int const& FlatKdTree::getNOfQueryNeighbours() const {
+	return m_nOfNeighbours;
+}
+
+inline unsigned int FlatKdTree::getNOfPositions() const {
+	return m_nOfPositions;
+}
+
+inline unsigned int FlatKdTree::getNOfNodes() const {
+	return (unsigned int)m_nodes.size();
+}
+
+#endif
+
+// Some Emacs-Hints -- please don't remove:
+//
+//  Local Variables:
+//  mode:C++
+//  tab-width:4
+//  End:
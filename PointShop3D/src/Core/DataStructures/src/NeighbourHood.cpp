@@ -28,25 +28,39 @@
 
 #include "NeighbourHood.h"
 
-NeighbourHood::NeighbourHood (const unsigned int bucketSize) {
+NeighbourHood::NeighbourHood (const unsigned int bucketSize, const bool indexOnlyTree) {
+	positions			= 0;
+	nofPositions		= 0;
 	this->bucketSize	= bucketSize;
+	this->indexOnlyTree	= indexOnlyTree;
 	nofNeighbours		= 1;
 	maxSqrDistance		= FLT_MAX;
+	approximationError	= 0.0f;
 	eigenSolver			= new Mgc::Eigen(3);
+	searchStructure		= KD_TREE;
 	
 	kdTree       = 0;
+	uniformGrid  = 0;
+	flatKdTree   = 0;
+	dynamicKdTree = 0;
 }
 
 
-NeighbourHood::NeighbourHood (const Vector3D *positions, const unsigned int nofPositions, const unsigned int bucketSize) {
+NeighbourHood::NeighbourHood (const Vector3D *positions, const unsigned int nofPositions, const unsigned int bucketSize, const bool indexOnlyTree) {
 	this->positions		= positions;
 	this->nofPositions	= nofPositions;
 	this->bucketSize	= bucketSize;
+	this->indexOnlyTree	= indexOnlyTree;
 	nofNeighbours		= 1;
 	maxSqrDistance		= FLT_MAX;
+	approximationError	= 0.0f;
 	eigenSolver			= new Mgc::Eigen(3);
+	searchStructure		= KD_TREE;
 	
 	kdTree       = 0;
+	uniformGrid  = 0;
+	flatKdTree   = 0;
+	dynamicKdTree = 0;
 	this->rebuildKDTree();
 }
 
@@ -55,6 +69,15 @@ NeighbourHood::~NeighbourHood() {
 	if (kdTree != 0) {
 		delete kdTree;
 	}
+	if (uniformGrid != 0) {
+		delete uniformGrid;
+	}
+	if (flatKdTree != 0) {
+		delete flatKdTree;
+	}
+	if (dynamicKdTree != 0) {
+		delete dynamicKdTree;
+	}
 	delete eigenSolver;
 	
 }
@@ -69,13 +92,58 @@ void NeighbourHood::clearMaxQueryDistance() {
 	neighboursUpdated = false;
 }
 
+void NeighbourHood::setApproximationError (const float epsilon) {
+	if (epsilon != approximationError) {
+		approximationError = epsilon;
+		if (kdTree != 0) {
+			kdTree->setApproximationError (approximationError);
+		}
+		neighboursUpdated = false;
+
+		// the neighbour graph was computed with the old error
+		neighbourGraph.offsets.clear();
+		neighbourGraph.indices.clear();
+		neighbourGraph.sqrDistances.clear();
+	}
+}
+
+float NeighbourHood::getApproximationError() const {
+	return approximationError;
+}
+
+void NeighbourHood::setSearchStructure (const SearchStructure newSearchStructure) {
+	if (newSearchStructure != searchStructure) {
+		searchStructure = newSearchStructure;
+		if (kdTree != 0 || uniformGrid != 0 || flatKdTree != 0 || dynamicKdTree != 0) {
+			this->rebuildKDTree();
+		}
+	}
+}
+
+NeighbourHood::SearchStructure NeighbourHood::getSearchStructure() const {
+	return searchStructure;
+}
+
+bool NeighbourHood::isUniformGridUsed() const {
+	return uniformGrid != 0;
+}
+
 unsigned int NeighbourHood::getNofFoundNeighbours() {
 	if (neighboursUpdated == false) {
 		// we have to compute the neighbours first
-		kdTree->queryRange(sourcePoint, maxSqrDistance);
+		this->querySourcePoint();
 		neighboursUpdated = true;
 	}
 
+	if (uniformGrid != 0) {
+		return uniformGrid->getNOfFoundNeighbours();
+	}
+	if (flatKdTree != 0) {
+		return flatKdTree->getNOfFoundNeighbours();
+	}
+	if (dynamicKdTree != 0) {
+		return dynamicKdTree->getNOfFoundNeighbours();
+	}
 	return kdTree->getNOfFoundNeighbours();
 }
 
@@ -87,19 +155,85 @@ void NeighbourHood::setPositions (const Vector3D *newPositions, const unsigned i
 
 }
 
+bool NeighbourHood::setPositions (const Vector3D *newPositions, const unsigned int newNofPositions, const char *snapshotFileName) {
+
+	KdTree *loadedTree = 0;
+	if (searchStructure == KD_TREE) {
+		loadedTree = KdTree::loadSnapshotFile(newPositions, newNofPositions, snapshotFileName, indexOnlyTree);
+	}
+
+	positions       = newPositions;
+	nofPositions    = newNofPositions;
+	this->rebuildKDTree(loadedTree);
+	return loadedTree != 0;
+
+}
+
+bool NeighbourHood::saveSnapshot (const char *fileName) const {
+	return kdTree != 0 && kdTree->saveSnapshot(fileName);
+}
+
+unsigned int NeighbourHood::insertPosition (const Vector3D &position) {
+
+	if (dynamicKdTree == 0) {
+		// the current positions are copied into the dynamic tree
+		searchStructure = DYNAMIC_KD_TREE;
+		this->rebuildKDTree();
+		dynamicKdTree->setNOfNeighbours(nofNeighbours);
+	}
+	unsigned int positionIndex = dynamicKdTree->insertPosition(position);
+	neighboursUpdated = false;
+
+	// the neighbour graph misses the new position
+	neighbourGraph.offsets.clear();
+	neighbourGraph.indices.clear();
+	neighbourGraph.sqrDistances.clear();
+
+	return positionIndex;
+
+}
+
+void NeighbourHood::removePosition (const unsigned int positionIndex) {
+
+	if (dynamicKdTree == 0) {
+		searchStructure = DYNAMIC_KD_TREE;
+		this->rebuildKDTree();
+		dynamicKdTree->setNOfNeighbours(nofNeighbours);
+	}
+	dynamicKdTree->removePosition(positionIndex);
+	neighboursUpdated = false;
+
+	// the neighbour graph still holds the removed position
+	neighbourGraph.offsets.clear();
+	neighbourGraph.indices.clear();
+	neighbourGraph.sqrDistances.clear();
+
+}
+
 const Vector3D *NeighbourHood::getPositions() const {
-	return positions;
+	return dynamicKdTree != 0 ? dynamicKdTree->getPositions() : positions;
 }
 
 unsigned int NeighbourHood::getNofPositions() const {
-	return nofPositions;
+	return dynamicKdTree != 0 ? dynamicKdTree->getNOfIds() : nofPositions;
 }
 
 void NeighbourHood::setNofNeighbours (const unsigned int newNofNeighbours) {
 
 	// allocate new data
 	nofNeighbours    = newNofNeighbours;
-	kdTree->setNOfNeighbours(newNofNeighbours);
+	if (uniformGrid != 0) {
+		uniformGrid->setNOfNeighbours(newNofNeighbours);
+	}
+	else if (flatKdTree != 0) {
+		flatKdTree->setNOfNeighbours(newNofNeighbours);
+	}
+	else if (dynamicKdTree != 0) {
+		dynamicKdTree->setNOfNeighbours(newNofNeighbours);
+	}
+	else {
+		kdTree->setNOfNeighbours(newNofNeighbours);
+	}
 
 	neighboursUpdated = false;
 
@@ -122,10 +256,19 @@ unsigned int NeighbourHood::getNeighbourPositionIndex (const unsigned int neighb
 
 	if (neighboursUpdated == false) {
 		// we have to compute the neighbours first
-		kdTree->queryRange(sourcePoint, maxSqrDistance);
+		this->querySourcePoint();
 		neighboursUpdated = true;
 	}
 
+	if (uniformGrid != 0) {
+		return uniformGrid->getNeighbourPositionIndex(neighbourIndex);
+	}
+	if (flatKdTree != 0) {
+		return flatKdTree->getNeighbourPositionIndex(neighbourIndex);
+	}
+	if (dynamicKdTree != 0) {
+		return dynamicKdTree->getNeighbourPositionIndex(neighbourIndex);
+	}
 	return kdTree->getNeighbourPositionIndex(neighbourIndex);
 	
 }
@@ -135,10 +278,19 @@ Vector3D NeighbourHood::getNeighbourPosition (const unsigned int neighbourIndex)
 
 	if (neighboursUpdated == false) {
 		// we have to compute the neighbours first
-		kdTree->queryRange(sourcePoint, maxSqrDistance);
+		this->querySourcePoint();
 		neighboursUpdated = true;
 	}
 
+	if (uniformGrid != 0) {
+		return uniformGrid->getNeighbourPosition(neighbourIndex);
+	}
+	if (flatKdTree != 0) {
+		return flatKdTree->getNeighbourPosition(neighbourIndex);
+	}
+	if (dynamicKdTree != 0) {
+		return dynamicKdTree->getNeighbourPosition(neighbourIndex);
+	}
 	return kdTree->getNeighbourPosition(neighbourIndex);
 }
 
@@ -148,13 +300,77 @@ float NeighbourHood::getSquaredDistance (const unsigned int neighbourIndex) {
 	if (neighboursUpdated == false) {
 		// we have to compute the neighbours first
 		// we have to compute the neighbours first
-		kdTree->queryRange(sourcePoint, maxSqrDistance);
+		this->querySourcePoint();
 		neighboursUpdated = true;
 	}
 
+	if (uniformGrid != 0) {
+		return uniformGrid->getSquaredDistance(neighbourIndex);
+	}
+	if (flatKdTree != 0) {
+		return flatKdTree->getSquaredDistance(neighbourIndex);
+	}
+	if (dynamicKdTree != 0) {
+		return dynamicKdTree->getSquaredDistance(neighbourIndex);
+	}
 	return kdTree->getSquaredDistance(neighbourIndex);
 }
 
+unsigned int NeighbourHood::queryNeighbours (const Vector3D &queryPoint, KdQueryContext &context) const {
+	if (uniformGrid != 0) {
+		return uniformGrid->queryRange(queryPoint, maxSqrDistance, context);
+	}
+	if (flatKdTree != 0) {
+		return flatKdTree->queryRange(queryPoint, maxSqrDistance, context);
+	}
+	if (dynamicKdTree != 0) {
+		return dynamicKdTree->queryRange(queryPoint, maxSqrDistance, context);
+	}
+	return kdTree->queryRange(queryPoint, maxSqrDistance, context);
+}
+
+unsigned int NeighbourHood::queryRadius (const Vector3D &queryPoint, const float sqrRadius, std::vector<Neighbour> &neighbours) const {
+	if (uniformGrid != 0) {
+		return uniformGrid->queryRadius(queryPoint, sqrRadius, neighbours);
+	}
+	if (flatKdTree != 0) {
+		return flatKdTree->queryRadius(queryPoint, sqrRadius, neighbours);
+	}
+	if (dynamicKdTree != 0) {
+		return dynamicKdTree->queryRadius(queryPoint, sqrRadius, neighbours);
+	}
+	return kdTree->queryRadius(queryPoint, sqrRadius, neighbours);
+}
+
+void NeighbourHood::queryRadius (const Vector3D *queryPoints, const unsigned int nofQueryPoints, const float sqrRadius,
+								 std::vector<unsigned int> &offsets, std::vector<Neighbour> &neighbours) const {
+	if (uniformGrid != 0) {
+		uniformGrid->queryRadius(queryPoints, nofQueryPoints, sqrRadius, offsets, neighbours);
+	}
+	else if (flatKdTree != 0) {
+		flatKdTree->queryRadius(queryPoints, nofQueryPoints, sqrRadius, offsets, neighbours);
+	}
+	else if (dynamicKdTree != 0) {
+		dynamicKdTree->queryRadius(queryPoints, nofQueryPoints, sqrRadius, offsets, neighbours);
+	}
+	else {
+		kdTree->queryRadius(queryPoints, nofQueryPoints, sqrRadius, offsets, neighbours);
+	}
+}
+
+unsigned int NeighbourHood::countNeighboursInRadius (const Vector3D &queryPoint, const float sqrRadius, const unsigned int maxCount) const {
+	if (uniformGrid != 0) {
+		return uniformGrid->countRadius(queryPoint, sqrRadius, maxCount);
+	}
+	if (flatKdTree != 0) {
+		return flatKdTree->countRadius(queryPoint, sqrRadius, maxCount);
+	}
+	if (dynamicKdTree != 0) {
+		return dynamicKdTree->countRadius(queryPoint, sqrRadius, maxCount);
+	}
+	return kdTree->countRadius(queryPoint, sqrRadius, maxCount);
+}
+
 // normal is not consistent!!!
 Vector3D NeighbourHood::computeNormal () {
 
@@ -216,7 +432,7 @@ float NeighbourHood::computeVariation () {
 
 	if (neighboursUpdated == false) {
 		// we have to compute the neighbours first
-		kdTree->queryRange(sourcePoint, maxSqrDistance);
+		this->querySourcePoint();
 		neighboursUpdated = true;
 	}
 
@@ -278,22 +494,98 @@ float NeighbourHood::computeVariation () {
 
 
 
+const NeighbourGraph *NeighbourHood::getNeighbourGraph (const unsigned int nofGraphNeighbours) {
+
+	if (neighbourGraph.offsets.size() == 0 || neighbourGraph.nofNeighbours < nofGraphNeighbours) {
+		if (uniformGrid != 0) {
+			uniformGrid->computeNeighbourGraph (nofGraphNeighbours, neighbourGraph);
+		}
+		else if (flatKdTree != 0) {
+			flatKdTree->computeNeighbourGraph (nofGraphNeighbours, neighbourGraph);
+		}
+		else if (dynamicKdTree != 0) {
+			dynamicKdTree->computeNeighbourGraph (nofGraphNeighbours, neighbourGraph);
+		}
+		else {
+			kdTree->computeNeighbourGraph (nofGraphNeighbours, neighbourGraph);
+		}
+	}
+
+	return &neighbourGraph;
+}
+
+
+
 // ***************
 // private methods
 // ***************
 
-void NeighbourHood::rebuildKDTree() {
+void NeighbourHood::rebuildKDTree(KdTree *loadedTree) {
 
 	// delete the old KDTree and its point array, if necessary
 	if (kdTree != 0) {
 		delete kdTree;
+		kdTree = 0;
+	}
+	if (uniformGrid != 0) {
+		delete uniformGrid;
+		uniformGrid = 0;
+	}
+	if (flatKdTree != 0) {
+		delete flatKdTree;
+		flatKdTree = 0;
+	}
+	if (dynamicKdTree != 0) {
+		delete dynamicKdTree;
+		dynamicKdTree = 0;
 	}
 
 	// build search structure
 
-	kdTree = new KdTree(positions, nofPositions, bucketSize);
+	if (loadedTree != 0) {
+		kdTree = loadedTree;
+		kdTree->setApproximationError (approximationError);
+	}
+	else if (searchStructure == FLAT_KD_TREE) {
+		flatKdTree = new FlatKdTree(positions, nofPositions, bucketSize);
+	}
+	else if (searchStructure == DYNAMIC_KD_TREE) {
+		dynamicKdTree = new DynamicKdTree(positions, nofPositions, bucketSize);
+	}
+	else if (searchStructure != KD_TREE) {
+		// the grid is built in linear time, so it is cheap to try it
+		uniformGrid = new UniformGrid(positions, nofPositions);
+		if (searchStructure == AUTOMATIC_SEARCH && uniformGrid->getOverfullFraction() > NEIGHBOURHOOD_MAX_OVERFULL_FRACTION) {
+			delete uniformGrid;
+			uniformGrid = 0;
+		}
+	}
+	if (uniformGrid == 0 && flatKdTree == 0 && dynamicKdTree == 0 && kdTree == 0) {
+		kdTree = new KdTree(positions, nofPositions, bucketSize, indexOnlyTree);
+		kdTree->setApproximationError (approximationError);
+	}
 	neighboursUpdated = false;	
 
+	// the neighbour graph belongs to the old positions
+	neighbourGraph.offsets.clear();
+	neighbourGraph.indices.clear();
+	neighbourGraph.sqrDistances.clear();
+
+}
+
+void NeighbourHood::querySourcePoint() {
+	if (uniformGrid != 0) {
+		uniformGrid->queryRange(sourcePoint, maxSqrDistance);
+	}
+	else if (flatKdTree != 0) {
+		flatKdTree->queryRange(sourcePoint, maxSqrDistance);
+	}
+	else if (dynamicKdTree != 0) {
+		dynamicKdTree->queryRange(sourcePoint, maxSqrDistance);
+	}
+	else {
+		kdTree->queryRange(sourcePoint, maxSqrDistance);
+	}
 }
 
 // Some Emacs-Hints -- please don't remove:
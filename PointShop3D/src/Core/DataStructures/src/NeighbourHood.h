@@ -37,6 +37,12 @@
 #include "../../../Utilities/MagicSoft/MgcEigen.h"
 
 #include "kdTree.h"
+#include "UniformGrid.h"
+#include "FlatKdTree.h"
+#include "DynamicKdTree.h"
+
+// with AUTOMATIC_SEARCH, the points are evenly sampled if at most this fraction lies in overfull grid cells
+#define NEIGHBOURHOOD_MAX_OVERFULL_FRACTION 0.05f
 
 /**
  * This data structure allows to query the n-th nearest neighbours to a given
@@ -48,16 +54,29 @@
 class NeighbourHood {
 
 public:
+	/**
+	 * the search structures for the neighbour queries
+	 */
+	typedef enum searchStructure {
+		KD_TREE          = 0,	// a k-d tree, for any distribution of the points
+		UNIFORM_GRID     = 1,	// a uniform grid, for evenly sampled points
+		AUTOMATIC_SEARCH = 2,	// a uniform grid if the points turn out to be evenly sampled, else a k-d tree
+		FLAT_KD_TREE     = 3,	// a k-d tree with a pointer free layout, see FlatKdTree
+		DYNAMIC_KD_TREE  = 4	// a forest of k-d trees which supports insertPosition and removePosition, see DynamicKdTree
+	} SearchStructure;
+
 	/**
 	 * Creates this <code>NeighbourHood</code> structure. The k-d tree is created not only before
 	 * the <code>setPositions</code> method is called.
 	 *
 	 * @param bucketSize
 	 *		  maximum number of elements in a bucket
+	 * @param indexOnlyTree
+	 *		  if true, the k-d tree does not copy the positions, see <code>KdTree::KdTree</code>
 	 * @see #setPositions
 	 *
 	 */
-	NeighbourHood (const unsigned int bucketSize = 10);
+	NeighbourHood (const unsigned int bucketSize = 10, const bool indexOnlyTree = false);
 	/**
 	 * Creates this <code>NeighbourHood</code> structure, based on the <code>positions</code> array
 	 * which contains <code>nofPositions</code> positions. The <code>positions</code> must be
@@ -69,8 +88,10 @@ public:
 	 *        the number of elements in the <code>Vector3D</code> array
 	 * @param bucketSize
 	 *		  maximum number of elements in a bucket
+	 * @param indexOnlyTree
+	 *		  if true, the k-d tree does not copy the positions, see <code>KdTree::KdTree</code>
 	 */
-	NeighbourHood (const Vector3D *positions, const unsigned int nofPositions, const unsigned int bucketSize = 10);
+	NeighbourHood (const Vector3D *positions, const unsigned int nofPositions, const unsigned int bucketSize = 10, const bool indexOnlyTree = false);
 
 	/**
 	 * Destroys this <code>NeighbourHood</code>. The <code>positions</code> are <em>not</em> <code>delete</code>d. 
@@ -96,6 +117,45 @@ public:
 	 */
 	void clearMaxQueryDistance();
 
+	/**
+	 * sets the allowed error of the neighbour queries and of the neighbour graph: the distance of 
+	 * the i-th found neighbour is at most (1+<code>epsilon</code>) times the distance of the true 
+	 * i-th nearest neighbour. With 0, the default, the neighbours are exact. The radius queries
+	 * are always exact.
+	 *
+	 * @param epsilon
+	 *			the allowed relative error of the neighbour distances
+	 * @see KdTree#setApproximationError
+	 */
+	void setApproximationError (const float epsilon);
+	/**
+	 * @return the allowed relative error of the neighbour distances
+	 * @see #setApproximationError
+	 */
+	float getApproximationError() const;
+
+	/**
+	 * sets the search structure for the neighbour queries, the default is <code>KD_TREE</code>.
+	 * The approximation error, the index only option and the snapshots only apply to
+	 * <code>KD_TREE</code>. Set the search structure before the positions, otherwise the search 
+	 * structure is built again.
+	 *
+	 * @param newSearchStructure
+	 *			the search structure
+	 * @see UniformGrid
+	 * @see FlatKdTree
+	 * @see DynamicKdTree
+	 */
+	void setSearchStructure (const SearchStructure newSearchStructure);
+	/**
+	 * @return the search structure set with <code>setSearchStructure</code>
+	 */
+	SearchStructure getSearchStructure() const;
+	/**
+	 * @return true, if the neighbours are looked up in a uniform grid, also with <code>AUTOMATIC_SEARCH</code>
+	 */
+	bool isUniformGridUsed() const;
+
 	/**
 	 * Sets the <code>newPositions</code> for which the neighbourhood has to be calculated.
 	 *
@@ -107,7 +167,61 @@ public:
 	void setPositions (const Vector3D *newPositions, const unsigned int nofPositions);
 
 	/**
-	 * Returns the points for which the neighbourhood is to be calculated.
+	 * Sets the <code>newPositions</code> like <code>setPositions</code>, but takes the k-d tree
+	 * from a snapshot file if the snapshot has been saved for the same positions, see
+	 * <code>KdTree::loadSnapshot</code>. Otherwise, and if the search structure is not
+	 * <code>KD_TREE</code>, the search structure is built as usual.
+	 *
+	 * @param newPositions
+	 *        a pointer to a <code>Vector3D</code> array
+	 * @param nofPositions
+	 *        the number of points in <code>newPositions</code>
+	 * @param snapshotFileName
+	 *        the snapshot file of the k-d tree
+	 * @return true, if the k-d tree has been loaded from the snapshot
+	 * @see #saveSnapshot
+	 */
+	bool setPositions (const Vector3D *newPositions, const unsigned int nofPositions, const char *snapshotFileName);
+
+	/**
+	 * Inserts a single position without rebuilding the search structure. The search structure
+	 * is switched to <code>DYNAMIC_KD_TREE</code> first if necessary, which copies the current
+	 * positions. The neighbour graph is computed again when it is requested the next time.
+	 * <code>setPositions</code> and <code>setSearchStructure</code> start again from the positions
+	 * which were set, without the inserted and removed ones.
+	 *
+	 * @param position
+	 *        the position to insert
+	 * @return the index of the inserted position, the first one is <code>getNofPositions()</code>
+	 * @see DynamicKdTree#insertPosition
+	 */
+	unsigned int insertPosition (const Vector3D &position);
+
+	/**
+	 * Removes a single position, which is not found by any query afterwards, see
+	 * <code>insertPosition</code>. The indices of the other positions do not change.
+	 *
+	 * @param positionIndex
+	 *        the index of the position
+	 * @see DynamicKdTree#removePosition
+	 */
+	void removePosition (const unsigned int positionIndex);
+
+	/**
+	 * Saves the k-d tree as a snapshot file, which can be used by <code>setPositions</code>
+	 * as long as the positions do not change.
+	 *
+	 * @param fileName
+	 *        the snapshot file
+	 * @return true, if the file has been written, false if it could not be written or if
+	 *         no k-d tree is used
+	 */
+	bool saveSnapshot (const char *fileName) const;
+
+	/**
+	 * Returns the points for which the neighbourhood is to be calculated. With <code>DYNAMIC_KD_TREE</code>
+	 * these are the positions by index of the <code>DynamicKdTree</code>, including the inserted and
+	 * the removed ones; the array moves when a position is inserted.
 	 *
 	 * @return a pointer to an array of <code>Vector3D</code> points
 	 * @see #getNofPositions
@@ -115,7 +229,7 @@ public:
 	const Vector3D *getPositions() const;
 
 	/**
-	 * Returns the number of points.
+	 * Returns the number of points, with <code>DYNAMIC_KD_TREE</code> including the removed ones.
 	 *
 	 * @return the number of points
 	 * @see #getPositions
@@ -209,6 +323,68 @@ public:
 	 * @see #getNofNeighbours
 	 */
 	float getSquaredDistance (const unsigned int neighbourIndex);
+
+	/**
+	 * Looks for the neighbours of <code>queryPoint</code> without using or changing the source point
+	 * and the number of neighbours of this <code>NeighbourHood</code>, hence several threads can query
+	 * the same <code>NeighbourHood</code> at the same time. The maximum query distance is respected.
+	 *
+	 * @param queryPoint
+	 *        a <code>Vector3D</code> point for which the neighbours are to be calculated
+	 * @param context
+	 *        a caller owned query context, each thread needs its own; the size of its queue
+	 *        is the number of neighbours which are to be calculated
+	 * @return the number of found neighbours, which are stored in <code>context.neighbours</code>
+	 * @see #setMaxQuerySqrDistance
+	 */
+	unsigned int queryNeighbours (const Vector3D &queryPoint, KdQueryContext &context) const;
+
+	/**
+	 * Looks for all points with a squared distance of at most <code>sqrRadius</code> to <code>queryPoint</code>,
+	 * independent of the number of neighbours and the maximum query distance. The query state of this 
+	 * <code>NeighbourHood</code> is neither used nor changed.
+	 *
+	 * @param queryPoint
+	 *        a <code>Vector3D</code> point for which the neighbours are to be calculated
+	 * @param sqrRadius
+	 *        the squared search radius
+	 * @param neighbours
+	 *        the position indices and squared distances of the found points are appended, in no particular order
+	 * @return the number of found points
+	 */
+	unsigned int queryRadius (const Vector3D &queryPoint, const float sqrRadius, std::vector<Neighbour> &neighbours) const;
+
+	/**
+	 * Looks for the points within <code>sqrRadius</code> of each of the <code>queryPoints</code>, see 
+	 * <code>KdTree::queryRadius</code> for the layout of the results.
+	 *
+	 * @param queryPoints
+	 *        the points for which the neighbours are to be calculated
+	 * @param nofQueryPoints
+	 *        the number of <code>queryPoints</code>
+	 * @param sqrRadius
+	 *        the squared search radius
+	 * @param offsets
+	 *        the end of the neighbours of each query point is appended
+	 * @param neighbours
+	 *        the found points of all query points are appended
+	 */
+	void queryRadius (const Vector3D *queryPoints, const unsigned int nofQueryPoints, const float sqrRadius,
+		              std::vector<unsigned int> &offsets, std::vector<Neighbour> &neighbours) const;
+
+	/**
+	 * Counts the points within <code>sqrRadius</code> of <code>queryPoint</code>, stopping as soon as
+	 * <code>maxCount</code> points are found.
+	 *
+	 * @param queryPoint
+	 *        the point for which the neighbours are to be counted
+	 * @param sqrRadius
+	 *        the squared search radius
+	 * @param maxCount
+	 *        the count at which the search stops
+	 * @return the number of points within the radius, at most <code>maxCount</code>
+	 */
+	unsigned int countNeighboursInRadius (const Vector3D &queryPoint, const float sqrRadius, const unsigned int maxCount) const;
 	
 	/**
 	 * computes an approximation of the normal vector at the source point using PCA.
@@ -234,6 +410,23 @@ public:
 	 */
 	float computeVariation ();
 
+	/**
+	 * Returns the nearest neighbours of all points at once. The neighbours are computed in parallel
+	 * the first time they are requested and are kept until new positions are set, so all consumers 
+	 * of the same point set share them. If a graph with more neighbours has already been computed, 
+	 * it is returned instead; the first <code>nofGraphNeighbours</code> entries of each row are the
+	 * requested neighbours then.
+	 *
+	 * <b>Note:</b> The query state of this <code>NeighbourHood</code> (source point, number of
+	 *              neighbours, maximum query distance) is neither used nor changed.
+	 *
+	 * @param nofGraphNeighbours
+	 *        the minimum number of neighbours per point, the point itself is its own neighbour 0
+	 * @return the neighbour graph; must <em>not</em> be <code>delete</code>d
+	 * @see #setPositions
+	 */
+	const NeighbourGraph *getNeighbourGraph (const unsigned int nofGraphNeighbours);
+
 private:
 	
 	const Vector3D    *positions;
@@ -241,14 +434,24 @@ private:
 	unsigned int	  nofPositions,
 		              nofNeighbours,
 					  bucketSize;
-	float			  maxSqrDistance;					  
+	float			  maxSqrDistance,
+					  approximationError;	// allowed relative error of the neighbour distances
 	
-	bool              neighboursUpdated;
+	bool              neighboursUpdated,
+					  indexOnlyTree;		// the k-d tree only keeps the position indices
 	Mgc::Eigen		  *eigenSolver;
+	SearchStructure   searchStructure;
 	KdTree*			  kdTree;
+	UniformGrid*	  uniformGrid;		// used instead of the kdTree if not 0
+	FlatKdTree*		  flatKdTree;		// used instead of the kdTree if not 0
+	DynamicKdTree*	  dynamicKdTree;	// used instead of the kdTree if not 0
+	NeighbourGraph    neighbourGraph;	// the neighbours of all points, computed on demand
 
-	// rebuilds the KDTree - call this as soon as a new 'positions' array has been set
-	void rebuildKDTree();
+	// rebuilds the KDTree, the uniform grid, the flat or the dynamic k-d tree - call this as soon as a new 'positions' array has been set,
+	// loadedTree is used instead of building a k-d tree if it is not 0
+	void rebuildKDTree(KdTree *loadedTree = 0);
+	// looks for the neighbours of the source point
+	void querySourcePoint();
 	
 };
 
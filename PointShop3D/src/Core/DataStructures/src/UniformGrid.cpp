@@ -0,0 +1,573 @@
+// Title:   UniformGrid.cpp
+//
+// This file is part of the Pointshop3D system.
+// See http://www.pointshop3d.com/ for more information.
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program; if not, write to the Free
+// Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+// MA 02111-1307, USA.
+//
+// Contact info@pointshop3d.com if any conditions of this
+// licensing are not clear to you.
+//
+
+#include "UniformGrid.h"
+#include <float.h>
+#include <math.h>
+
+
+// ******************
+// global definitions
+// ******************
+
+UniformGrid::UniformGrid(const Vector3D *positions, const unsigned int nOfPositions, const float pointsPerCell) {
+	m_positions				= positions;
+	m_nOfPositions			= nOfPositions;
+	m_points				= 0;
+	m_cellSize				= 1.0f;
+	m_invCellSize			= 1.0f;
+	m_overfullFraction		= 0.0f;
+	m_hashBits				= 0;
+	m_nOfFoundNeighbours	= 0;
+	m_nOfNeighbours			= 0;
+	m_queryContext.neighbours = 0;
+	m_nOfCellsPerAxis[0] = m_nOfCellsPerAxis[1] = m_nOfCellsPerAxis[2] = 1;
+	setNOfNeighbours(1);
+	if (nOfPositions == 0) {
+		return;
+	}
+
+	unsigned int i;
+	int d;
+	Vector3D maximum = positions[0],
+			 minimum = positions[0];
+	for (i=1; i<nOfPositions; i++) {
+		for (d=0; d<3; d++) {
+			if (positions[i][d] < minimum[d]) {
+				minimum[d] = positions[i][d];
+			}
+			else if (positions[i][d] > maximum[d]) {
+				maximum[d] = positions[i][d];
+			}
+		}
+	}
+	float extent = 0.0f;
+	for (d=0; d<3; d++) {
+		if (maximum[d] - minimum[d] > extent) {
+			extent = maximum[d] - minimum[d];
+		}
+	}
+	if (extent <= 0.0f) {
+		extent = 1.0f;
+	}
+	float target = pointsPerCell > 1.0f ? pointsPerCell : 1.0f,
+		  minCellSize = extent / (UNIFORMGRID_MAX_CELLS_PER_AXIS - 1);
+
+	// the first guess assumes that the points fill a cube, the next ones that they lie on a surface,
+	// where the number of occupied cells grows with the square of the inverse cell size
+	std::vector<unsigned int> cells(nOfPositions);
+	float cellSize = extent * (float)pow(target / nOfPositions, 1.0 / 3.0),
+		  mean;
+	for (int iteration=0; ; iteration++) {
+		if (cellSize < minCellSize) {
+			cellSize = minCellSize;
+		}
+		hashPoints(cellSize, minimum, maximum, cells);
+		mean = (float)nOfPositions / m_cellStarts.size();
+		if ((mean > 0.5f * target && mean < 2.0f * target) || iteration == 3) {
+			break;
+		}
+		cellSize *= (float)sqrt(target / mean);
+	}
+	// sort the points by cell
+	unsigned int nofCells = (unsigned int)m_cellStarts.size(),
+				 nofOverfull = 0,
+				 start = 0;
+	for (i=0; i<nofCells; i++) {
+		unsigned int count = m_cellStarts[i];
+		if (count > UNIFORMGRID_OVERFULL_FACTOR * mean) {
+			nofOverfull += count;
+		}
+		m_cellStarts[i] = start;
+		start += count;
+	}
+	m_cellStarts.push_back(start);
+	resizeHashTable(nofCells);
+	m_overfullFraction = (float)nofOverfull / nOfPositions;
+
+	std::vector<unsigned int> next(m_cellStarts.begin(), m_cellStarts.end() - 1);
+	m_points = new KdTreePoint[nOfPositions];
+	for (i=0; i<nOfPositions; i++) {
+		KdTreePoint &point = m_points[next[cells[i]]++];
+		point.pos = positions[i];
+		point.index = i;
+	}
+}
+
+UniformGrid::~UniformGrid() {
+	delete[] m_points;
+}
+
+void UniformGrid::queryPosition(const Vector3D &position) {
+	if (m_neighbours.size() == 0) {
+		return;
+	}
+	m_nOfFoundNeighbours = queryRange(position, FLT_MAX, m_queryContext);
+}
+
+void UniformGrid::queryRange(const Vector3D &position, const float maxSqrDistance) {
+	if (m_neighbours.size() == 0) {
+		return;
+	}
+	m_nOfFoundNeighbours = queryRange(position, maxSqrDistance, m_queryContext);
+}
+
+unsigned int UniformGrid::queryPosition(const Vector3D &position, KdQueryContext &context) const {
+	return queryRange(position, FLT_MAX, context);
+}
+
+unsigned int UniformGrid::queryRange(const Vector3D &position, const float maxSqrDistance, KdQueryContext &context) const {
+	if (m_nOfPositions == 0) {
+		return 0;
+	}
+
+	PQueue *queue = &context.queue;
+	int center[3],
+		low[3],
+		high[3];
+	int d;
+
+	queue->init();
+	queue->insert(-1, maxSqrDistance);
+
+	getCellCoordinates(position, center);
+	for (int ring=0; ; ring++) {
+		// the distance to the faces of the ring which have cells beyond them
+		float reach = FLT_MAX;
+		for (d=0; d<3; d++) {
+			low[d] = center[d] - ring;
+			high[d] = center[d] + ring;
+			if (low[d] > 0) {
+				float t = position[d] - (m_origin[d] + low[d] * m_cellSize);
+				if (t < reach) {
+					reach = t;
+				}
+			}
+			if (high[d] < m_nOfCellsPerAxis[d] - 1) {
+				float t = m_origin[d] + (high[d] + 1) * m_cellSize - position[d];
+				if (t < reach) {
+					reach = t;
+				}
+			}
+		}
+
+		// visit the cells on the surface of the ring
+		int x0 = low[0] > 0 ? low[0] : 0, x1 = high[0] < m_nOfCellsPerAxis[0] ? high[0] : m_nOfCellsPerAxis[0] - 1,
+			y0 = low[1] > 0 ? low[1] : 0, y1 = high[1] < m_nOfCellsPerAxis[1] ? high[1] : m_nOfCellsPerAxis[1] - 1,
+			z0 = low[2] > 0 ? low[2] : 0, z1 = high[2] < m_nOfCellsPerAxis[2] ? high[2] : m_nOfCellsPerAxis[2] - 1;
+		for (int x=x0; x<=x1; x++) {
+			for (int y=y0; y<=y1; y++) {
+				if (x == low[0] || x == high[0] || y == low[1] || y == high[1]) {
+					for (int z=z0; z<=z1; z++) {
+						queryCell(position, x, y, z, queue);
+					}
+				}
+				else {
+					if (low[2] >= 0) {
+						queryCell(position, x, y, low[2], queue);
+					}
+					if (high[2] < m_nOfCellsPerAxis[2]) {
+						queryCell(position, x, y, high[2], queue);
+					}
+				}
+			}
+		}
+
+		// all points outside the ring are farther away than reach
+		if (reach == FLT_MAX || (reach > 0.0f && reach * reach >= queue->getMaxWeight())) {
+			break;
+		}
+	}
+
+	if (queue->getMax().index == -1) {
+		queue->removeMax();
+	}
+
+	unsigned int nOfFoundNeighbours = queue->getNofElements();
+
+	for(int i=nOfFoundNeighbours-1; i>=0; i--) {
+		context.neighbours[i] = queue->getMax();
+		queue->removeMax();
+	}
+
+	return nOfFoundNeighbours;
+}
+
+unsigned int UniformGrid::queryRadius(const Vector3D &position, const float sqrRadius, std::vector<Neighbour> &neighbours) const {
+	if (m_nOfPositions == 0) {
+		return 0;
+	}
+
+	size_t nofNeighbours = neighbours.size();
+	float radius = (float)sqrt(sqrRadius);
+	int low[3],
+		high[3];
+	getCellCoordinates(Vector3D(position[0] - radius, position[1] - radius, position[2] - radius), low);
+	getCellCoordinates(Vector3D(position[0] + radius, position[1] + radius, position[2] + radius), high);
+
+	Neighbour neighbour;
+	for (int x=low[0]; x<=high[0]; x++) {
+		for (int y=low[1]; y<=high[1]; y++) {
+			for (int z=low[2]; z<=high[2]; z++) {
+				if (computeCellSqrDistance(position, x, y, z) > sqrRadius) {
+					continue;
+				}
+				int cell = findCell(getKey(x, y, z));
+				if (cell < 0) {
+					continue;
+				}
+				for (unsigned int i=m_cellStarts[cell]; i<m_cellStarts[cell+1]; i++) {
+					neighbour.weight = (m_points[i].pos - position).getSquaredLength();
+					if (neighbour.weight <= sqrRadius) {
+						neighbour.index = m_points[i].index;
+						neighbours.push_back(neighbour);
+					}
+				}
+			}
+		}
+	}
+
+	return (unsigned int)(neighbours.size() - nofNeighbours);
+}
+
+void UniformGrid::queryRadius(const Vector3D *positions, const unsigned int nofPositions, const float sqrRadius, std::vector<unsigned int> &offsets, std::vector<Neighbour> &neighbours) const {
+	if (offsets.size() == 0) {
+		offsets.push_back((unsigned int)neighbours.size());
+	}
+	for (unsigned int i=0; i<nofPositions; i++) {
+		queryRadius(positions[i], sqrRadius, neighbours);
+		offsets.push_back((unsigned int)neighbours.size());
+	}
+}
+
+unsigned int UniformGrid::countRadius(const Vector3D &position, const float sqrRadius, const unsigned int maxCount) const {
+	if (m_nOfPositions == 0 || maxCount == 0) {
+		return 0;
+	}
+
+	unsigned int count = 0;
+	float radius = (float)sqrt(sqrRadius);
+	int low[3],
+		high[3];
+	getCellCoordinates(Vector3D(position[0] - radius, position[1] - radius, position[2] - radius), low);
+	getCellCoordinates(Vector3D(position[0] + radius, position[1] + radius, position[2] + radius), high);
+
+	for (int x=low[0]; x<=high[0]; x++) {
+		for (int y=low[1]; y<=high[1]; y++) {
+			for (int z=low[2]; z<=high[2]; z++) {
+				if (computeCellSqrDistance(position, x, y, z) > sqrRadius) {
+					continue;
+				}
+				int cell = findCell(getKey(x, y, z));
+				if (cell < 0) {
+					continue;
+				}
+				for (unsigned int i=m_cellStarts[cell]; i<m_cellStarts[cell+1]; i++) {
+					if ((m_points[i].pos - position).getSquaredLength() <= sqrRadius) {
+						count++;
+						if (count >= maxCount) {
+							return count;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	return count;
+}
+
+void UniformGrid::computeNeighbourGraph(const unsigned int nofNeighbours, NeighbourGraph &graph) const {
+	// every query finds the same number of neighbours, unless there are fewer points
+	unsigned int nofFound = (nofNeighbours < m_nOfPositions) ? nofNeighbours : m_nOfPositions;
+	int nofCells = (int)getNOfCells();
+	int i;
+
+	graph.nofNeighbours = nofNeighbours;
+	graph.offsets.resize(m_nOfPositions + 1);
+	graph.indices.resize(m_nOfPositions * nofFound);
+	graph.sqrDistances.resize(m_nOfPositions * nofFound);
+	for (i=0; i<=(int)m_nOfPositions; i++) {
+		graph.offsets[i] = i * nofFound;
+	}
+	if (nofFound == 0) {
+		return;
+	}
+
+	#pragma omp parallel
+	{
+		KdQueryContext context;
+		std::vector<Neighbour> neighbours(nofFound);
+		context.queue.setSize(nofFound);
+		context.neighbours = &neighbours[0];
+		std::vector<float> x, y, z, sqrDistances;
+		std::vector<int> indices;
+
+		// the points of a cell share the candidates of the 3x3x3 cells around it
+		#pragma omp for schedule(dynamic, 64)
+		for (i=0; i<nofCells; i++) {
+			int center[3];
+			getCellCoordinates(m_points[m_cellStarts[i]].pos, center);
+			x.clear();
+			y.clear();
+			z.clear();
+			indices.clear();
+			for (int cx=center[0]-1; cx<=center[0]+1; cx++) {
+				for (int cy=center[1]-1; cy<=center[1]+1; cy++) {
+					for (int cz=center[2]-1; cz<=center[2]+1; cz++) {
+						if (cx < 0 || cy < 0 || cz < 0 || cx >= m_nOfCellsPerAxis[0] || cy >= m_nOfCellsPerAxis[1] || cz >= m_nOfCellsPerAxis[2]) {
+							continue;
+						}
+						int cell = findCell(getKey(cx, cy, cz));
+						if (cell < 0) {
+							continue;
+						}
+						for (unsigned int j=m_cellStarts[cell]; j<m_cellStarts[cell+1]; j++) {
+							x.push_back(m_points[j].pos[0]);
+							y.push_back(m_points[j].pos[1]);
+							z.push_back(m_points[j].pos[2]);
+							indices.push_back(m_points[j].index);
+						}
+					}
+				}
+			}
+			unsigned int nofCandidates = (unsigned int)indices.size();
+			sqrDistances.resize(nofCandidates);
+
+			for (unsigned int j=m_cellStarts[i]; j<m_cellStarts[i+1]; j++) {
+				const Vector3D &position = m_points[j].pos;
+				float qx = position[0],
+					  qy = position[1],
+					  qz = position[2];
+				// no dependencies between the candidates, so this loop vectorizes
+				for (unsigned int k=0; k<nofCandidates; k++) {
+					float dx = x[k] - qx,
+						  dy = y[k] - qy,
+						  dz = z[k] - qz;
+					sqrDistances[k] = dx*dx + dy*dy + dz*dz;
+				}
+				PQueue *queue = &context.queue;
+				queue->init();
+				queue->insert(-1, FLT_MAX);
+				for (unsigned int k=0; k<nofCandidates; k++) {
+					if (sqrDistances[k] < queue->getMaxWeight()) {
+						queue->insert(indices[k], sqrDistances[k]);
+					}
+				}
+
+				// the candidates are complete if no point beyond the 3x3x3 cells can be closer
+				float reach = FLT_MAX;
+				for (int d=0; d<3; d++) {
+					if (center[d] > 1) {
+						float t = position[d] - (m_origin[d] + (center[d] - 1) * m_cellSize);
+						if (t < reach) {
+							reach = t;
+						}
+					}
+					if (center[d] < m_nOfCellsPerAxis[d] - 2) {
+						float t = m_origin[d] + (center[d] + 2) * m_cellSize - position[d];
+						if (t < reach) {
+							reach = t;
+						}
+					}
+				}
+				unsigned int n;
+				if (reach == FLT_MAX || reach * reach >= queue->getMaxWeight()) {
+					if (queue->getMax().index == -1) {
+						queue->removeMax();
+					}
+					n = queue->getNofElements();
+					for (int k=n-1; k>=0; k--) {
+						neighbours[k] = queue->getMax();
+						queue->removeMax();
+					}
+				}
+				else {
+					n = queryPosition(position, context);
+				}
+
+				unsigned int offset = graph.offsets[m_points[j].index];
+				for (unsigned int k=0; k<n; k++) {
+					graph.indices[offset + k] = neighbours[k].index;
+					graph.sqrDistances[offset + k] = neighbours[k].weight;
+				}
+			}
+		}
+	}
+}
+
+void UniformGrid::setNOfNeighbours (const unsigned int newNOfNeighbours) {
+	if (newNOfNeighbours != m_nOfNeighbours) {
+		m_nOfNeighbours = newNOfNeighbours;
+		m_queryContext.queue.setSize(m_nOfNeighbours);
+		m_neighbours.resize(m_nOfNeighbours);
+		m_queryContext.neighbours = m_nOfNeighbours > 0 ? &m_neighbours[0] : 0;
+		m_nOfFoundNeighbours = 0;
+	}
+}
+
+// ***************
+// private methods
+// ***************
+
+void UniformGrid::hashPoints(const float cellSize, const Vector3D &minimum, const Vector3D &maximum, std::vector<unsigned int> &cells) {
+	double nofGridCells = 1.0;
+	int cell[3];
+
+	m_cellSize = cellSize;
+	m_invCellSize = 1.0f / cellSize;
+	m_origin = minimum;
+	for (int d=0; d<3; d++) {
+		double n = floor((maximum[d] - minimum[d]) * m_invCellSize) + 1.0;
+		m_nOfCellsPerAxis[d] = n < UNIFORMGRID_MAX_CELLS_PER_AXIS ? (int)n : UNIFORMGRID_MAX_CELLS_PER_AXIS;
+		nofGridCells *= m_nOfCellsPerAxis[d];
+	}
+
+	m_cellStarts.clear();
+	m_hashKeys.clear();
+	resizeHashTable(nofGridCells < m_nOfPositions ? (size_t)nofGridCells : m_nOfPositions);
+	for (unsigned int i=0; i<m_nOfPositions; i++) {
+		getCellCoordinates(m_positions[i], cell);
+		cells[i] = insertCell(getKey(cell[0], cell[1], cell[2]));
+		m_cellStarts[cells[i]]++;
+	}
+}
+
+void UniformGrid::resizeHashTable(const size_t nofCells) {
+	std::vector<unsigned long long> keys;
+	std::vector<unsigned int> hashCells;
+	size_t slot;
+
+	keys.swap(m_hashKeys);
+	hashCells.swap(m_hashCells);
+	m_hashBits = 1;
+	while (((size_t)1 << m_hashBits) < 2 * nofCells) {
+		m_hashBits++;
+	}
+	m_hashKeys.assign((size_t)1 << m_hashBits, 0);
+	m_hashCells.resize((size_t)1 << m_hashBits);
+
+	size_t mask = m_hashKeys.size() - 1;
+	for (size_t i=0; i<keys.size(); i++) {
+		if (keys[i] != 0) {
+			slot = (size_t)(((keys[i] - 1) * 0x9E3779B97F4A7C15ULL) >> (64 - m_hashBits));
+			while (m_hashKeys[slot] != 0) {
+				slot = (slot + 1) & mask;
+			}
+			m_hashKeys[slot] = keys[i];
+			m_hashCells[slot] = hashCells[i];
+		}
+	}
+}
+
+inline unsigned int UniformGrid::insertCell(const unsigned long long key) {
+	size_t mask = m_hashKeys.size() - 1;
+	size_t slot = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - m_hashBits));
+
+	while (m_hashKeys[slot] != 0) {
+		if (m_hashKeys[slot] == key + 1) {
+			return m_hashCells[slot];
+		}
+		slot = (slot + 1) & mask;
+	}
+	m_hashKeys[slot] = key + 1;
+	m_hashCells[slot] = (unsigned int)m_cellStarts.size();
+	m_cellStarts.push_back(0);
+	return m_hashCells[slot];
+}
+
+inline int UniformGrid::findCell(const unsigned long long key) const {
+	size_t mask = m_hashKeys.size() - 1;
+	size_t slot = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - m_hashBits));
+
+	while (m_hashKeys[slot] != 0) {
+		if (m_hashKeys[slot] == key + 1) {
+			return (int)m_hashCells[slot];
+		}
+		slot = (slot + 1) & mask;
+	}
+	return -1;
+}
+
+inline void UniformGrid::getCellCoordinates(const Vector3D &position, int *cell) const {
+	for (int d=0; d<3; d++) {
+		float c = (position[d] - m_origin[d]) * m_invCellSize;
+		if (c <= 0.0f) {
+			cell[d] = 0;
+		}
+		else if (c >= m_nOfCellsPerAxis[d] - 1) {
+			cell[d] = m_nOfCellsPerAxis[d] - 1;
+		}
+		else {
+			cell[d] = (int)c;
+		}
+	}
+}
+
+inline unsigned long long UniformGrid::getKey(const int x, const int y, const int z) const {
+	return ((unsigned long long)x << 42) | ((unsigned long long)y << 21) | (unsigned long long)z;
+}
+
+inline float UniformGrid::computeCellSqrDistance(const Vector3D &q, const int x, const int y, const int z) const {
+	int cell[3] = {x, y, z};
+	float dist = 0.0f;
+	float t;
+
+	for (int d=0; d<3; d++) {
+		float lo = m_origin[d] + cell[d] * m_cellSize;
+		if (q[d] < lo) {
+			t = lo - q[d];
+			dist += t*t;
+		}
+		else if (q[d] > lo + m_cellSize) {
+			t = q[d] - lo - m_cellSize;
+			dist += t*t;
+		}
+	}
+
+	return dist;
+}
+
+inline void UniformGrid::queryCell(const Vector3D &position, const int x, const int y, const int z, PQueue *queue) const {
+	if (computeCellSqrDistance(position, x, y, z) >= queue->getMaxWeight()) {
+		return;
+	}
+	int cell = findCell(getKey(x, y, z));
+	if (cell < 0) {
+		return;
+	}
+	for (unsigned int i=m_cellStarts[cell]; i<m_cellStarts[cell+1]; i++) {
+		float sqrDist = (m_points[i].pos - position).getSquaredLength();
+		if (sqrDist < queue->getMaxWeight()) {
+			queue->insert(m_points[i].index, sqrDist);
+		}
+	}
+}
+
+// Some Emacs-Hints -- please don't remove:
+//
+//  Local Variables:
+//  mode:C++
+//  tab-width:4
+//  End:
@@ -0,0 +1,306 @@
+// Title:   UniformGrid.h
+//
+// This file is part of the Pointshop3D system.
+// See http://www.pointshop3d.com/ for more information.
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program; if not, write to the Free
+// Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+// MA 02111-1307, USA.
+//
+// Contact info@pointshop3d.com if any conditions of this
+// licensing are not clear to you.
+//
+
+#ifndef __UNIFORMGRID_H_
+#define __UNIFORMGRID_H_
+
+#include "kdTree.h"
+#include <vector>
+
+// the mean number of points per occupied cell the cell size is chosen for
+#define UNIFORMGRID_POINTS_PER_CELL 4.0f
+// the cell coordinates are packed into 21 bits each
+#define UNIFORMGRID_MAX_CELLS_PER_AXIS (1 << 21)
+// a cell is overfull if it holds more than this times the mean number of points per cell
+#define UNIFORMGRID_OVERFULL_FACTOR 4.0f
+
+/**
+ * A uniform grid for nearest neighbour queries of evenly sampled points, with the same
+ * queries as <code>KdTree</code>. Only the occupied cells are stored, in a hash table
+ * of their integer coordinates, and the points are sorted by cell. The grid is built
+ * in O(n): the cell size is first estimated from the bounding box and then adapted
+ * until the occupied cells hold about <code>pointsPerCell</code> points on average,
+ * which also works for points sampled from a surface.
+ * <p>
+ * A k nearest neighbour query visits the cells in rings of growing distance around the
+ * cell of the query, skipping the cells which are farther away than the current k-th
+ * neighbour, until the next ring cannot contain a closer point. For unevenly sampled
+ * points the rings in the sparse regions grow large, see <code>getOverfullFraction</code>.
+ * All queries which take a context or are const are reentrant.
+ */
+class UniformGrid {
+
+public:
+	/**
+	 * Creates a uniform grid from the positions
+	 *
+	 * @param positions
+	 *			point positions
+	 * @param nOfPositions
+	 *			number of points
+	 * @param pointsPerCell
+	 *			the mean number of points per occupied cell
+	 */
+	UniformGrid(const Vector3D *positions, const unsigned int nOfPositions, const float pointsPerCell = UNIFORMGRID_POINTS_PER_CELL);
+	/**
+	 * Destructor
+	 */
+	~UniformGrid();
+
+	/**
+	 * look for the nearest neighbours at <code>position</code>, see <code>KdTree::queryPosition</code>
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 */
+	void queryPosition(const Vector3D &position);
+	/**
+	 * look for the nearest neighbours with a maximal squared distance <code>maxSqrDistance</code>,
+	 * see <code>KdTree::queryRange</code>
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param maxSqrDistance
+	 *			the maximal squared distance of a nearest neighbour
+	 */
+	void queryRange(const Vector3D &position, const float maxSqrDistance);
+	/**
+	 * look for the nearest neighbours at <code>position</code>
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param context
+	 *			the queue and the output buffer of the query
+	 * @return the number of found neighbours, which are stored in <code>context.neighbours</code>
+	 */
+	unsigned int queryPosition(const Vector3D &position, KdQueryContext &context) const;
+	/**
+	 * look for the nearest neighbours with a maximal squared distance <code>maxSqrDistance</code>
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param maxSqrDistance
+	 *			the maximal squared distance of a nearest neighbour
+	 * @param context
+	 *			the queue and the output buffer of the query
+	 * @return the number of found neighbours, which are stored in <code>context.neighbours</code>
+	 */
+	unsigned int queryRange(const Vector3D &position, const float maxSqrDistance, KdQueryContext &context) const;
+	/**
+	 * look for all points within a squared distance of <code>sqrRadius</code>,
+	 * see <code>KdTree::queryRadius</code>
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param sqrRadius
+	 *			the squared search radius
+	 * @param neighbours
+	 *			the found points are appended, in no particular order
+	 * @return the number of found points
+	 */
+	unsigned int queryRadius(const Vector3D &position, const float sqrRadius, std::vector<Neighbour> &neighbours) const;
+	/**
+	 * look for the points within a squared distance of <code>sqrRadius</code> of each of the 
+	 * <code>positions</code>, the results have the same layout as those of <code>KdTree::queryRadius</code>
+	 *
+	 * @param positions
+	 *			the positions to query with
+	 * @param nofPositions
+	 *			the number of <code>positions</code>
+	 * @param sqrRadius
+	 *			the squared search radius
+	 * @param offsets
+	 *			the end of the neighbours of each query position is appended
+	 * @param neighbours
+	 *			the found points of all query positions are appended
+	 */
+	void queryRadius(const Vector3D *positions, const unsigned int nofPositions, const float sqrRadius, std::vector<unsigned int> &offsets, std::vector<Neighbour> &neighbours) const;
+	/**
+	 * counts the points within a squared distance of <code>sqrRadius</code>
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param sqrRadius
+	 *			the squared search radius
+	 * @param maxCount
+	 *			the search stops as soon as this many points are found
+	 * @return the number of found points, at most <code>maxCount</code>
+	 */
+	unsigned int countRadius(const Vector3D &position, const float sqrRadius, const unsigned int maxCount = UINT_MAX) const;
+	/**
+	 * computes the <code>nofNeighbours</code> nearest neighbours of all positions of this grid
+	 * at once, see <code>KdTree::computeNeighbourGraph</code>
+	 *
+	 * @param nofNeighbours
+	 *			the number of nearest neighbours per position
+	 * @param graph
+	 *			returns the neighbours of all positions
+	 */
+	void computeNeighbourGraph(const unsigned int nofNeighbours, NeighbourGraph &graph) const;
+
+	/**
+	 * set the number of nearest neighbours which have to be looked at for a query
+	 *
+	 * @params newNOfNeighbours
+	 *			the number of nearest neighbours
+	 */
+	void setNOfNeighbours (const unsigned int newNOfNeighbours);
+	/**
+	 * get the index of the i-th nearest neighbour to the query point
+	 * i must be smaller than the number of found neighbours
+	 *
+	 * @param i
+	 *			index of the nearest neighbour
+	 * @return the index of the i-th nearest neighbour
+	 */
+	inline unsigned int getNeighbourPositionIndex (const unsigned int i) const;
+	/** 
+	 * get the position of the i-th nearest neighbour
+	 * i must be smaller than the number of found neighbours
+	 *
+	 * @param i
+	 *			index of the nearest neighbour
+	 * @return the position of the i-th nearest neighbour
+	 */
+	inline Vector3D const& getNeighbourPosition(const unsigned int i) const;
+	/**
+	 * get the squared distance of the query point and its i-th nearest neighbour
+	 * i must be smaller than the number of found neighbours
+	 *
+	 * @param i
+	 *			index of the nearest neighbour
+	 * @return the squared distance to the i-th nearest neighbour
+	 */
+	inline float const& getSquaredDistance (const unsigned int i) const;
+	/**
+	 * get the number of found neighbours
+	 * Generally, this is equal to the number of query neighbours
+	 * except for range queries, where this number may be smaller than the number of query neigbhbours
+	 *
+	 * @return the number of found neighbours
+	 */
+	inline unsigned int const& getNOfFoundNeighbours() const;
+	/**
+	 * get the number of query neighbors
+	 * Generally, this is equal to the number of found neighbours
+	 * except for range queries, where this number may be larger than the number of found neigbhbours
+	 *
+	 * @return the number of query neighbours
+	 */
+	inline unsigned int const& getNOfQueryNeighbours() const;
+
+	/**
+	 * @return the edge length of the cells
+	 */
+	inline float getCellSize() const;
+	/**
+	 * @return the number of occupied cells
+	 */
+	inline unsigned int getNOfCells() const;
+	/**
+	 * A measure of how unevenly the points are sampled.
+	 *
+	 * @return the fraction of the points which lie in cells with more than 
+	 *		   <code>UNIFORMGRID_OVERFULL_FACTOR</code> times the mean number of points per cell
+	 */
+	inline float getOverfullFraction() const;
+
+private:
+
+	KdTreePoint*				m_points;			// the points, sorted by cell
+	const Vector3D*				m_positions;
+	unsigned int				m_nOfPositions;
+	Vector3D					m_origin;			// the low corner of cell (0, 0, 0)
+	float						m_cellSize,
+								m_invCellSize,
+								m_overfullFraction;
+	int							m_nOfCellsPerAxis[3];
+	std::vector<unsigned int>	m_cellStarts;		// the points of cell c are m_points[m_cellStarts[c]..m_cellStarts[c+1]-1]
+	std::vector<unsigned long long>	m_hashKeys;		// the packed cell coordinates plus one, 0 for an empty slot
+	std::vector<unsigned int>	m_hashCells;		// the cell of each slot
+	unsigned int				m_hashBits;
+	std::vector<Neighbour>		m_neighbours;
+	unsigned int				m_nOfFoundNeighbours,
+								m_nOfNeighbours;
+	KdQueryContext				m_queryContext;
+
+	// sets the cell size and hashes the cells of all points, returns the cell of each point in cells,
+	// m_cellStarts holds the number of points of each cell on return
+	void hashPoints(const float cellSize, const Vector3D &minimum, const Vector3D &maximum, std::vector<unsigned int> &cells);
+	// returns the cell with the packed coordinates key, or -1 if it is not occupied
+	inline int findCell(const unsigned long long key) const;
+	// returns the cell with the packed coordinates key, a new one with no points if it is not occupied yet
+	inline unsigned int insertCell(const unsigned long long key);
+	// sets the number of bits of the hash table index to hold nofCells cells at half load, and rehashes the cells
+	void resizeHashTable(const size_t nofCells);
+	// the cell coordinates of a position, clamped to the grid
+	inline void getCellCoordinates(const Vector3D &position, int *cell) const;
+	// the packed coordinates of a cell
+	inline unsigned long long getKey(const int x, const int y, const int z) const;
+	// squared distance of q to the box of a cell
+	inline float computeCellSqrDistance(const Vector3D &q, const int x, const int y, const int z) const;
+	// inserts the points of a cell which are closer than the farthest neighbour into the queue
+	inline void queryCell(const Vector3D &position, const int x, const int y, const int z, PQueue *queue) const;
+};
+
+inline unsigned int UniformGrid::getNeighbourPositionIndex(const unsigned int neighbourIndex) const {
+	return m_neighbours[neighbourIndex].index;
+}
+
+inline Vector3D const& UniformGrid::getNeighbourPosition(const unsigned int neighbourIndex) const {
+	return m_positions[m_neighbours[neighbourIndex].index];
+}
+
+inline float const& UniformGrid::getSquaredDistance (const unsigned int neighbourIndex) const {
+	return m_neighbours[neighbourIndex].weight;
+}
+
+inline unsigned int const& UniformGrid::getNOfFoundNeighbours() const {
+	return m_nOfFoundNeighbours;
+}
+
+inline unsigned int const& UniformGrid::getNOfQueryNeighbours() const {
+	return m_nOfNeighbours;
+}
+
+inline float UniformGrid::getCellSize() const {
+	return m_cellSize;
+}
+
+inline unsigned int UniformGrid::getNOfCells() const {
+	return m_cellStarts.size() > 0 ? (unsigned int)m_cellStarts.size() - 1 : 0;
+}
+
+inline float UniformGrid::getOverfullFraction() const {
+	return m_overfullFraction;
+}
+
+#endif
+
+// Some Emacs-Hints -- please don't remove:
+//
+//  Local Variables:
+//  mode:C++
+//  tab-width:4
+//  End:
@@ -27,7 +27,23 @@
 //
 
 #include "kdTree.h"
+#include "FlatKdTree.h"
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <thread>
+#include <functional>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// identifies a snapshot file, the version changes with the layout of the snapshot
+#define KDTREE_SNAPSHOT_MAGIC "PS3DKDT"
+#define KDTREE_SNAPSHOT_VERSION 1
+// the sections of a snapshot start at multiples of this alignment
+#define KDTREE_SNAPSHOT_ALIGNMENT 16
 
 #define SWAP_POINTS(a,b) \
 			KdTreePoint tmp = points[a];\
@@ -39,23 +55,76 @@
 // global definitions
 // ******************
 
-KdTree::KdTree(const Vector3D *positions, const unsigned int nOfPositions, const unsigned int maxBucketSize) {
+/**
+ * The header of a tree snapshot, at the start of the snapshot. The nodes and the permutation
+ * follow at the given offsets from the start, so the snapshot does not depend on its address.
+ */
+typedef struct kdTreeSnapshotHeader {
+	char				magic[8];			// KDTREE_SNAPSHOT_MAGIC
+	unsigned int		version,			// KDTREE_SNAPSHOT_VERSION
+						headerSize,			// sizeof(KdTreeSnapshotHeader), guards against different layouts
+						nofPositions,
+						nofNodes,
+						bucketSize,
+						reserved;
+	unsigned long long	positionsHash,		// KdTree::hashPositions of the positions of the tree
+						nodesOffset,		// the FlatKdNodes in depth first order
+						indicesOffset,		// the position indices in tree order
+						size;				// the size of the whole snapshot
+	float				lowCorner[3],		// the bounding box of the positions
+						highCorner[3];
+} KdTreeSnapshotHeader;
+
+// rounds the offset up to the snapshot alignment
+static unsigned long long alignSnapshotOffset(const unsigned long long offset) {
+	return (offset + KDTREE_SNAPSHOT_ALIGNMENT - 1) / KDTREE_SNAPSHOT_ALIGNMENT * KDTREE_SNAPSHOT_ALIGNMENT;
+}
+
+KdTree::KdTree(const Vector3D *positions, const unsigned int nOfPositions, const unsigned int maxBucketSize, const bool indexOnly) {
 	m_bucketSize			= maxBucketSize;
 	m_positions				= positions;
 	m_nOfPositions			= nOfPositions;
 	m_points				= new KdTreePoint[nOfPositions];
+	m_indices				= 0;
 	m_nOfFoundNeighbours	= 0;
 	m_nOfNeighbours			= 0;
-	m_queryPriorityQueue	= new PQueue();
-	for (unsigned int i=0; i<nOfPositions; i++) {
+	m_queryContext.neighbours = 0;
+	m_approximationError	= 0.0f;
+	m_pruneFactor			= 1.0f;
+	int i;
+	#pragma omp parallel for
+	for (i=0; i<(int)nOfPositions; i++) {
 		m_points[i].pos = positions[i];
 		m_points[i].index = i;
 	}
-	computeEnclosingBoundingBox(m_boundingBoxLowCorner, m_boundingBoxHighCorner);
 	m_root = new KdNode(false);
 	Vector3D maximum, minimum;
 	getSpread(m_points, nOfPositions, maximum, minimum);
-	createTree(*m_root, 0, nOfPositions, maximum, minimum);
+	m_boundingBoxLowCorner = minimum;
+	m_boundingBoxHighCorner = maximum;
+
+	// the upper levels are built in parallel, the scratch buffer is only needed for them. it is
+	// used with a single thread too, such that the tree does not depend on the number of threads
+#ifdef _OPENMP
+	int nofThreads = omp_get_max_threads();
+#else
+	int nofThreads = 1;
+#endif
+	KdTreePoint *scratch = (nOfPositions >= KDTREE_PARALLEL_CUTOFF) ? new KdTreePoint[nOfPositions] : 0;
+	createTree(*m_root, 0, nOfPositions, maximum, minimum, scratch, nofThreads);
+	delete[] scratch;
+
+	if (indexOnly) {
+		// only the permutation of the points is kept
+		m_indices = new unsigned int[nOfPositions];
+		#pragma omp parallel for
+		for (i=0; i<(int)nOfPositions; i++) {
+			m_indices[i] = m_points[i].index;
+		}
+		setIndexLeaves(m_root);
+		delete[] m_points;
+		m_points = 0;
+	}
 	setNOfNeighbours(1);
 }
 
@@ -63,141 +132,724 @@ KdTree::KdTree(const Vector3D *positions, const unsigned int nOfPositions, const
 KdTree::~KdTree() {
 	delete m_root;
 	delete[] m_points;
-	delete m_queryPriorityQueue;
+	delete[] m_indices;
+}
+
+void KdTree::queryPosition(const Vector3D &position) {
+	if (m_neighbours.size() == 0) {
+		return;
+	}
+	m_nOfFoundNeighbours = queryRange(position, FLT_MAX, m_queryContext);
+}
+
+void KdTree::queryRange(const Vector3D &position, const float maxSqrDistance) {
+	if (m_neighbours.size() == 0) {
+		return;
+	}
+	m_nOfFoundNeighbours = queryRange(position, maxSqrDistance, m_queryContext);
+}
+
+unsigned int KdTree::queryPosition(const Vector3D &position, KdQueryContext &context) const {
+	return queryRange(position, FLT_MAX, context);
+}
+
+unsigned int KdTree::queryRange(const Vector3D &position, const float maxSqrDistance, KdQueryContext &context) const {
+	PQueue *queue = &context.queue;
+	Vector3D queryOffsets(0,0,0);
+
+    float sqrDist = computeBoxSqrDistance(position, m_boundingBoxLowCorner, m_boundingBoxHighCorner, queryOffsets);	
+
+    if (sqrDist > maxSqrDistance) {
+        return 0;
+    }
+
+	queue->init();
+	queue->insert(-1, maxSqrDistance);
+
+	m_root->queryNode(sqrDist, queue, position, queryOffsets, m_pruneFactor);
+
+	if (queue->getMax().index == -1) {
+		queue->removeMax();
+	}
+
+	unsigned int nOfFoundNeighbours = queue->getNofElements();
+
+	for(int i=nOfFoundNeighbours-1; i>=0; i--) {
+		context.neighbours[i] = queue->getMax();
+		queue->removeMax();
+	}
+
+	return nOfFoundNeighbours;
+}
+
+unsigned int KdTree::queryRadius(const Vector3D &position, const float sqrRadius, std::vector<Neighbour> &neighbours) const {
+	Vector3D queryOffsets(0,0,0);
+	size_t nofNeighbours = neighbours.size();
+
+	float sqrDist = computeBoxSqrDistance(position, m_boundingBoxLowCorner, m_boundingBoxHighCorner, queryOffsets);
+	if (sqrDist > sqrRadius) {
+		return 0;
+	}
+	m_root->queryRadiusNode(sqrDist, sqrRadius, position, queryOffsets, neighbours);
+
+	return (unsigned int)(neighbours.size() - nofNeighbours);
+}
+
+void KdTree::queryRadius(const Vector3D *positions, const unsigned int nofPositions, const float sqrRadius, std::vector<unsigned int> &offsets, std::vector<Neighbour> &neighbours) const {
+	if (offsets.size() == 0) {
+		offsets.push_back((unsigned int)neighbours.size());
+	}
+	for (unsigned int i=0; i<nofPositions; i++) {
+		queryRadius(positions[i], sqrRadius, neighbours);
+		offsets.push_back((unsigned int)neighbours.size());
+	}
+}
+
+unsigned int KdTree::countRadius(const Vector3D &position, const float sqrRadius, const unsigned int maxCount) const {
+	Vector3D queryOffsets(0,0,0);
+	unsigned int count = 0;
+
+	float sqrDist = computeBoxSqrDistance(position, m_boundingBoxLowCorner, m_boundingBoxHighCorner, queryOffsets);
+	if (sqrDist > sqrRadius || maxCount == 0) {
+		return 0;
+	}
+	m_root->countRadiusNode(sqrDist, sqrRadius, position, queryOffsets, count, maxCount);
+
+	return count;
+}
+
+void KdTree::computeNeighbourGraph(const unsigned int nofNeighbours, NeighbourGraph &graph) const {
+	// every query finds the same number of neighbours, unless there are fewer points
+	unsigned int nofFound = (nofNeighbours < m_nOfPositions) ? nofNeighbours : m_nOfPositions;
+	int i;
+
+	// the dual tree search only pays off for large trees, and it is always exact
+	if (m_nOfPositions >= KDTREE_DUAL_TREE_CUTOFF && m_approximationError == 0.0f) {
+		computeDualTreeNeighbourGraph(nofNeighbours, graph);
+		return;
+	}
+
+	graph.nofNeighbours = nofNeighbours;
+	graph.offsets.resize(m_nOfPositions + 1);
+	graph.indices.resize(m_nOfPositions * nofFound);
+	graph.sqrDistances.resize(m_nOfPositions * nofFound);
+	for (i=0; i<=(int)m_nOfPositions; i++) {
+		graph.offsets[i] = i * nofFound;
+	}
+	if (nofFound == 0) {
+		return;
+	}
+
+	// the 9 neighbours of the default stencil of the parameterization are faster with a 
+	// fixed size query, for 3 and 7 neighbours the heap is as fast
+	if (nofFound == 9) {
+		computeFixedNeighbourGraph<9>(graph);
+		return;
+	}
+
+	#pragma omp parallel
+	{
+		// each thread uses its own query context, the tree itself is only read
+		KdQueryContext context;
+		std::vector<Neighbour> neighbours(nofFound);
+		context.queue.setSize(nofFound);
+		context.neighbours = &neighbours[0];
+
+		// the points are queried in the order of the tree, so consecutive queries visit the same nodes
+		#pragma omp for schedule(dynamic, 1024)
+		for (i=0; i<(int)m_nOfPositions; i++) {
+			unsigned int n = queryPosition(getTreePointPosition(i), context);
+			unsigned int offset = graph.offsets[getTreePointIndex(i)];
+			for (unsigned int j=0; j<n; j++) {
+				graph.indices[offset + j] = neighbours[j].index;
+				graph.sqrDistances[offset + j] = neighbours[j].weight;
+			}
+		}
+	}
+}
+
+template<unsigned int K>
+void KdTree::computeFixedNeighbourGraph(NeighbourGraph &graph) const {
+	int i;
+
+	// the points are queried in the order of the tree, so consecutive queries visit the same nodes
+	#pragma omp parallel for schedule(dynamic, 1024)
+	for (i=0; i<(int)m_nOfPositions; i++) {
+		Neighbour neighbours[K];
+		unsigned int n = knn<K>(getTreePointPosition(i), neighbours);
+		unsigned int offset = graph.offsets[getTreePointIndex(i)];
+		for (unsigned int j=0; j<n; j++) {
+			graph.indices[offset + j] = neighbours[j].index;
+			graph.sqrDistances[offset + j] = neighbours[j].weight;
+		}
+	}
 }
 
-void KdTree::computeEnclosingBoundingBox(Vector3D &lowCorner, Vector3D &hiCorner) {
-	hiCorner = lowCorner = m_points[0].pos;	
-	for (unsigned int i=1; i<m_nOfPositions; i++) {
-		Vector3D const& tmp = m_positions[i];
-		if (hiCorner[0] < tmp[0]) {
-			hiCorner[0] = tmp[0];
+// *************************
+// dual tree neighbour graph
+// *************************
+
+// a node of the tree with the range of its points and their bounding box
+typedef struct dualTreeNode {
+	int			children[2];				// -1 for a leaf
+	int			start,						// the points of the node are points[start..end-1]
+				end;
+	Vector3D	lowCorner,					// the bounding box of the points
+				highCorner;
+	float		bound;						// no query point of the node has a neighbour candidate farther away
+
+	dualTreeNode() : start(0), end(0), lowCorner(0.0f, 0.0f, 0.0f), highCorner(0.0f, 0.0f, 0.0f), bound(FLT_MAX) {
+		children[0] = children[1] = -1;
+	}
+} DualTreeNode;
+
+/**
+ * The state of a dual tree traversal: a copy of the tree with node boxes and bounds, and the
+ * current neighbours of all points, kept sorted by increasing distance in slots of 
+ * <code>nofNeighbours</code> entries.
+ */
+class DualTreeSearch {
+
+public:
+
+	DualTreeSearch(const KdTreePoint *points, const unsigned int *treeIndices, const unsigned int nofPoints, const unsigned int nofNeighbours, const bool excludeSelf) {
+		this->points = points;
+		this->treeIndices = treeIndices;
+		this->nofNeighbours = nofNeighbours;
+		this->excludeSelf = excludeSelf;
+		indices.assign(nofPoints * nofNeighbours, -1);
+		sqrDistances.assign(nofPoints * nofNeighbours, FLT_MAX);
+	}
+
+	// appends the subtree of node to nodes, returns the index of its copy
+	int addNode(const KdNode *node) {
+		int index = (int)nodes.size();
+		nodes.push_back(DualTreeNode());
+		if (node->leaf) {
+			DualTreeNode &leaf = nodes[index];
+			leaf.children[0] = leaf.children[1] = -1;
+			if (node->indexOnly) {
+				leaf.start = (int)(node->indexleafdata.m_indices - treeIndices);
+				leaf.end = leaf.start + node->indexleafdata.m_nOfElements;
+			}
+			else {
+				leaf.start = (int)(node->leafdata.m_points - points);
+				leaf.end = leaf.start + node->leafdata.m_nOfElements;
+			}
+			if (leaf.start < leaf.end) {
+				KdTree::getSpread((KdTreePoint *)points + leaf.start, leaf.end - leaf.start, leaf.highCorner, leaf.lowCorner);
+				leaf.bound = FLT_MAX;
+			}
+			else {
+				// an empty leaf is farther away than anything
+				leaf.lowCorner = Vector3D(FLT_MAX, FLT_MAX, FLT_MAX);
+				leaf.highCorner = Vector3D(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+				leaf.bound = 0.0f;
+			}
 		}
-		else if (lowCorner[0] > tmp[0]) {
-			lowCorner[0] = tmp[0];
+		else {
+			int low = addNode(node->nodedata.m_children[0]),
+				high = addNode(node->nodedata.m_children[1]);
+			DualTreeNode &inner = nodes[index];
+			inner.children[0] = low;
+			inner.children[1] = high;
+			inner.start = nodes[low].start;
+			inner.end = nodes[high].end;
+			for (int d=0; d<3; d++) {
+				inner.lowCorner[d] = nodes[low].lowCorner[d] < nodes[high].lowCorner[d] ? nodes[low].lowCorner[d] : nodes[high].lowCorner[d];
+				inner.highCorner[d] = nodes[low].highCorner[d] > nodes[high].highCorner[d] ? nodes[low].highCorner[d] : nodes[high].highCorner[d];
+			}
+			inner.bound = FLT_MAX;
 		}
-		if (hiCorner[1] < tmp[1]) {
-			hiCorner[1] = tmp[1];
+		return index;
+	}
+
+	// finds the neighbours of the points of the query node among the points of the reference node
+	void search(const int queryNode, const int referenceNode) {
+		DualTreeNode &q = nodes[queryNode];
+		const DualTreeNode &r = nodes[referenceNode];
+
+		if (boxSqrDistance(q, r) >= q.bound) {
+			return;
 		}
-		else if (lowCorner[1] > tmp[1]) {
-			lowCorner[1] = tmp[1];
+
+		if (q.children[0] == -1 && r.children[0] == -1) {
+			searchLeaves(q, r);
 		}
-		if (hiCorner[2] < tmp[2]) {
-			hiCorner[2] = tmp[2];
+		else if (q.children[0] == -1) {
+			searchChildren(queryNode, r);
 		}
-		else if (lowCorner[2] > tmp[2]) {
-			lowCorner[2] = tmp[2];
+		else {
+			for (int i=0; i<2; i++) {
+				if (r.children[0] == -1) {
+					search(q.children[i], referenceNode);
+				}
+				else {
+					searchChildren(q.children[i], r);
+				}
+			}
+			q.bound = nodes[q.children[0]].bound > nodes[q.children[1]].bound ? nodes[q.children[0]].bound : nodes[q.children[1]].bound;
 		}
-	}		 
-}
+	}
+
+	// collects subtrees of the query tree which can be searched independently
+	void getSubtrees(const int node, const int minNofPoints, std::vector<int> &subtrees) const {
+		const DualTreeNode &n = nodes[node];
+		if (n.children[0] == -1 || n.end - n.start <= minNofPoints) {
+			subtrees.push_back(node);
+		}
+		else {
+			getSubtrees(n.children[0], minNofPoints, subtrees);
+			getSubtrees(n.children[1], minNofPoints, subtrees);
+		}
+	}
+
+	std::vector<DualTreeNode>	nodes;
+	std::vector<int>			indices;			// the neighbour slots of points[i] start at i*nofNeighbours
+	std::vector<float>			sqrDistances;
+
+private:
+
+	const KdTreePoint			*points;
+	const unsigned int			*treeIndices;		// the index array of an index only tree, else 0
+	unsigned int				nofNeighbours;
+	bool						excludeSelf;
+
+	// visits the children of the reference node, the closer one first
+	void searchChildren(const int queryNode, const DualTreeNode &r) {
+		const DualTreeNode &q = nodes[queryNode];
+		float lowDistance = boxSqrDistance(q, nodes[r.children[0]]),
+			  highDistance = boxSqrDistance(q, nodes[r.children[1]]);
+		if (lowDistance <= highDistance) {
+			search(queryNode, r.children[0]);
+			search(queryNode, r.children[1]);
+		}
+		else {
+			search(queryNode, r.children[1]);
+			search(queryNode, r.children[0]);
+		}
+	}
+
+	void searchLeaves(DualTreeNode &q, const DualTreeNode &r) {
+		float bound = 0.0f;
+		for (int i=q.start; i<q.end; i++) {
+			int *slotIndices = &indices[i * nofNeighbours];
+			float *slotDistances = &sqrDistances[i * nofNeighbours];
+			const Vector3D &position = points[i].pos;
+			for (int j=r.start; j<r.end; j++) {
+				if (excludeSelf && i == j) {
+					continue;
+				}
+				float sqrDist = (points[j].pos - position).getSquaredLength();
+				if (sqrDist < slotDistances[nofNeighbours-1]) {
+					// shift the farther neighbours up by one slot
+					unsigned int k = nofNeighbours-1;
+					while (k > 0 && slotDistances[k-1] > sqrDist) {
+						slotDistances[k] = slotDistances[k-1];
+						slotIndices[k] = slotIndices[k-1];
+						k--;
+					}
+					slotDistances[k] = sqrDist;
+					slotIndices[k] = j;
+				}
+			}
+			if (slotDistances[nofNeighbours-1] > bound) {
+				bound = slotDistances[nofNeighbours-1];
+			}
+		}
+		q.bound = bound;
+	}
+
+	inline float boxSqrDistance(const DualTreeNode &a, const DualTreeNode &b) const {
+		float dist = 0.0f;
+		for (int d=0; d<3; d++) {
+			float t = a.lowCorner[d] - b.highCorner[d];
+			if (b.lowCorner[d] - a.highCorner[d] > t) {
+				t = b.lowCorner[d] - a.highCorner[d];
+			}
+			if (t > 0.0f) {
+				dist += t*t;
+			}
+		}
+		return dist;
+	}
+};
 
-inline float KdTree::computeBoxSqrDistance(const Vector3D &q, const Vector3D &lo, const Vector3D &hi, Vector3D& offset) {
-	float dist = 0.0;
-	float t;
+void KdTree::computeDualTreeNeighbourGraph(const unsigned int nofNeighbours, NeighbourGraph &graph, const bool excludeSelf) const {
+	unsigned int nofCandidates = excludeSelf ? (m_nOfPositions > 0 ? m_nOfPositions - 1 : 0) : m_nOfPositions;
+	unsigned int nofFound = (nofNeighbours < nofCandidates) ? nofNeighbours : nofCandidates;
+	int i;
 
-	if (q[0] < lo[0]) {
-		t = lo[0] - q[0];
-		offset[0] = t;
-		dist = t*t;
+	graph.nofNeighbours = nofNeighbours;
+	graph.offsets.resize(m_nOfPositions + 1);
+	graph.indices.resize(m_nOfPositions * nofFound);
+	graph.sqrDistances.resize(m_nOfPositions * nofFound);
+	for (i=0; i<=(int)m_nOfPositions; i++) {
+		graph.offsets[i] = i * nofFound;
 	}
-	else if (q[0] > hi[0]) {
-		t = q[0] - hi[0];
-		offset[0] = t;
-		dist = t*t;
+	if (nofFound == 0) {
+		return;
 	}
-	if (q[1] < lo[1]) {
-		t = lo[1] - q[1];
-		offset[1] = t;
-		dist += t*t;
+
+	// the search works on the points in tree order, an index only tree needs a temporary copy
+	std::vector<KdTreePoint> indexedPoints;
+	const KdTreePoint *points = m_points;
+	if (m_indices != 0) {
+		indexedPoints.resize(m_nOfPositions);
+		for (i=0; i<(int)m_nOfPositions; i++) {
+			indexedPoints[i].pos = m_positions[m_indices[i]];
+			indexedPoints[i].index = m_indices[i];
+		}
+		points = &indexedPoints[0];
 	}
-	else if (q[1] > hi[1]) {
-		t = q[1] - hi[1];
-		offset[1] = t;
-		dist += t*t;
+	DualTreeSearch search(points, m_indices, m_nOfPositions, nofFound, excludeSelf);
+	search.nodes.reserve(2 * (m_nOfPositions / (m_bucketSize > 0 ? m_bucketSize : 1) + 1));
+	int root = search.addNode(m_root);
+
+	// the query subtrees own disjoint points and nodes, so they are searched in parallel
+	std::vector<int> subtrees;
+	search.getSubtrees(root, 4096, subtrees);
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (i=0; i<(int)subtrees.size(); i++) {
+		search.search(subtrees[i], root);
 	}
-	if (q[2] < lo[2]) {
-		t = lo[2] - q[2];
-		offset[2] = t;
-		dist += t*t;
+
+	// the slots are in the order of the tree points
+	#pragma omp parallel for
+	for (i=0; i<(int)m_nOfPositions; i++) {
+		unsigned int offset = graph.offsets[points[i].index];
+		for (unsigned int j=0; j<nofFound; j++) {
+			graph.indices[offset + j] = points[search.indices[i * nofFound + j]].index;
+			graph.sqrDistances[offset + j] = search.sqrDistances[i * nofFound + j];
+		}
 	}
-	else if (q[2] > hi[2]) {
-		t = q[2] - hi[2];
-		offset[2] = t;
-		dist += t*t;
+}
+
+// **************
+// tree snapshots
+// **************
+
+KdTree::KdTree() {
+	m_bucketSize			= 0;
+	m_positions				= 0;
+	m_nOfPositions			= 0;
+	m_points				= 0;
+	m_indices				= 0;
+	m_root					= 0;
+	m_nOfFoundNeighbours	= 0;
+	m_nOfNeighbours			= 0;
+	m_queryContext.neighbours = 0;
+	m_approximationError	= 0.0f;
+	m_pruneFactor			= 1.0f;
+}
+
+bool KdTree::saveSnapshot(const char *fileName) const {
+	std::vector<FlatKdNode> nodes;
+	std::vector<unsigned int> indices(m_nOfPositions);
+	KdTreeSnapshotHeader header;
+	unsigned int i;
+
+	flattenNode(m_root, nodes);
+	for (i=0; i<m_nOfPositions; i++) {
+		indices[i] = getTreePointIndex(i);
+	}
+
+	memset(&header, 0, sizeof(header));
+	strcpy(header.magic, KDTREE_SNAPSHOT_MAGIC);
+	header.version = KDTREE_SNAPSHOT_VERSION;
+	header.headerSize = sizeof(header);
+	header.nofPositions = m_nOfPositions;
+	header.nofNodes = (unsigned int)nodes.size();
+	header.bucketSize = m_bucketSize;
+	header.positionsHash = hashPositions(m_positions, m_nOfPositions);
+	header.nodesOffset = alignSnapshotOffset(sizeof(header));
+	header.indicesOffset = alignSnapshotOffset(header.nodesOffset + nodes.size() * sizeof(FlatKdNode));
+	header.size = header.indicesOffset + indices.size() * sizeof(unsigned int);
+	for (i=0; i<3; i++) {
+		header.lowCorner[i] = m_boundingBoxLowCorner[i];
+		header.highCorner[i] = m_boundingBoxHighCorner[i];
 	}
 
-	return dist;
+	FILE *file = fopen(fileName, "wb");
+	if (file == 0) {
+		return false;
+	}
+	char padding[KDTREE_SNAPSHOT_ALIGNMENT];
+	memset(padding, 0, sizeof(padding));
+	bool isWritten = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		             fwrite(padding, 1, (size_t)(header.nodesOffset - sizeof(header)), file) == header.nodesOffset - sizeof(header) &&
+		             fwrite(&nodes[0], sizeof(FlatKdNode), nodes.size(), file) == nodes.size() &&
+		             fwrite(padding, 1, (size_t)(header.indicesOffset - header.nodesOffset - nodes.size() * sizeof(FlatKdNode)), file) ==
+		                 header.indicesOffset - header.nodesOffset - nodes.size() * sizeof(FlatKdNode) &&
+		             (indices.size() == 0 || fwrite(&indices[0], sizeof(unsigned int), indices.size(), file) == indices.size());
+	if (fclose(file) != 0) {
+		isWritten = false;
+	}
+	return isWritten;
 }
 
-void KdTree::queryPosition(const Vector3D &position) {
-	if (m_neighbours.size() == 0) {
-		return;
+KdTree *KdTree::loadSnapshot(const Vector3D *positions, const unsigned int nOfPositions, const void *snapshot, const size_t snapshotSize,
+	                         const bool indexOnly) {
+	const char *data = (const char *)snapshot;
+	KdTreeSnapshotHeader header;
+	int i;
+
+	// check the header, then that the sections lie within the snapshot
+	if (snapshotSize < sizeof(header)) {
+		return 0;
 	}
-	Vector3D queryOffsets(0,0,0);
-	m_queryPriorityQueue->init();
-	m_queryPriorityQueue->insert(-1, FLT_MAX);
-	float sqrDist = computeBoxSqrDistance(position, m_boundingBoxLowCorner, m_boundingBoxHighCorner, queryOffsets);
-	m_root->queryNode(sqrDist, m_queryPriorityQueue, position, queryOffsets);
-	
-	if (m_queryPriorityQueue->getMax().index == -1) {
-		m_queryPriorityQueue->removeMax();
+	memcpy(&header, data, sizeof(header));
+	if (strncmp(header.magic, KDTREE_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != KDTREE_SNAPSHOT_VERSION ||
+		header.headerSize != sizeof(header) || header.nofPositions != nOfPositions || header.nofNodes == 0 ||
+		header.size != snapshotSize || header.nodesOffset % KDTREE_SNAPSHOT_ALIGNMENT != 0 ||
+		header.indicesOffset % KDTREE_SNAPSHOT_ALIGNMENT != 0 ||
+		header.nodesOffset + (unsigned long long)header.nofNodes * sizeof(FlatKdNode) > header.indicesOffset ||
+		header.indicesOffset + (unsigned long long)nOfPositions * sizeof(unsigned int) > header.size) {
+		return 0;
+	}
+	if (header.positionsHash != hashPositions(positions, nOfPositions)) {
+		return 0;
 	}
 
-	m_nOfFoundNeighbours = m_queryPriorityQueue->getNofElements();
+	const unsigned int *indices = (const unsigned int *)(data + header.indicesOffset);
+	for (i=0; i<(int)nOfPositions; i++) {
+		if (indices[i] >= nOfPositions) {
+			return 0;
+		}
+	}
 
-	for(int i=m_nOfFoundNeighbours-1; i>=0; i--) {
-		m_neighbours[i] = m_queryPriorityQueue->getMax();
-		m_queryPriorityQueue->removeMax();
+	KdTree *tree = new KdTree();
+	tree->m_bucketSize = header.bucketSize;
+	tree->m_positions = positions;
+	tree->m_nOfPositions = nOfPositions;
+	tree->m_boundingBoxLowCorner = Vector3D(header.lowCorner[0], header.lowCorner[1], header.lowCorner[2]);
+	tree->m_boundingBoxHighCorner = Vector3D(header.highCorner[0], header.highCorner[1], header.highCorner[2]);
+	if (indexOnly) {
+		tree->m_indices = new unsigned int[nOfPositions];
+		memcpy(tree->m_indices, indices, nOfPositions * sizeof(unsigned int));
 	}
+	else {
+		// gather the positions in tree order
+		tree->m_points = new KdTreePoint[nOfPositions];
+		#pragma omp parallel for
+		for (i=0; i<(int)nOfPositions; i++) {
+			tree->m_points[i].pos = positions[indices[i]];
+			tree->m_points[i].index = indices[i];
+		}
+	}
+
+	// the root of a tree is always an inner node
+	const FlatKdNode *nodes = (const FlatKdNode *)(data + header.nodesOffset);
+	if ((nodes[0].info & 3) != FLAT_KDNODE_LEAF) {
+		tree->m_root = tree->unflattenNode(nodes, header.nofNodes, 0);
+	}
+	if (tree->m_root == 0) {
+		delete tree;
+		return 0;
+	}
+	tree->setNOfNeighbours(1);
+	return tree;
 }
 
-void KdTree::queryRange(const Vector3D &position, const float maxSqrDistance) {
-	if (m_neighbours.size() == 0) {
-		return;
+KdTree *KdTree::loadSnapshotFile(const Vector3D *positions, const unsigned int nOfPositions, const char *fileName, const bool indexOnly) {
+	FILE *file = fopen(fileName, "rb");
+	if (file == 0) {
+		return 0;
 	}
-	Vector3D queryOffsets(0,0,0);
+	std::vector<char> snapshot;
+	if (fseek(file, 0, SEEK_END) == 0) {
+		long size = ftell(file);
+		if (size > 0 && fseek(file, 0, SEEK_SET) == 0) {
+			snapshot.resize(size);
+			if (fread(&snapshot[0], 1, size, file) != (size_t)size) {
+				snapshot.clear();
+			}
+		}
+	}
+	fclose(file);
 
-    m_nOfFoundNeighbours = 0;
-    float sqrDist = computeBoxSqrDistance(position, m_boundingBoxLowCorner, m_boundingBoxHighCorner, queryOffsets);	
+	if (snapshot.size() == 0) {
+		return 0;
+	}
+	return loadSnapshot(positions, nOfPositions, &snapshot[0], snapshot.size(), indexOnly);
+}
 
-    if (sqrDist > maxSqrDistance) {
-        return;
-    }
+unsigned long long KdTree::hashPositions(const Vector3D *positions, const unsigned int nOfPositions) {
+	unsigned long long hash = 14695981039346656037ULL;
+	unsigned int word;
 
-	m_queryPriorityQueue->init();
-	m_queryPriorityQueue->insert(-1, maxSqrDistance);
+	// the coordinates are hashed as 32 bit words, which is exact and much faster than bytes
+	for (unsigned int i=0; i<nOfPositions; i++) {
+		for (int j=0; j<3; j++) {
+			memcpy(&word, &positions[i][j], sizeof(word));
+			hash = (hash ^ word) * 1099511628211ULL;
+		}
+	}
+	return (hash ^ nOfPositions) * 1099511628211ULL;
+}
 
-	m_root->queryNode(sqrDist, m_queryPriorityQueue, position, queryOffsets);
+void KdTree::flattenNode(const KdNode *node, std::vector<FlatKdNode> &nodes) const {
+	unsigned int index = (unsigned int)nodes.size();
+	nodes.push_back(FlatKdNode());
 
-	if (m_queryPriorityQueue->getMax().index == -1) {
-		m_queryPriorityQueue->removeMax();
+	if (node->leaf) {
+		if (node->indexOnly) {
+			nodes[index].firstPoint = (unsigned int)(node->indexleafdata.m_indices - m_indices);
+			nodes[index].info = (node->indexleafdata.m_nOfElements << 2) | FLAT_KDNODE_LEAF;
+		}
+		else {
+			nodes[index].firstPoint = (unsigned int)(node->leafdata.m_points - m_points);
+			nodes[index].info = (node->leafdata.m_nOfElements << 2) | FLAT_KDNODE_LEAF;
+		}
+	}
+	else {
+		// the low child follows its parent
+		flattenNode(node->nodedata.m_children[0], nodes);
+		nodes[index].cutVal = node->nodedata.m_cutval;
+		nodes[index].info = ((unsigned int)nodes.size() << 2) | node->nodedata.m_dim;
+		flattenNode(node->nodedata.m_children[1], nodes);
 	}
+}
 
-	m_nOfFoundNeighbours = m_queryPriorityQueue->getNofElements();
+KdNode *KdTree::unflattenNode(const FlatKdNode *nodes, const unsigned int nofNodes, const unsigned int index) {
+	const FlatKdNode &flatNode = nodes[index];
 
-	for(int i=m_nOfFoundNeighbours-1; i>=0; i--) {
-		m_neighbours[i] = m_queryPriorityQueue->getMax();
-		m_queryPriorityQueue->removeMax();
+	if ((flatNode.info & 3) == FLAT_KDNODE_LEAF) {
+		unsigned int first = flatNode.firstPoint,
+			         nOfElements = flatNode.info >> 2;
+		if (first > m_nOfPositions || nOfElements > m_nOfPositions - first) {
+			return 0;
+		}
+		KdNode *leaf = new KdNode(true);
+		if (m_points != 0) {
+			leaf->leafdata.m_points = m_points + first;
+			leaf->leafdata.m_nOfElements = nOfElements;
+		}
+		else {
+			leaf->indexOnly = true;
+			leaf->indexleafdata.m_indices = m_indices + first;
+			leaf->indexleafdata.m_nOfElements = nOfElements;
+			leaf->indexleafdata.m_positions = m_positions;
+		}
+		return leaf;
 	}
+
+	// the children follow their parent, so a valid snapshot has no cycles
+	unsigned int right = flatNode.info >> 2;
+	if (index + 1 >= nofNodes || right <= index + 1 || right >= nofNodes) {
+		return 0;
+	}
+	KdNode *node = new KdNode(false);
+	node->nodedata.m_dim = (unsigned char)(flatNode.info & 3);
+	node->nodedata.m_cutval = flatNode.cutVal;
+	node->nodedata.m_children[0] = unflattenNode(nodes, nofNodes, index + 1);
+	node->nodedata.m_children[1] = node->nodedata.m_children[0] != 0 ? unflattenNode(nodes, nofNodes, right) : 0;
+	if (node->nodedata.m_children[1] == 0) {
+		delete node;
+		return 0;
+	}
+	return node;
+}
+
+void KdTree::setApproximationError (const float epsilon) {
+	m_approximationError = epsilon;
+	m_pruneFactor = (1.0f + epsilon) * (1.0f + epsilon);
+}
+
+float KdTree::getApproximationError () const {
+	return m_approximationError;
 }
 
 void KdTree::setNOfNeighbours (const unsigned int newNOfNeighbours) {
 	if (newNOfNeighbours != m_nOfNeighbours) {
 		m_nOfNeighbours = newNOfNeighbours;
-		m_queryPriorityQueue->setSize(m_nOfNeighbours);
+		m_queryContext.queue.setSize(m_nOfNeighbours);
 		m_nOfNeighbours = newNOfNeighbours;
 		m_neighbours.resize(m_nOfNeighbours);
+		m_queryContext.neighbours = m_nOfNeighbours > 0 ? &m_neighbours[0] : 0;
 		m_nOfFoundNeighbours = 0;
 	}
 }
 
 
-void KdTree::createTree(KdNode &node, int start, int end, Vector3D &maximum, Vector3D &minimum) {
+void KdTree::createTree(KdNode &node, const int start, const int end, Vector3D maximum, Vector3D minimum, KdTreePoint *scratch, const int nofThreads) {
 	int	mid;
-
 	int n = end-start;
+	// the points of large nodes are always split stably through the scratch buffer, and the ones of
+	// small nodes in place, hence the tree is the same for any number of threads
+	bool isLargeNode = (n >= KDTREE_PARALLEL_CUTOFF);
+
+	splitPoints(m_points+start, n, maximum, minimum, node.nodedata.m_dim, node.nodedata.m_cutval, mid,
+		        isLargeNode ? scratch+start : 0, nofThreads);
+	mid += start;
+	unsigned char dim = node.nodedata.m_dim;
+
+	// the boxes of the children
+	Vector3D lowMaximum = maximum,
+		     highMinimum = minimum;
+	lowMaximum[dim] = node.nodedata.m_cutval;
+	highMinimum[dim] = node.nodedata.m_cutval;
+
+	int nofLowThreads = nofThreads;
+	std::thread highThread;
+	if (end-mid <= m_bucketSize) {
+		// new leaf
+		KdNode* _leaf = new KdNode(true);
+		node.nodedata.m_children[1] = _leaf;
+		_leaf->leafdata.m_points = (m_points+mid);
+		_leaf->leafdata.m_nOfElements = end-mid;
+	}
+	else {
+		// new node
+		KdNode* child = new KdNode(false);
+		node.nodedata.m_children[1] = child;
+		if (isLargeNode && nofThreads > 1) {
+			// fork, the children work on disjoint ranges of the data and the scratch array
+			nofLowThreads = nofThreads - nofThreads/2;
+			highThread = std::thread(&KdTree::createTree, this, std::ref(*child), mid, end, maximum, highMinimum, scratch, nofThreads/2);
+		}
+		else {
+			createTree(*child, mid, end, maximum, highMinimum, scratch, nofThreads);
+		}
+	}
+
+	if (mid-start <= m_bucketSize) {
+		// new leaf
+		KdNode* leaf = new KdNode(true);
+		node.nodedata.m_children[0] = leaf;
+		leaf->leafdata.m_points = (m_points+start);
+		leaf->leafdata.m_nOfElements = mid-start;
+	}
+	else {
+		// new node
+		KdNode* child = new KdNode(false);
+		node.nodedata.m_children[0] = child;
+		createTree(*child, start, mid, lowMaximum, minimum, scratch, nofLowThreads);
+	}
+
+	if (highThread.joinable()) {
+		highThread.join();
+	}
+}
+
+void KdTree::setIndexLeaves(KdNode *node) {
+	if (node->leaf) {
+		unsigned int first = (unsigned int)(node->leafdata.m_points - m_points),
+					 nOfElements = node->leafdata.m_nOfElements;
+		node->indexOnly = true;
+		node->indexleafdata.m_indices = m_indices + first;
+		node->indexleafdata.m_nOfElements = nOfElements;
+		node->indexleafdata.m_positions = m_positions;
+	}
+	else {
+		setIndexLeaves(node->nodedata.m_children[0]);
+		setIndexLeaves(node->nodedata.m_children[1]);
+	}
+}
+
+void KdTree::splitPoints(KdTreePoint *points, const int n, const Vector3D &maximum, const Vector3D &minimum, unsigned char &dim, float &cutVal, int &mid,
+						 KdTreePoint *scratch, const int nofThreads) {
 	Vector3D diff = maximum - minimum;
-	unsigned char dim;
 	// get longest axis
 	if (diff[0] > diff[1]) {
 		if (diff[0] > diff[2]) {
@@ -216,58 +868,36 @@ void KdTree::createTree(KdNode &node, int start, int end, Vector3D &maximum, Vec
 		}
 	}
 	
-  node.nodedata.m_dim = (unsigned char)dim;
-  float bestCut = (maximum[dim]+minimum[dim])/2.0f;
+	float bestCut = (maximum[dim]+minimum[dim])/2.0f;
 	float min, max;
-	getMinMax(m_points+start, n, dim, min, max);	// find min/max coordinates
-	if (bestCut < min)		// slide to min or max as needed
-	node.nodedata.m_cutval = min;
-    else if (bestCut > max)
-	node.nodedata.m_cutval = max;
-    else
-	node.nodedata.m_cutval = bestCut;
-
-    int br1, br2;
-	// permute points accordingly
-	splitAtMid(m_points+start, n, dim, node.nodedata.m_cutval, br1, br2);	
-
-	if (bestCut < min) mid = start+1;
-    else if (bestCut > max) mid = end-1;
-    else if (br1 > n/2.0) mid = start+br1;
-    else if (br2 < n/2.0) mid = start+br2;
-    else mid = start + (n>>1);
-
-	if (mid-start <= m_bucketSize) {
-		// new leaf
-		KdNode* leaf = new KdNode(true);
-		node.nodedata.m_children[0] = leaf;
-		leaf->leafdata.m_points = (m_points+start);
-		leaf->leafdata.m_nOfElements = mid-start;
+	// find min/max coordinates
+	if (scratch != 0) {
+		getMinMaxParallel(points, n, dim, min, max, nofThreads);
 	}
 	else {
-		// new node
-		KdNode* child = new KdNode(false);
-		node.nodedata.m_children[0] = child;
-		float oldMax = maximum[dim];
-		maximum[dim] = node.nodedata.m_cutval;
-		createTree(*child, start, mid, maximum, minimum);
-		maximum[dim] = oldMax;
+		getMinMax(points, n, dim, min, max);
 	}
-	
-	if (end-mid <= m_bucketSize) {
-		// new leaf
-		KdNode* _leaf = new KdNode(true);
-		node.nodedata.m_children[1] = _leaf;
-		_leaf->leafdata.m_points = (m_points+mid);
-		_leaf->leafdata.m_nOfElements = end-mid;
+	if (bestCut < min)		// slide to min or max as needed
+		cutVal = min;
+	else if (bestCut > max)
+		cutVal = max;
+	else
+		cutVal = bestCut;
+
+	int br1, br2;
+	// permute points accordingly
+	if (scratch != 0) {
+		splitAtMidParallel(points, scratch, n, dim, cutVal, br1, br2, nofThreads);
 	}
 	else {
-		// new node
-      minimum[dim] = node.nodedata.m_cutval;
-	  KdNode* child = new KdNode(false);
-	  node.nodedata.m_children[1] = child;
-	  createTree(*child, mid, end, maximum, minimum);
+		splitAtMid(points, n, dim, cutVal, br1, br2);
 	}
+
+	if (bestCut < min) mid = 1;
+	else if (bestCut > max) mid = n-1;
+	else if (br1 > n/2.0) mid = br1;
+	else if (br2 < n/2.0) mid = br2;
+	else mid = (n>>1);
 }
 
 void KdTree::getSpread(KdTreePoint* points, int nOfPoints, Vector3D &maximum, Vector3D &minimum) {
@@ -349,48 +979,186 @@ void KdTree::splitAtMid(KdTreePoint *points, int nOfPoints, int dim, float cutVa
     br2 = l;			// now: points[br1..br2-1] == cutVal < points[br2..n-1]
 }
 
-void KdNode::queryNode(float rd, PQueue* queryPriorityQueue, Vector3D const& queryPosition, Vector3D& queryOffsets) {
-	
-	if (!leaf)
-	{
+void KdTree::getMinMaxParallel(KdTreePoint *points, int nOfPoints, int dim, float &mmin, float &mmax, int nofThreads) {
+	std::vector<float> blockMin(nofThreads), blockMax(nofThreads);
+	int blockSize = (nOfPoints + nofThreads - 1) / nofThreads;
+	int b;
+
+	#pragma omp parallel for num_threads(nofThreads)
+	for (b=0; b<nofThreads; b++) {
+		int first = b * blockSize,
+			last = (first + blockSize < nOfPoints) ? first + blockSize : nOfPoints;
+		if (first < last) {
+			getMinMax(points+first, last-first, dim, blockMin[b], blockMax[b]);
+		}
+		else {
+			blockMin[b] = FLT_MAX;
+			blockMax[b] = -FLT_MAX;
+		}
+	}
+
+	mmin = blockMin[0];
+	mmax = blockMax[0];
+	for (b=1; b<nofThreads; b++) {
+		if (blockMin[b] < mmin) {
+			mmin = blockMin[b];
+		}
+		if (blockMax[b] > mmax) {
+			mmax = blockMax[b];
+		}
+	}
+}
+
+void KdTree::splitAtMidParallel(KdTreePoint *points, KdTreePoint *scratch, int nOfPoints, int dim, float cutVal, int &br1, int &br2, int nofThreads) {
+	std::vector<int> nofLess(nofThreads), nofEqual(nofThreads),
+					 lessStart(nofThreads), equalStart(nofThreads), greaterStart(nofThreads);
+	int blockSize = (nOfPoints + nofThreads - 1) / nofThreads;
+	int b;
+
+	// count the points of each block on either side of the cut value
+	#pragma omp parallel for num_threads(nofThreads)
+	for (b=0; b<nofThreads; b++) {
+		int first = b * blockSize,
+			last = (first + blockSize < nOfPoints) ? first + blockSize : nOfPoints;
+		int less = 0, equal = 0;
+		for (int i=first; i<last; i++) {
+			if (points[i].pos[dim] < cutVal) {
+				less++;
+			}
+			else if (points[i].pos[dim] == cutVal) {
+				equal++;
+			}
+		}
+		nofLess[b] = less;
+		nofEqual[b] = equal;
+	}
+
+	// the smaller points of all blocks come first, then the equal ones, then the larger ones
+	br1 = 0;
+	br2 = 0;
+	for (b=0; b<nofThreads; b++) {
+		br1 += nofLess[b];
+		br2 += nofEqual[b];
+	}
+	br2 += br1;
+	int less = 0, equal = br1, greater = br2;
+	for (b=0; b<nofThreads; b++) {
+		int first = b * blockSize,
+			last = (first + blockSize < nOfPoints) ? first + blockSize : nOfPoints;
+		lessStart[b] = less;
+		equalStart[b] = equal;
+		greaterStart[b] = greater;
+		less += nofLess[b];
+		equal += nofEqual[b];
+		if (first < last) {
+			greater += (last - first) - nofLess[b] - nofEqual[b];
+		}
+	}
+
+	#pragma omp parallel for num_threads(nofThreads)
+	for (b=0; b<nofThreads; b++) {
+		int first = b * blockSize,
+			last = (first + blockSize < nOfPoints) ? first + blockSize : nOfPoints;
+		int l = lessStart[b], e = equalStart[b], g = greaterStart[b];
+		for (int i=first; i<last; i++) {
+			if (points[i].pos[dim] < cutVal) {
+				scratch[l++] = points[i];
+			}
+			else if (points[i].pos[dim] == cutVal) {
+				scratch[e++] = points[i];
+			}
+			else {
+				scratch[g++] = points[i];
+			}
+		}
+	}
+
+	#pragma omp parallel for num_threads(nofThreads)
+	for (b=0; b<nofThreads; b++) {
+		int first = b * blockSize,
+			last = (first + blockSize < nOfPoints) ? first + blockSize : nOfPoints;
+		for (int i=first; i<last; i++) {
+			points[i] = scratch[i];
+		}
+	}
+}
+
+void KdNode::queryRadiusNode(float rd, const float sqrRadius, Vector3D const& queryPosition, Vector3D& queryOffsets, std::vector<Neighbour> &neighbours) const {
+	if (!leaf) {
 		float old_off = queryOffsets[nodedata.m_dim];
 		float new_off = queryPosition[nodedata.m_dim] - nodedata.m_cutval;
-		if (new_off < 0) {
-			nodedata.m_children[0]->queryNode(rd, queryPriorityQueue, 
-											  queryPosition, queryOffsets);
-			rd = rd - SQR(old_off) + SQR(new_off);
-			if (rd < queryPriorityQueue->getMaxWeight()) {
-		  		queryOffsets[nodedata.m_dim] = new_off;
-		  		nodedata.m_children[1]->queryNode(rd, queryPriorityQueue, 
-		  	   	 								queryPosition, queryOffsets);
-		  		queryOffsets[nodedata.m_dim] = old_off;
+		int nearChild = (new_off < 0) ? 0 : 1;
+		nodedata.m_children[nearChild]->queryRadiusNode(rd, sqrRadius, queryPosition, queryOffsets, neighbours);
+		rd = rd - SQR(old_off) + SQR(new_off);
+		if (rd <= sqrRadius) {
+			queryOffsets[nodedata.m_dim] = new_off;
+			nodedata.m_children[1-nearChild]->queryRadiusNode(rd, sqrRadius, queryPosition, queryOffsets, neighbours);
+			queryOffsets[nodedata.m_dim] = old_off;
+		}
+	}
+	else if (indexOnly) {
+		Neighbour neighbour;
+		for (unsigned int i=0; i<indexleafdata.m_nOfElements; i++) {
+			neighbour.index = indexleafdata.m_indices[i];
+			neighbour.weight = (indexleafdata.m_positions[neighbour.index] - queryPosition).getSquaredLength();
+			if (neighbour.weight <= sqrRadius) {
+				neighbours.push_back(neighbour);
 			}
 		}
-		else {
-			nodedata.m_children[1]->queryNode(rd, queryPriorityQueue, 
-										  queryPosition, queryOffsets);
-			rd = rd - SQR(old_off) + SQR(new_off);
-			if (rd < queryPriorityQueue->getMaxWeight()) {
-		  		queryOffsets[nodedata.m_dim] = new_off;
-		  		nodedata.m_children[0]->queryNode(rd, queryPriorityQueue, 
-												queryPosition, queryOffsets);
-		  		queryOffsets[nodedata.m_dim] = old_off;
+	}
+	else {
+		Neighbour neighbour;
+		const KdTreePoint* point = leafdata.m_points;
+		for (unsigned int i=0; i<leafdata.m_nOfElements; i++) {
+			neighbour.weight = (point->pos - queryPosition).getSquaredLength();
+			if (neighbour.weight <= sqrRadius) {
+				neighbour.index = point->index;
+				neighbours.push_back(neighbour);
 			}
+			point++;
 		}
 	}
-  	else {
-		
-		float sqrDist;
-		//use pointer arithmetic to speed up the linear traversing
-		KdTreePoint* point = leafdata.m_points;
+}
+
+bool KdNode::countRadiusNode(float rd, const float sqrRadius, Vector3D const& queryPosition, Vector3D& queryOffsets, unsigned int &count, const unsigned int maxCount) const {
+	if (!leaf) {
+		float old_off = queryOffsets[nodedata.m_dim];
+		float new_off = queryPosition[nodedata.m_dim] - nodedata.m_cutval;
+		int nearChild = (new_off < 0) ? 0 : 1;
+		if (nodedata.m_children[nearChild]->countRadiusNode(rd, sqrRadius, queryPosition, queryOffsets, count, maxCount)) {
+			return true;
+		}
+		rd = rd - SQR(old_off) + SQR(new_off);
+		if (rd <= sqrRadius) {
+			queryOffsets[nodedata.m_dim] = new_off;
+			bool isDone = nodedata.m_children[1-nearChild]->countRadiusNode(rd, sqrRadius, queryPosition, queryOffsets, count, maxCount);
+			queryOffsets[nodedata.m_dim] = old_off;
+			return isDone;
+		}
+	}
+	else if (indexOnly) {
+		for (unsigned int i=0; i<indexleafdata.m_nOfElements; i++) {
+			if ((indexleafdata.m_positions[indexleafdata.m_indices[i]] - queryPosition).getSquaredLength() <= sqrRadius) {
+				count++;
+				if (count >= maxCount) {
+					return true;
+				}
+			}
+		}
+	}
+	else {
+		const KdTreePoint* point = leafdata.m_points;
 		for (unsigned int i=0; i<leafdata.m_nOfElements; i++) {
-			sqrDist = (point->pos - queryPosition).getSquaredLength();
-			if (sqrDist < queryPriorityQueue->getMaxWeight()) {
-				queryPriorityQueue->insert(point->index, sqrDist);
+			if ((point->pos - queryPosition).getSquaredLength() <= sqrRadius) {
+				count++;
+				if (count >= maxCount) {
+					return true;
+				}
 			}
 			point++;
-		}		
+		}
 	}
+	return false;
 }
 
 // Some Emacs-Hints -- please don't remove:
@@ -31,19 +31,56 @@
 
 #include "../../../DataTypes/src/Vector3D.h"
 #include "PriorityQueue.h"
+#include <float.h>
+#include <limits.h>
 //#include "../../src/CoreDLL.h"
 #include <vector>
 
 #define SQR(x) ((x)*(x))
 
+// nodes with fewer points are built sequentially
+#define KDTREE_PARALLEL_CUTOFF 65536
+
+// exact neighbour graphs of trees with at least this many points are computed with the dual tree search
+#define KDTREE_DUAL_TREE_CUTOFF 262144
+
 typedef MaxPriorityQueue<int, float> PQueue;
 typedef PQueue::Element Neighbour;
 
+struct flatKdNode;
+typedef struct flatKdNode FlatKdNode;
+
 typedef struct kdTreePoint {
 	Vector3D	pos;
 	int			index;
 } KdTreePoint;
 
+/**
+ * The caller owned state of a nearest neighbour query. The size of the <code>queue</code>
+ * (see <code>MaxPriorityQueue::setSize</code>) is the number of query neighbours, and
+ * <code>neighbours</code> must point to a buffer with room for as many neighbours. 
+ * A <code>KdTree</code> can be queried from several threads at the same time, as long as
+ * each thread uses its own context.
+ */
+typedef struct kdQueryContext {
+	PQueue			queue;				// the heap of the current query
+	Neighbour		*neighbours;		// output span, receives the neighbours sorted by increasing distance
+} KdQueryContext;
+
+/**
+ * The nearest neighbours of all points of a k-d tree in compressed row storage.
+ * The neighbours of point i are stored in <code>indices</code> and <code>sqrDistances</code>
+ * at the positions <code>offsets[i]</code> .. <code>offsets[i+1]-1</code>, sorted by 
+ * increasing distance. The point itself is its own neighbour 0, unless self matches
+ * were excluded (see <code>KdTree::computeDualTreeNeighbourGraph</code>).
+ */
+typedef struct neighbourGraph {
+	unsigned int				nofNeighbours;		// the number of neighbours queried per point
+	std::vector<unsigned int>	offsets;			// start of the neighbours of each point, plus one end entry
+	std::vector<unsigned int>	indices;			// the position indices of the neighbours
+	std::vector<float>			sqrDistances;		// the squared distances to the neighbours
+} NeighbourGraph;
+
 /**
  * Node of a kd tree. The node stands for a box in space.
  *
@@ -53,6 +90,7 @@ typedef struct kdTreePoint {
 class KdNode {
 public:
   bool leaf;
+  bool indexOnly;					// a leaf of an index only tree, see KdTree
   union {
 	struct {
 	  KdNode *m_children[2];
@@ -63,6 +101,11 @@ public:
 	  KdTreePoint *m_points;
 	  unsigned int m_nOfElements;
 	} leafdata;
+	struct {
+	  const unsigned int *m_indices;	// the position indices of the leaf points
+	  unsigned int m_nOfElements;
+	  const Vector3D *m_positions;		// all positions of the tree
+	} indexleafdata;
 };
 
 /**
@@ -73,6 +116,7 @@ public:
   KdNode(bool _leaf)
   {
 	leaf = _leaf;
+	indexOnly = false;
 	if (!leaf)
 	  {
 		nodedata.m_children[0] = NULL;
@@ -96,9 +140,86 @@ public:
 	 * @param rd 
 	 *		  the distance of the query position to the node box
 	 * @param queryPriorityQueue
-	 *		  a priority queue
+	 *		  a priority queue, either a <code>PQueue</code> or a <code>KnnArray</code>
+	 * @param pruneFactor
+	 *		  a child is only visited if its distance times this factor is smaller than the 
+	 *		  distance of the farthest neighbour; 1 for exact queries, (1+eps)^2 for approximate ones
+	 */
+	template<class Queue>
+	inline void queryNode(float rd, Queue* queryPriorityQueue, Vector3D const& queryPosition, Vector3D& queryOffsets, const float pruneFactor);
+
+	/**
+	 * look for all points within a radius
+	 * @param rd 
+	 *		  the distance of the query position to the node box
+	 * @param sqrRadius
+	 *		  the squared radius
+	 * @param neighbours
+	 *		  the found points are appended
 	 */
-	void queryNode(float rd, PQueue* queryPriorityQueue, Vector3D const& queryPosition, Vector3D& queryOffsets);
+	void queryRadiusNode(float rd, const float sqrRadius, Vector3D const& queryPosition, Vector3D& queryOffsets, std::vector<Neighbour> &neighbours) const;
+
+	/**
+	 * count the points within a radius
+	 * @param rd 
+	 *		  the distance of the query position to the node box
+	 * @param sqrRadius
+	 *		  the squared radius
+	 * @param count
+	 *		  the number of points found so far
+	 * @param maxCount
+	 *		  the count at which the search stops
+	 * @return true if <code>maxCount</code> has been reached
+	 */
+	bool countRadiusNode(float rd, const float sqrRadius, Vector3D const& queryPosition, Vector3D& queryOffsets, unsigned int &count, const unsigned int maxCount) const;
+};
+
+/**
+ * The result of a query for a number of neighbours <code>K</code> which is known at
+ * compile time. The neighbours are kept sorted by increasing distance, a new neighbour
+ * is inserted by shifting the farther ones one slot up. For <code>K</code> = 9 this is
+ * faster than the heap of a <code>PQueue</code>, and the result needs no final sorting.
+ * Empty slots have index -1 and the maximum distance of the query.
+ */
+template<unsigned int K>
+class KnnArray {
+
+public:
+	/**
+	 * empties the array
+	 *
+	 * @param maxSqrDistance
+	 *			the maximal squared distance of a neighbour
+	 */
+	inline void init(const float maxSqrDistance) {
+		for (unsigned int i=0; i<K; i++) {
+			m_neighbours[i].index = -1;
+			m_neighbours[i].weight = maxSqrDistance;
+		}
+	}
+
+	/**
+	 * gets the distance of the farthest neighbour, or the maximal distance if the array is not full
+	 */
+	inline float getMaxWeight() const {
+		return m_neighbours[K-1].weight;
+	}
+
+	/**
+	 * inserts a neighbour which is closer than <code>getMaxWeight()</code>
+	 */
+	inline void insert(const int index, const float weight) {
+		// the shift stops at the new slot, a branch free insertion into all K slots is not faster
+		unsigned int i = K-1;
+		while (i > 0 && m_neighbours[i-1].weight > weight) {
+			m_neighbours[i] = m_neighbours[i-1];
+			i--;
+		}
+		m_neighbours[i].index = index;
+		m_neighbours[i].weight = weight;
+	}
+
+	Neighbour	m_neighbours[K];
 };
 
 
@@ -125,8 +246,13 @@ public:
 	 *			number of points
 	 * @param maxBucketSize
 	 *			number of points per bucket
+	 * @param indexOnly
+	 *			if true, the tree does not keep a copy of the positions: its leaves only refer to
+	 *			a permuted array of position indices, and the points are read from 
+	 *			<code>positions</code>, which must stay valid as long as the tree. This saves 12 of
+	 *			the 16 bytes per point, the queries are a bit slower because of the indirection.
 	 */
-	KdTree(const Vector3D *positions, const unsigned int nOfPositions, const unsigned int maxBucketSize);
+	KdTree(const Vector3D *positions, const unsigned int nOfPositions, const unsigned int maxBucketSize, const bool indexOnly = false);
 	/**
 	 * Destructor
 	 */
@@ -159,6 +285,21 @@ public:
 	 *			the number of nearest neighbours
 	 */
 	void setNOfNeighbours (const unsigned int newNOfNeighbours);
+	/**
+	 * sets the allowed error of the nearest neighbour queries: the distance of the i-th found
+	 * neighbour is at most (1+<code>epsilon</code>) times the distance of the true i-th nearest
+	 * neighbour. With 0, the default, the queries are exact. The error applies to all kNN queries
+	 * (including <code>computeNeighbourGraph</code>), but not to the radius queries and not
+	 * to <code>computeDualTreeNeighbourGraph</code>.
+	 *
+	 * @param epsilon
+	 *			the allowed relative error of the neighbour distances
+	 */
+	void setApproximationError (const float epsilon);
+	/**
+	 * @return the allowed relative error of the neighbour distances
+	 */
+	float getApproximationError () const;
 	/**
 	 * get the index of the i-th nearest neighbour to the query point
 	 * i must be smaller than the number of found neighbours
@@ -177,6 +318,10 @@ public:
 	 * @return the position of the i-th nearest neighbour
 	 */
 	inline Vector3D const& getNeighbourPosition(const unsigned int i) const;
+	/**
+	 * @return true, if the tree only keeps the position indices, see the constructor
+	 */
+	inline bool isIndexOnly() const;
 	/**
 	 * get the squared distance of the query point and its i-th nearest neighbour
 	 * i must be smaller than the number of found neighbours
@@ -204,6 +349,239 @@ public:
 	 */
 	inline unsigned int const& getNOfQueryNeighbours() const;
 
+	/**
+	 * look for the nearest neighbours at <code>position</code>, using the caller owned 
+	 * <code>context</code> instead of the state of this tree. This method is reentrant.
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param context
+	 *			the queue and the output buffer of the query
+	 * @return the number of found neighbours, which are stored in <code>context.neighbours</code>
+	 */
+	unsigned int queryPosition(const Vector3D &position, KdQueryContext &context) const;
+	/**
+	 * look for the nearest neighbours with a maximal squared distance <code>maxSqrDistance</code>,
+	 * using the caller owned <code>context</code> instead of the state of this tree. This method is reentrant.
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param maxSqrDistance
+	 *			the maximal squared distance of a nearest neighbour
+	 * @param context
+	 *			the queue and the output buffer of the query
+	 * @return the number of found neighbours, which are stored in <code>context.neighbours</code>
+	 */
+	unsigned int queryRange(const Vector3D &position, const float maxSqrDistance, KdQueryContext &context) const;
+
+	/**
+	 * look for the <code>K</code> nearest neighbours with a maximal squared distance 
+	 * <code>maxSqrDistance</code>. The same as <code>queryRange</code>, but the 
+	 * neighbours are collected in a <code>KnnArray</code> instead of a heap, so
+	 * no query context is needed. This method is reentrant.
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param neighbours
+	 *			returns the neighbours sorted by increasing distance, must have room for <code>K</code> neighbours
+	 * @param maxSqrDistance
+	 *			the maximal squared distance of a nearest neighbour
+	 * @return the number of found neighbours
+	 */
+	template<unsigned int K>
+	inline unsigned int knn(const Vector3D &position, Neighbour *neighbours, const float maxSqrDistance = FLT_MAX) const;
+
+	/**
+	 * continues a nearest neighbour query in a caller supplied <code>queue</code>, which may
+	 * already hold neighbours, e.g. from other trees. The points of this tree which are closer 
+	 * than <code>queue->getMaxWeight()</code> are inserted with their position index. The
+	 * queue is neither initialized nor emptied. This method is reentrant.
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param queue
+	 *			a priority queue with the interface of <code>PQueue</code>
+	 */
+	template<class Queue>
+	inline void queryQueue(const Vector3D &position, Queue *queue) const;
+
+	/**
+	 * looks for all points with a squared distance of at most <code>sqrRadius</code> to 
+	 * <code>position</code>. Unlike <code>queryRange</code>, the number of results is not 
+	 * limited by the number of query neighbours. The found points are appended to
+	 * <code>neighbours</code> in no particular order. This method is reentrant.
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param sqrRadius
+	 *			the squared radius
+	 * @param neighbours
+	 *			the found points and their squared distances are appended
+	 * @return the number of found points
+	 */
+	unsigned int queryRadius(const Vector3D &position, const float sqrRadius, std::vector<Neighbour> &neighbours) const;
+	/**
+	 * looks for the points within <code>sqrRadius</code> of each of the <code>positions</code>, 
+	 * see <code>queryRadius</code>. The results are appended in compressed row storage: if
+	 * <code>offsets</code> is empty, the size of <code>neighbours</code> is appended first, then
+	 * the size of <code>neighbours</code> after each position. Thus the points found for the 
+	 * i-th position are <code>neighbours[offsets[i]]</code> .. <code>neighbours[offsets[i+1]-1]</code>,
+	 * also if <code>neighbours</code> was not empty, and consecutive calls append further rows.
+	 *
+	 * @param positions
+	 *			the positions to query with
+	 * @param nofPositions
+	 *			the number of positions
+	 * @param sqrRadius
+	 *			the squared radius
+	 * @param offsets
+	 *			the end of the neighbours of each position is appended
+	 * @param neighbours
+	 *			the found points of all positions are appended
+	 */
+	void queryRadius(const Vector3D *positions, const unsigned int nofPositions, const float sqrRadius, std::vector<unsigned int> &offsets, std::vector<Neighbour> &neighbours) const;
+	/**
+	 * counts the points with a squared distance of at most <code>sqrRadius</code> to 
+	 * <code>position</code>. The search stops as soon as <code>maxCount</code> points are
+	 * found, e.g. when only a minimum density has to be checked. This method is reentrant.
+	 *
+	 * @param position
+	 *			the position of the point to query with
+	 * @param sqrRadius
+	 *			the squared radius
+	 * @param maxCount
+	 *			the count at which the search stops
+	 * @return the number of found points, at most <code>maxCount</code>
+	 */
+	unsigned int countRadius(const Vector3D &position, const float sqrRadius, const unsigned int maxCount = UINT_MAX) const;
+
+	/**
+	 * computes the <code>nofNeighbours</code> nearest neighbours of all positions of this tree
+	 * at once. The queries are distributed over all available threads. The number of 
+	 * query neighbours set by <code>setNOfNeighbours</code> and the result of the last
+	 * query are not affected. Exact graphs of trees with at least <code>KDTREE_DUAL_TREE_CUTOFF</code>
+	 * points are computed with <code>computeDualTreeNeighbourGraph</code>, which only differs
+	 * in the order of neighbours at the same distance.
+	 *
+	 * @param nofNeighbours
+	 *			the number of nearest neighbours per position
+	 * @param graph
+	 *			returns the neighbours of all positions
+	 */
+	void computeNeighbourGraph(const unsigned int nofNeighbours, NeighbourGraph &graph) const;
+
+	/**
+	 * computes the same graph as <code>computeNeighbourGraph</code> with a dual tree traversal:
+	 * the tree is traversed as query tree and as reference tree at the same time, and a pair of
+	 * nodes is skipped as soon as their boxes are farther apart than the current neighbours of
+	 * all query points in the query node. The subtrees of the query tree are distributed over 
+	 * all available threads.
+	 *
+	 * @param nofNeighbours
+	 *			the number of nearest neighbours per position
+	 * @param graph
+	 *			returns the neighbours of all positions
+	 * @param excludeSelf
+	 *			if true, a position is not its own neighbour, and all <code>nofNeighbours</code> 
+	 *			slots hold other positions
+	 */
+	void computeDualTreeNeighbourGraph(const unsigned int nofNeighbours, NeighbourGraph &graph, const bool excludeSelf = false) const;
+
+	/**
+	 * saves this tree as a snapshot: a header with a hash of the positions, the nodes in
+	 * depth first order with the encoding of <code>FlatKdNode</code>, and the permutation
+	 * of the position indices into tree order. The snapshot holds offsets instead of pointers,
+	 * so it can be used from any address, e.g. directly from a memory mapped file.
+	 *
+	 * @param fileName
+	 *			the file to write
+	 * @return true, if the file has been written
+	 * @see loadSnapshot
+	 */
+	bool saveSnapshot(const char *fileName) const;
+	/**
+	 * creates a k-d tree from a snapshot written by <code>saveSnapshot</code>, without splitting
+	 * any points: only the nodes are allocated and the permutation is copied. The snapshot is
+	 * only used if it has been saved for the same <code>positions</code>, which is checked with
+	 * <code>hashPositions</code>. The snapshot memory is not needed anymore after this call.
+	 *
+	 * @param positions
+	 *			point positions
+	 * @param nOfPositions
+	 *			number of points
+	 * @param snapshot
+	 *			the snapshot, e.g. a memory mapped snapshot file
+	 * @param snapshotSize
+	 *			the size of the snapshot in bytes
+	 * @param indexOnly
+	 *			see the constructor
+	 * @return the tree, or 0 if the snapshot is invalid or does not belong to the positions
+	 */
+	static KdTree *loadSnapshot(const Vector3D *positions, const unsigned int nOfPositions, const void *snapshot, const size_t snapshotSize,
+		                        const bool indexOnly = false);
+	/**
+	 * creates a k-d tree from a snapshot file, see <code>loadSnapshot</code>
+	 *
+	 * @param fileName
+	 *			the snapshot file
+	 * @return the tree, or 0 if the file cannot be read or does not belong to the positions
+	 */
+	static KdTree *loadSnapshotFile(const Vector3D *positions, const unsigned int nOfPositions, const char *fileName, const bool indexOnly = false);
+	/**
+	 * computes the hash of the positions which is stored in a snapshot
+	 *
+	 * @param positions
+	 *			point positions
+	 * @param nOfPositions
+	 *			number of points
+	 * @return a 64 bit FNV-1a hash of the coordinates
+	 */
+	static unsigned long long hashPositions(const Vector3D *positions, const unsigned int nOfPositions);
+
+	/**
+	 * splits the points of a node using the sliding midpoint splitting rule: the points are
+	 * split at the middle of the longest side of the node box, and the cut slides to the
+	 * nearest point if all points lie on one side of it. The points are permuted such that
+	 * <code>points[0..mid-1]</code> belong to the low child and <code>points[mid..n-1]</code>
+	 * to the high child.
+	 *
+	 * @param points
+	 *			the points of the node
+	 * @param n
+	 *			the number of points
+	 * @param maximum
+	 *			the high corner of the node box
+	 * @param minimum
+	 *			the low corner of the node box
+	 * @param dim
+	 *			returns the split dimension
+	 * @param cutVal
+	 *			returns the cut value
+	 * @param mid
+	 *			returns the number of points of the low child
+	 * @param scratch
+	 *			if not <code>NULL</code>, a buffer of <code>n</code> points which is used to
+	 *			split the points with <code>nofThreads</code> threads. The low and the high
+	 *			points then keep their relative order, otherwise they are swapped in place
+	 * @param nofThreads
+	 *			the number of threads used if <code>scratch</code> is given
+	 */
+	static void splitPoints(KdTreePoint *points, const int n, const Vector3D &maximum, const Vector3D &minimum, unsigned char &dim, float &cutVal, int &mid,
+		                    KdTreePoint *scratch = 0, const int nofThreads = 1);
+	/**
+	 * gets the axis aligned bounding box of points
+	 *
+	 * @param points
+	 *			the points
+	 * @param nOfPoints
+	 *			the number of points
+	 * @param maximum
+	 *			returns the high corner of the box
+	 * @param minimum
+	 *			returns the low corner of the box
+	 */
+	static void getSpread(KdTreePoint* points, int nOfPoints, Vector3D &maximum, Vector3D &minimum);
+
 protected:
 	/**
 	 * compute distance from point to box
@@ -218,18 +596,14 @@ protected:
      *      distance to the box in each dimension
 	 * @return the squared distance to the box
 	 */
-	inline float computeBoxSqrDistance(const Vector3D &q, const Vector3D &lo, const Vector3D &hi, Vector3D &offset);
-	/**
-	 * computes the enclosing box of the points
-	 *
-	 * @param lowCorner
-	 *			the low corner of the enclosing box is returned
-	 * @param hiCorner
-	 *			the high corner of the enclosing box is returned
-	 */
-	void computeEnclosingBoundingBox(Vector3D &lowCorner, Vector3D &hiCorner);
+	inline float computeBoxSqrDistance(const Vector3D &q, const Vector3D &lo, const Vector3D &hi, Vector3D &offset) const;
 	/** 
-	 * creates the tree using the sliding midpoint splitting rule
+	 * creates the tree using the sliding midpoint splitting rule. Nodes with at least 
+	 * <code>KDTREE_PARALLEL_CUTOFF</code> points are split stably through <code>scratch</code>
+	 * with <code>nofThreads</code> threads, and if more than one thread is available, their high
+	 * child is built on a thread of its own while the low child is built on the calling thread.
+	 * Smaller nodes are split in place. Hence the tree, including the order of the points within
+	 * the leaves, does not depend on the number of threads.
 	 * 
 	 * @param node
 	 *		  the node to split
@@ -241,13 +615,19 @@ protected:
 	 *		  maximum coordinates of the data points
 	 * @param minimum
 	 *		  minimum coordinates of the data points
+	 * @param scratch
+	 *		  a buffer with as many points as the data array, if the node has at least
+	 *		  <code>KDTREE_PARALLEL_CUTOFF</code> points
+	 * @param nofThreads
+	 *		  the number of threads available for this subtree
 	 */
-	void createTree(KdNode &node, const int start, const int end, Vector3D &maximum, Vector3D &minimum);
+	void createTree(KdNode &node, const int start, const int end, Vector3D maximum, Vector3D minimum, KdTreePoint *scratch, const int nofThreads);
 
 	
 private:
 	
-	KdTreePoint*				m_points;
+	KdTreePoint*				m_points;			// 0 for an index only tree
+	unsigned int*				m_indices;			// the position indices in tree order, only for an index only tree
 	const Vector3D*				m_positions;
     std::vector<Neighbour>  	m_neighbours;
 	int							m_bucketSize;
@@ -255,21 +635,175 @@ private:
 	unsigned int				m_nOfFoundNeighbours,
 								m_nOfNeighbours,
 								m_nOfPositions;
-	PQueue*						m_queryPriorityQueue;
+	KdQueryContext				m_queryContext;
+	float						m_approximationError,
+								m_pruneFactor;		// (1 + m_approximationError)^2
 	Vector3D					m_boundingBoxLowCorner;
 	Vector3D					m_boundingBoxHighCorner;
 
+	// computeNeighbourGraph for the number of neighbours K
+	template<unsigned int K>
+	void computeFixedNeighbourGraph(NeighbourGraph &graph) const;
+	// creates an empty tree, used by loadSnapshot
+	KdTree();
+	// appends the nodes of the subtree in depth first order, for saveSnapshot
+	void flattenNode(const KdNode *node, std::vector<FlatKdNode> &nodes) const;
+	// creates the subtree of the nodes[index], returns 0 if the nodes are inconsistent
+	KdNode *unflattenNode(const FlatKdNode *nodes, const unsigned int nofNodes, const unsigned int index);
+	// the position index and the position of the i-th point in tree order
+	inline unsigned int getTreePointIndex(const unsigned int i) const;
+	inline const Vector3D &getTreePointPosition(const unsigned int i) const;
+	// replaces the point arrays of the leaves by ranges of m_indices
+	void setIndexLeaves(KdNode *node);
 	// gets the minimum and maximum value of all points at dimension dim
-	void getMinMax(KdTreePoint *points, int nOfPoints, int dim, float &min, float &max);
+	static void getMinMax(KdTreePoint *points, int nOfPoints, int dim, float &min, float &max);
 	// splits the points such that on return for all points:
 	//		points[0..br1-1] < cutVal
 	//		points[br1-1..br2-1] == cutVal
 	//		points[br2..nOfPoints-1] > cutVal
-	void splitAtMid(KdTreePoint *points, int nOfPoints, int dim, float cutVal, int &br1, int &br2);
-	// get the axis aligned bounding box of points
-	void getSpread(KdTreePoint* points, int nOfPoints, Vector3D &maximum, Vector3D &minimum);
+	static void splitAtMid(KdTreePoint *points, int nOfPoints, int dim, float cutVal, int &br1, int &br2);
+	// same as getMinMax and splitAtMid, using nofThreads threads, the points are stably partitioned through scratch
+	static void getMinMaxParallel(KdTreePoint *points, int nOfPoints, int dim, float &min, float &max, int nofThreads);
+	static void splitAtMidParallel(KdTreePoint *points, KdTreePoint *scratch, int nOfPoints, int dim, float cutVal, int &br1, int &br2, int nofThreads);
 };
 
+inline float KdTree::computeBoxSqrDistance(const Vector3D &q, const Vector3D &lo, const Vector3D &hi, Vector3D& offset) const {
+	float dist = 0.0;
+	float t;
+
+	if (q[0] < lo[0]) {
+		t = lo[0] - q[0];
+		offset[0] = t;
+		dist = t*t;
+	}
+	else if (q[0] > hi[0]) {
+		t = q[0] - hi[0];
+		offset[0] = t;
+		dist = t*t;
+	}
+	if (q[1] < lo[1]) {
+		t = lo[1] - q[1];
+		offset[1] = t;
+		dist += t*t;
+	}
+	else if (q[1] > hi[1]) {
+		t = q[1] - hi[1];
+		offset[1] = t;
+		dist += t*t;
+	}
+	if (q[2] < lo[2]) {
+		t = lo[2] - q[2];
+		offset[2] = t;
+		dist += t*t;
+	}
+	else if (q[2] > hi[2]) {
+		t = q[2] - hi[2];
+		offset[2] = t;
+		dist += t*t;
+	}
+
+	return dist;
+}
+
+template<unsigned int K>
+inline unsigned int KdTree::knn(const Vector3D &position, Neighbour *neighbours, const float maxSqrDistance) const {
+	Vector3D queryOffsets(0,0,0);
+	KnnArray<K> result;
+
+	float sqrDist = computeBoxSqrDistance(position, m_boundingBoxLowCorner, m_boundingBoxHighCorner, queryOffsets);
+	if (sqrDist > maxSqrDistance) {
+		return 0;
+	}
+
+	result.init(maxSqrDistance);
+	m_root->queryNode(sqrDist, &result, position, queryOffsets, m_pruneFactor);
+
+	unsigned int nOfFoundNeighbours = 0;
+	while (nOfFoundNeighbours < K && result.m_neighbours[nOfFoundNeighbours].index != -1) {
+		neighbours[nOfFoundNeighbours] = result.m_neighbours[nOfFoundNeighbours];
+		nOfFoundNeighbours++;
+	}
+	return nOfFoundNeighbours;
+}
+
+template<class Queue>
+inline void KdTree::queryQueue(const Vector3D &position, Queue *queue) const {
+	Vector3D queryOffsets(0,0,0);
+
+	float sqrDist = computeBoxSqrDistance(position, m_boundingBoxLowCorner, m_boundingBoxHighCorner, queryOffsets);
+	if (sqrDist < queue->getMaxWeight()) {
+		m_root->queryNode(sqrDist, queue, position, queryOffsets, m_pruneFactor);
+	}
+}
+
+template<class Queue>
+inline void KdNode::queryNode(float rd, Queue* queryPriorityQueue, Vector3D const& queryPosition, Vector3D& queryOffsets, const float pruneFactor) {
+	
+	if (!leaf)
+	{
+		float old_off = queryOffsets[nodedata.m_dim];
+		float new_off = queryPosition[nodedata.m_dim] - nodedata.m_cutval;
+		if (new_off < 0) {
+			nodedata.m_children[0]->queryNode(rd, queryPriorityQueue, 
+											  queryPosition, queryOffsets, pruneFactor);
+			rd = rd - SQR(old_off) + SQR(new_off);
+			if (rd * pruneFactor < queryPriorityQueue->getMaxWeight()) {
+		  		queryOffsets[nodedata.m_dim] = new_off;
+		  		nodedata.m_children[1]->queryNode(rd, queryPriorityQueue, 
+		  	   	 								queryPosition, queryOffsets, pruneFactor);
+		  		queryOffsets[nodedata.m_dim] = old_off;
+			}
+		}
+		else {
+			nodedata.m_children[1]->queryNode(rd, queryPriorityQueue, 
+										  queryPosition, queryOffsets, pruneFactor);
+			rd = rd - SQR(old_off) + SQR(new_off);
+			if (rd * pruneFactor < queryPriorityQueue->getMaxWeight()) {
+		  		queryOffsets[nodedata.m_dim] = new_off;
+		  		nodedata.m_children[0]->queryNode(rd, queryPriorityQueue, 
+												queryPosition, queryOffsets, pruneFactor);
+		  		queryOffsets[nodedata.m_dim] = old_off;
+			}
+		}
+	}
+	else if (indexOnly) {
+		float sqrDist;
+		const unsigned int *index = indexleafdata.m_indices;
+		for (unsigned int i=0; i<indexleafdata.m_nOfElements; i++) {
+			sqrDist = (indexleafdata.m_positions[*index] - queryPosition).getSquaredLength();
+			if (sqrDist < queryPriorityQueue->getMaxWeight()) {
+				queryPriorityQueue->insert(*index, sqrDist);
+			}
+			index++;
+		}
+	}
+  	else {
+		
+		float sqrDist;
+		//use pointer arithmetic to speed up the linear traversing
+		KdTreePoint* point = leafdata.m_points;
+		for (unsigned int i=0; i<leafdata.m_nOfElements; i++) {
+			sqrDist = (point->pos - queryPosition).getSquaredLength();
+			if (sqrDist < queryPriorityQueue->getMaxWeight()) {
+				queryPriorityQueue->insert(point->index, sqrDist);
+			}
+			point++;
+		}		
+	}
+}
+
+inline bool KdTree::isIndexOnly() const {
+	return m_indices != 0;
+}
+
+inline unsigned int KdTree::getTreePointIndex(const unsigned int i) const {
+	return m_indices != 0 ? m_indices[i] : m_points[i].index;
+}
+
+inline const Vector3D &KdTree::getTreePointPosition(const unsigned int i) const {
+	return m_indices != 0 ? m_positions[m_indices[i]] : m_points[i].pos;
+}
+
 inline unsigned int const& KdTree::getNOfFoundNeighbours() const {
 	return m_nOfFoundNeighbours;
 }
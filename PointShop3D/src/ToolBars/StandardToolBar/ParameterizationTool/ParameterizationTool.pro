@@ -4,6 +4,7 @@ TEMPLATE	= lib
 CONFIG		= qt thread plugin $${BUILDTYPE}
 
 HEADERS		= src/BitmapMarker.h \
+		  src/MultiGridHierarchy.h \
 		  src/MultiGridLevel.h \
 		  src/Parameterization.h \
 		  src/ParameterizationDialogImpl.h \
@@ -11,6 +12,7 @@ HEADERS		= src/BitmapMarker.h \
 		  src/SparseLeastSquares.h \
 		  src/SplatBuffer.h
 SOURCES		= src/BitmapMarker.cpp \
+		  src/MultiGridHierarchy.cpp \
 		  src/MultiGridLevel.cpp \
 		  src/Parameterization.cpp \
 		  src/ParameterizationDialogImpl.cpp \
@@ -0,0 +1,243 @@
+// Title:   MultiGridHierarchy.cpp
+//
+// This file is part of the Pointshop3D system.
+// See http://www.pointshop3d.com/ for more information.
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program; if not, write to the Free
+// Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+// MA 02111-1307, USA.
+//
+// Contact info@pointshop3d.com if any conditions of this
+// licensing are not clear to you.
+//
+
+#include <new>
+
+#include "MultiGridHierarchy.h"
+
+
+MultiGridHierarchy::MultiGridHierarchy() {
+
+	levels                    = 0;
+	nofLevels                 = 0;
+	fittingConstraintCapacity = 0;
+
+	block          = 0;
+	unalignedBlock = 0;
+	blockSize      = 0;
+	blockOffset    = 0;
+	fullBlocksSize = 0;
+
+}
+
+MultiGridHierarchy::~MultiGridHierarchy() {
+
+	uint i;
+
+	this->clear();
+
+	for (i = 0; i < fullBlocks.size(); i++) {
+		delete[] fullBlocks[i];
+	}
+	delete[] unalignedBlock;
+
+}
+
+void MultiGridHierarchy::reserve (const size_t nofBytes) {
+
+	if (blockSize - blockOffset < nofBytes) {
+		this->allocateBlock (nofBytes);
+	}
+
+}
+
+void MultiGridHierarchy::setNofLevels (const uint newNofLevels) {
+
+	uint i;
+
+	levels    = (Level *)this->allocate (newNofLevels * sizeof (Level));
+	nofLevels = newNofLevels;
+
+	for (i = 0; i < nofLevels; i++) {
+		levels[i].nofPositions             = 0;
+		levels[i].positions                = 0;
+		levels[i].normals                  = 0;
+		levels[i].uvCoordinates            = 0;
+		levels[i].neighbourHood            = 0;
+		levels[i].cluster                  = 0;
+		levels[i].multiGridLevel           = 0;
+		levels[i].fittingConstraintsU      = 0;
+		levels[i].fittingConstraintsV      = 0;
+		levels[i].fittingConstraintIndices = 0;
+	}
+
+}
+
+uint MultiGridHierarchy::getNofLevels() const {
+	return nofLevels;
+}
+
+MultiGridHierarchy::Level *MultiGridHierarchy::getLevels() const {
+	return levels;
+}
+
+void MultiGridHierarchy::removeEmptyLevels (const uint nofEmptyLevels) {
+
+	uint i;
+
+	for (i = nofEmptyLevels; i < nofLevels; i++) {
+		levels[i - nofEmptyLevels] = levels[i];
+	}
+	nofLevels -= nofEmptyLevels;
+
+}
+
+void MultiGridHierarchy::allocateFittingConstraints (const uint nofFittingConstraints) {
+
+	uint i;
+
+	if (nofFittingConstraints <= fittingConstraintCapacity) {
+		return;
+	}
+
+	// the old arrays are not used anymore, their memory is available again after the next clear
+	for (i = 0; i < nofLevels; i++) {
+		levels[i].fittingConstraintsU      = this->allocateFloats (nofFittingConstraints);
+		levels[i].fittingConstraintsV      = this->allocateFloats (nofFittingConstraints);
+		levels[i].fittingConstraintIndices = this->allocateIndices (nofFittingConstraints);
+	}
+	fittingConstraintCapacity = nofFittingConstraints;
+
+}
+
+Vector3D *MultiGridHierarchy::allocateVectors (const uint n) {
+
+	Vector3D *vectors;
+	uint     i;
+
+	vectors = (Vector3D *)this->allocate (n * sizeof (Vector3D));
+	for (i = 0; i < n; i++) {
+		new (&vectors[i]) Vector3D();
+	}
+
+	return vectors;
+
+}
+
+float *MultiGridHierarchy::allocateFloats (const uint n) {
+	return (float *)this->allocate (n * sizeof (float));
+}
+
+uint *MultiGridHierarchy::allocateIndices (const uint n) {
+	return (uint *)this->allocate (n * sizeof (uint));
+}
+
+void MultiGridHierarchy::clear() {
+
+	uint i;
+
+	for (i = 0; i < nofLevels; i++) {
+
+		// the positions and normals of the levels are not owned by the clusters, as they
+		// are stored in the arrays provided by the hierarchy
+		if (levels[i].multiGridLevel != 0) {
+			delete levels[i].multiGridLevel;
+		}
+		if (levels[i].neighbourHood != 0) {
+			delete levels[i].neighbourHood;
+		}
+		if (levels[i].cluster != 0) {
+			delete levels[i].cluster;
+		}
+
+	}
+
+	levels                    = 0;
+	nofLevels                 = 0;
+	fittingConstraintCapacity = 0;
+
+	if (fullBlocks.size() > 0) {
+
+		// all arrays fit into one block next time
+		for (i = 0; i < fullBlocks.size(); i++) {
+			delete[] fullBlocks[i];
+		}
+		fullBlocks.clear();
+		blockOffset = 0;
+		this->allocateBlock (fullBlocksSize + blockSize);
+		fullBlocksSize = 0;
+
+	}
+	blockOffset = 0;
+
+}
+
+// ***************
+// private methods
+// ***************
+
+void *MultiGridHierarchy::allocate (const size_t nofBytes) {
+
+	size_t paddedSize,
+		   newBlockSize;
+	void   *memory;
+
+	// the next array starts at a multiple of the alignment as well
+	paddedSize = (nofBytes + MULTIGRIDHIERARCHY_ALIGNMENT - 1) & ~((size_t)MULTIGRIDHIERARCHY_ALIGNMENT - 1);
+
+	if (blockSize - blockOffset < paddedSize) {
+		newBlockSize = 2 * blockSize;
+		if (newBlockSize < paddedSize) {
+			newBlockSize = paddedSize;
+		}
+		this->allocateBlock (newBlockSize);
+	}
+
+	memory = block + blockOffset;
+	blockOffset += paddedSize;
+
+	return memory;
+
+}
+
+void MultiGridHierarchy::allocateBlock (const size_t newBlockSize) {
+
+	if (unalignedBlock != 0) {
+
+		if (blockOffset > 0) {
+			// the block is in use until the next clear
+			fullBlocks.push_back (unalignedBlock);
+			fullBlocksSize += blockSize;
+		}
+		else {
+			delete[] unalignedBlock;
+		}
+
+	}
+
+	blockSize = newBlockSize > MULTIGRIDHIERARCHY_MIN_BLOCK_SIZE ? newBlockSize : MULTIGRIDHIERARCHY_MIN_BLOCK_SIZE;
+	blockSize = (blockSize + MULTIGRIDHIERARCHY_ALIGNMENT - 1) & ~((size_t)MULTIGRIDHIERARCHY_ALIGNMENT - 1);
+
+	unalignedBlock = new char[blockSize + MULTIGRIDHIERARCHY_ALIGNMENT - 1];
+	block          = (char *)(((size_t)unalignedBlock + MULTIGRIDHIERARCHY_ALIGNMENT - 1) & ~((size_t)MULTIGRIDHIERARCHY_ALIGNMENT - 1));
+	blockOffset    = 0;
+
+}
+
+// Some Emacs-Hints -- please don't remove:
+//
+//  Local Variables:
+//  mode:C++
+//  tab-width:4
+//  End:
@@ -0,0 +1,170 @@
+// Title:   MultiGridHierarchy.h
+//
+// This file is part of the Pointshop3D system.
+// See http://www.pointshop3d.com/ for more information.
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this program; if not, write to the Free
+// Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+// MA 02111-1307, USA.
+//
+// Contact info@pointshop3d.com if any conditions of this
+// licensing are not clear to you.
+//
+
+#ifndef __MULTIGRIDHIERARCHY_H_
+#define __MULTIGRIDHIERARCHY_H_
+
+#include <stddef.h>
+#include <vector>
+
+#include "../../../../Core/DataStructures/src/NeighbourHood.h"
+#include "../../../../Core/DataStructures/src/Cluster.h"
+#include "../../../../DataTypes/src/Vector3D.h"
+#include "MultiGridLevel.h"
+
+// the alignment of each array allocated by the hierarchy, in bytes (a cache line)
+#define MULTIGRIDHIERARCHY_ALIGNMENT 64
+// the minimum size of a memory block of the hierarchy, in bytes
+#define MULTIGRIDHIERARCHY_MIN_BLOCK_SIZE (1 << 16)
+
+/**
+ * The levels of a multigrid solver, from the coarsest level 0 to the finest level. The arrays of all
+ * levels (positions, normals, uv coordinates and fitting constraints) are allocated from memory blocks
+ * which belong to the hierarchy: each array is aligned to a cache line and follows the previous one
+ * in the same block, and none of them is <code>delete[]</code>d individually. <code>clear</code>
+ * deletes the objects of the levels and makes all memory available again in O(1), the blocks themselves
+ * are kept for the next hierarchy. If more than one block was needed, they are replaced by a single
+ * block which is large enough for all arrays, hence a hierarchy of the same size is allocated from
+ * one contiguous block the next time.
+ */
+class MultiGridHierarchy {
+
+public:
+
+	/**
+	 * A level of the hierarchy. All arrays are allocated with the <code>allocate</code> methods
+	 * of the hierarchy, the objects are <code>new</code>ed and are <code>delete</code>d by
+	 * <code>clear</code>.
+	 */
+	typedef struct level {
+		uint           nofPositions;				// the number of points of the level
+		Vector3D       *positions,					// their positions
+		               *normals;					// and normals
+		float          *uvCoordinates;				// the u coordinates of all points, followed by the v coordinates
+		NeighbourHood  *neighbourHood;				// the neighbourhood of the positions
+		Cluster        *cluster;					// clusters the level into the next coarser one, 0 on the coarsest level
+		MultiGridLevel *multiGridLevel;				// the equations of the level
+		float          *fittingConstraintsU,		// U coordinates of the currently active fitting constraints
+		               *fittingConstraintsV;		// V coordinates of the currently active fitting constraints
+		uint           *fittingConstraintIndices;	// indices of the points in the currently active fitting constraints
+	} Level;
+
+	MultiGridHierarchy();
+	virtual ~MultiGridHierarchy();
+
+	/**
+	 * Makes sure that the arrays which are allocated next are allocated from one block, if they
+	 * need at most <code>nofBytes</code> bytes in total. Each array is padded to a multiple of
+	 * <code>MULTIGRIDHIERARCHY_ALIGNMENT</code> bytes.
+	 *
+	 * @param nofBytes
+	 *        the expected size of the arrays which are allocated next, including their padding
+	 */
+	void reserve (const size_t nofBytes);
+
+	/**
+	 * Creates <code>newNofLevels</code> empty levels: all pointers are 0, the number of points too.
+	 * Must only be called on an empty hierarchy.
+	 *
+	 * @param newNofLevels
+	 *        the number of levels
+	 * @see #clear
+	 */
+	void setNofLevels (const uint newNofLevels);
+
+	/**
+	 * Returns the number of levels.
+	 */
+	uint getNofLevels() const;
+
+	/**
+	 * Returns the levels, the coarsest one first.
+	 *
+	 * @return an array of <code>getNofLevels</code> levels; must <em>not</em> be <code>delete[]</code>d
+	 */
+	Level *getLevels() const;
+
+	/**
+	 * Removes the first <code>nofEmptyLevels</code> levels, which must still be empty, e.g. because
+	 * the coarsest level was reached before all levels were used. The other levels are moved to the front.
+	 */
+	void removeEmptyLevels (const uint nofEmptyLevels);
+
+	/**
+	 * Makes sure that the fitting constraint arrays of all levels can hold <code>nofFittingConstraints</code>
+	 * constraints. They are only allocated again if they are too small, hence the fitting constraints can be
+	 * set for each solution without allocating more and more memory.
+	 */
+	void allocateFittingConstraints (const uint nofFittingConstraints);
+
+	/**
+	 * Allocates an array of <code>n</code> <code>Vector3D</code>s; must <em>not</em> be <code>delete[]</code>d.
+	 */
+	Vector3D *allocateVectors (const uint n);
+
+	/**
+	 * Allocates an array of <code>n</code> <code>float</code>s; must <em>not</em> be <code>delete[]</code>d.
+	 */
+	float *allocateFloats (const uint n);
+
+	/**
+	 * Allocates an array of <code>n</code> <code>uint</code>s; must <em>not</em> be <code>delete[]</code>d.
+	 */
+	uint *allocateIndices (const uint n);
+
+	/**
+	 * Deletes the objects of all levels and removes all levels. The memory of all arrays is available
+	 * again for the next hierarchy.
+	 */
+	void clear();
+
+private:
+
+	Level              *levels;
+	uint               nofLevels,
+	                   fittingConstraintCapacity;	// the number of fitting constraints the arrays of the levels can hold
+
+	char               *block,						// the block the arrays are currently allocated from, aligned
+	                   *unalignedBlock;				// the same block as allocated
+	size_t             blockSize,					// the usable size of the block
+	                   blockOffset,					// the number of bytes already allocated from the block
+	                   fullBlocksSize;				// the size of the blocks which are full
+	std::vector<char*> fullBlocks;					// the blocks which are full (as allocated), until the next clear
+
+	// allocates nofBytes bytes, aligned to MULTIGRIDHIERARCHY_ALIGNMENT
+	void *allocate (const size_t nofBytes);
+
+	// replaces the current block by a new one with a usable size of at least newBlockSize bytes
+	void allocateBlock (const size_t newBlockSize);
+
+};
+
+#endif  // __MULTIGRIDHIERARCHY_H_
+
+// Some Emacs-Hints -- please don't remove:
+//
+//  Local Variables:
+//  mode:C++
+//  tab-width:4
+//  End:
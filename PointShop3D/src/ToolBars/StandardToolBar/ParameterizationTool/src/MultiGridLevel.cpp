@@ -33,20 +33,42 @@
 
 #include <assert.h>
 
+
 // **************
 // public methods
 // **************
 
-MultiGridLevel::MultiGridLevel (NeighbourHood *neighbourHood, const Vector3D *normals, float *uvCoordinates) {
+MultiGridLevel::MultiGridLevel (NeighbourHood *neighbourHood, const Vector3D *normals, float *uvCoordinates, const uint stencilSize) {
 
 	this->neighbourHood = neighbourHood;
 	this->normals       = normals;
 	this->uvCoordinates = uvCoordinates;
-
 	positions    = neighbourHood->getPositions();
 	nofPositions = neighbourHood->getNofPositions();
+
+	// a level with fewer points than the stencil size has shorter stencils
+	this->stencilSize = stencilSize;
+	if (this->stencilSize < MULTIGRIDLEVEL_MIN_NOF_NEIGHBOURS) {
+		this->stencilSize = MULTIGRIDLEVEL_MIN_NOF_NEIGHBOURS;
+	}
+	else if (this->stencilSize > MULTIGRIDLEVEL_MAX_NOF_NEIGHBOURS) {
+		this->stencilSize = MULTIGRIDLEVEL_MAX_NOF_NEIGHBOURS;
+	}
+	if (this->stencilSize > nofPositions) {
+		this->stencilSize = nofPositions;
+	}
 	leastSquares = new SparseLeastSquares (nofPositions * 2);
 
+	coarseLevel          = 0;
+	cluster              = 0;
+	cycleType            = NO_CYCLE;
+	cyclePreconditioning = false;
+	cycleSolution        = 0;
+	cycleRightHandSide   = 0;
+	cycleResidual        = 0;
+	cycleCorrection      = 0;
+	cycleProduct         = 0;
+
 	positionFlags = new PositionFlags[nofPositions];
 	this->resetFlags();
 
@@ -57,6 +79,11 @@ MultiGridLevel::MultiGridLevel (NeighbourHood *neighbourHood, const Vector3D *no
 }
 
 MultiGridLevel::~MultiGridLevel() {
+	delete[] cycleSolution;
+	delete[] cycleRightHandSide;
+	delete[] cycleResidual;
+	delete[] cycleCorrection;
+	delete[] cycleProduct;
 	delete[] positionFlags;
 	delete leastSquares;
 }
@@ -93,85 +120,331 @@ float MultiGridLevel::getPrecision() const {
 	return precision;
 }
 
+float MultiGridLevel::getRelativeResidual() const {
+	return leastSquares->getRelativeResidual (uvCoordinates);
+}
+
+void MultiGridLevel::setSolverVariant (const SparseLeastSquares::SolverVariant newSolverVariant) {
+	leastSquares->setSolverVariant (newSolverVariant);
+}
+
+SparseLeastSquares::SolverVariant MultiGridLevel::getSolverVariant() const {
+	return leastSquares->getSolverVariant();
+}
+
+uint MultiGridLevel::getStencilSize() const {
+	return stencilSize;
+}
+
+void MultiGridLevel::setCoarseLevel (MultiGridLevel *newCoarseLevel, Cluster *newCluster) {
+	coarseLevel = newCoarseLevel;
+	cluster     = newCluster;
+}
+
+MultiGridLevel *MultiGridLevel::getCoarseLevel() const {
+	return coarseLevel;
+}
+
+void MultiGridLevel::setCycleType (const CycleType newCycleType) {
+	cycleType = newCycleType;
+}
+
+MultiGridLevel::CycleType MultiGridLevel::getCycleType() const {
+	return cycleType;
+}
+
+void MultiGridLevel::setCyclePreconditioningEnabled (const bool enable) {
+	cyclePreconditioning = enable;
+}
+
+bool MultiGridLevel::isCyclePreconditioningEnabled() const {
+	return cyclePreconditioning;
+}
+
 void MultiGridLevel::addFittingConstraints (const float *fittingConstraintsU, const float *fittingConstraintsV,
 										    const uint *fittingConstraintIndices, const uint nofConstraints, float weight) {
 
-	std::vector<float> a;	 // the coefficients array of the constraint
-	std::vector<int>   I;	 // the index array of the constraint
+	float         a;		 // the coefficient of the constraint
 	float         b[2];	 // u and v components of the right hand side of the constraint
+	float         sumC[2];
     uint          i;
 
-	// fitting constraints have exactly one non-zero coefficient!
-	I.resize(1);
-	a.resize(1);
-
-	// adjust size of internal tables, all tables have the same size
-	this->fittingConstraintsU.resize (nofConstraints);
-	this->fittingConstraintsV.resize (nofConstraints);
-	this->fittingConstraintsIndex.resize (nofConstraints);
-
+	// fitting constraints have exactly one non-zero coefficient, hence they are added to the
+	// separate diagonal term of the least squares system, and the assembled matrix is left untouched
  	for (i = 0; i < nofConstraints; i++) {
 
-		// copy fitting constraints to private table
-		this->fittingConstraintsU.at(i)     = fittingConstraintsU[i];
-		this->fittingConstraintsV.at(i)     = fittingConstraintsV[i];
-		this->fittingConstraintsIndex.at(i) = fittingConstraintIndices[i];
-
-		I.at(0) = fittingConstraintIndices[i];
-
-		a.at(0) = 1.0f;
-		
 		// get the corresponding texture coordinates here...
 		b[0] = fittingConstraintsU[i];
 		b[1] = fittingConstraintsV[i];
 
-		this->normalizeAndAddConstraint (I, a, b, weight);
+		// normalize the u and v components as normalizeAndAddConstraint does
+		a = 1.0f;
+		sumC[0] = (float)fabs(a) + (float)fabs(b[0]);
+		sumC[1] = (float)fabs(a) + (float)fabs(b[1]);
 
+		a    = a / sumC[0] * weight;
+		b[0] = b[0] / sumC[0] * weight;
+		leastSquares->addDiagonalConstraint (b[0], fittingConstraintIndices[i], a);
+
+		a   *= sumC[0] / sumC[1];
+		b[1] = b[1] / sumC[1] * weight;
+		leastSquares->addDiagonalConstraint (b[1], fittingConstraintIndices[i] + nofPositions, a);
 	}
 
 }
 
 void MultiGridLevel::removeFittingConstraints() {
 
-	std::vector<float> a;	 // the coefficients array of the constraint
-	std::vector<int>   I;     // the index array of the constraint
-	float         b[2];	 // u and v components of the right hand side of the constraint
-	uint          size,
-		          i;
+	// the assembled matrix never contained the fitting constraints, hence this is exact
+	leastSquares->clearDiagonalConstraints();
+}
+
+void MultiGridLevel::generateUVCoordinates () {
+	
+	if (cycleType == NO_CYCLE || coarseLevel == 0) {
+		this->solveLeastSquares();
+	}
+	else {
+		this->solveWithCycles();
+	}
+}
 
-	// fitting constraints have exactly one non-zero coefficient!
-	I.resize(1);
-	a.resize(1);
+void MultiGridLevel::solveLeastSquares() {
+	
+	// solve the least squares optimization problem
+	leastSquares->solve (uvCoordinates, neighbourHood->getNofPositions(), precision);
+}
 
-	size = fittingConstraintsU.size();
-	// remove the constraints by multiplying the weights of the constraints by -1!
+int MultiGridLevel::solveWithCycles() {
 
-	for (i = 0; i < size; i++) {
+	double *x, *f, *r, *z, *p, *q;
+	double rr, rz, rzOld, pq, zq, threshold, alpha, beta;
+	int    nofUnknowns, i, its;
 
-		I.at(0) = fittingConstraintsIndex.at(i);
+	nofUnknowns = 2 * nofPositions;
+	x = new double[nofUnknowns];
+	f = new double[nofUnknowns];
+	r = new double[nofUnknowns];
 
-		a.at(0) = 1.0f;
-		
-		// get the corresponding texture coordinates here...
-		b[0] = fittingConstraintsU.at(i);
-		b[1] = fittingConstraintsV.at(i);
+	this->prepareCycles();
+	leastSquares->prepareSystem (f);
+
+	threshold = 0.0;
+	for (i = 0; i < nofUnknowns; i++) {
+		x[i] = uvCoordinates[i];
+		threshold += f[i] * f[i];
+	}
+	threshold *= (double)precision * precision;
+
+	leastSquares->residual (x, f, r);
+	rr = 0.0;
+	for (i = 0; i < nofUnknowns; i++) {
+		rr += r[i] * r[i];
+	}
+
+	its = 0;
+	if (cyclePreconditioning == false) {
+
+		// stationary iteration: x = x + correction of one cycle, until the residual is small enough
+		while (rr > threshold && its < MULTIGRIDLEVEL_MAX_NOF_CYCLES) {
+
+			this->cycle (x, f, cycleType);
+			leastSquares->residual (x, f, r);
+			rr = 0.0;
+			for (i = 0; i < nofUnknowns; i++) {
+				rr += r[i] * r[i];
+			}
+			its++;
+		}
+
+	}
+	else {
+
+		// conjugate gradients preconditioned by one cycle z = M * r, starting with z = 0. the coarsest level is
+		// only solved approximately and the coarse corrections are scaled, hence M is not exactly the same in each
+		// iteration and the flexible (Polak-Ribiere) beta = (z, r - rOld) / (zOld, rOld) is used, where
+		// r - rOld = -alpha * q
+		z = new double[nofUnknowns];
+		p = new double[nofUnknowns];
+		q = new double[nofUnknowns];
+
+		for (i = 0; i < nofUnknowns; i++) {
+			z[i] = 0.0;
+		}
+		this->cycle (z, r, cycleType);
+		rz = 0.0;
+		for (i = 0; i < nofUnknowns; i++) {
+			p[i] = z[i];
+			rz += r[i] * z[i];
+		}
+
+		while (rr > threshold && its < MULTIGRIDLEVEL_MAX_NOF_CYCLES) {
+
+			leastSquares->multiply (p, q);
+			pq = 0.0;
+			for (i = 0; i < nofUnknowns; i++) {
+				pq += p[i] * q[i];
+			}
+			if (pq <= 0.0) {
+				break;
+			}
+			alpha = rz / pq;
+
+			rr = 0.0;
+			for (i = 0; i < nofUnknowns; i++) {
+				x[i] += alpha * p[i];
+				r[i] -= alpha * q[i];
+				rr += r[i] * r[i];
+				z[i] = 0.0;
+			}
+			this->cycle (z, r, cycleType);
+
+			rzOld = rz;
+			rz = 0.0;
+			zq = 0.0;
+			for (i = 0; i < nofUnknowns; i++) {
+				rz += r[i] * z[i];
+				zq += z[i] * q[i];
+			}
+			beta = -alpha * zq / rzOld;
+			for (i = 0; i < nofUnknowns; i++) {
+				p[i] = z[i] + beta * p[i];
+			}
+			its++;
+		}
 
-		this->normalizeAndAddConstraint(I, a, b, 1.0f, false);
+		delete[] z;
+		delete[] p;
+		delete[] q;
 
 	}
 
+	for (i = 0; i < nofUnknowns; i++) {
+		uvCoordinates[i] = (float)x[i];
+	}
+
+	this->releaseCycles();
+	delete[] x;
+	delete[] f;
+	delete[] r;
+
+	return its;
 }
 
-void MultiGridLevel::generateUVCoordinates () {
-	
-	this->precision = precision;
-	this->solveLeastSquares();
+void MultiGridLevel::prepareCycles() {
+
+	MultiGridLevel *level;
+	int            nofUnknowns;
+
+	// the system of this level is prepared by the caller, which needs its right hand side
+	for (level = this; level != 0; level = level->coarseLevel) {
+		nofUnknowns = 2 * level->nofPositions;
+		if (level != this) {
+			level->leastSquares->prepareSystem (0);
+			level->cycleSolution      = new double[nofUnknowns];
+			level->cycleRightHandSide = new double[nofUnknowns];
+		}
+		if (level->coarseLevel != 0) {
+			level->cycleResidual      = new double[nofUnknowns];
+			level->cycleCorrection    = new double[nofUnknowns];
+			level->cycleProduct       = new double[nofUnknowns];
+		}
+	}
+
 }
 
-void MultiGridLevel::solveLeastSquares() {
-	
-	// solve the least squares optimization problem
-	leastSquares->solve (uvCoordinates, neighbourHood->getNofPositions(), precision);
+void MultiGridLevel::releaseCycles() {
+
+	MultiGridLevel *level;
+
+	for (level = this; level != 0; level = level->coarseLevel) {
+		level->leastSquares->releaseSystem();
+		delete[] level->cycleSolution;
+		delete[] level->cycleRightHandSide;
+		delete[] level->cycleResidual;
+		delete[] level->cycleCorrection;
+		delete[] level->cycleProduct;
+		level->cycleSolution      = 0;
+		level->cycleRightHandSide = 0;
+		level->cycleResidual      = 0;
+		level->cycleCorrection    = 0;
+		level->cycleProduct       = 0;
+	}
+
+}
+
+void MultiGridLevel::cycle (double *x, const double *f, const CycleType type) {
+
+	uint   nofCoarsePositions,
+		   parentIndex,
+		   i;
+	int    c;
+	double *coarseSolution,
+		   *coarseRightHandSide;
+	double re, eGe, scale;
+
+	if (coarseLevel == 0) {
+		// the coarsest level: solve for the correction
+		leastSquares->solvePrepared (x, f, MULTIGRIDLEVEL_COARSEST_PRECISION, 2 * leastSquares->getNofUnknowns());
+		return;
+	}
+
+	// pre-smoothing
+	leastSquares->smooth (x, f, MULTIGRIDLEVEL_SMOOTHING_SWEEPS, true);
+	leastSquares->residual (x, f, cycleResidual);
+
+	// restriction: the residual of a cluster is the sum of the residuals of its points, the transpose of the
+	// prolongation below
+	nofCoarsePositions  = coarseLevel->nofPositions;
+	coarseSolution      = coarseLevel->cycleSolution;
+	coarseRightHandSide = coarseLevel->cycleRightHandSide;
+	for (i = 0; i < 2 * nofCoarsePositions; i++) {
+		coarseSolution[i]      = 0.0;
+		coarseRightHandSide[i] = 0.0;
+	}
+	for (i = 0; i < nofPositions; i++) {
+		parentIndex = cluster->getParentPositionIndex (i);
+		coarseRightHandSide[parentIndex]                      += cycleResidual[i];
+		coarseRightHandSide[parentIndex + nofCoarsePositions] += cycleResidual[i + nofPositions];
+	}
+
+	// coarse correction
+	for (c = 0; c < (int)type; c++) {
+		coarseLevel->cycle (coarseSolution, coarseRightHandSide, type);
+	}
+
+	// prolongation: each point gets the correction e of its cluster
+	for (i = 0; i < nofPositions; i++) {
+		parentIndex = cluster->getParentPositionIndex (i);
+		cycleCorrection[i]                = coarseSolution[parentIndex];
+		cycleCorrection[i + nofPositions] = coarseSolution[parentIndex + nofCoarsePositions];
+	}
+
+	// the directional derivatives constraints are violated by the steps between neighbouring clusters of
+	// the piecewise constant correction, hence it is smoothed with sweeps on G * e = 0 first. the coarse
+	// matrix is not the projection of this one, so the correction is scaled by the step which minimizes
+	// the error in the energy norm: (r, e) / (e, G * e)
+	for (i = 0; i < 2 * nofPositions; i++) {
+		cycleProduct[i] = 0.0;
+	}
+	leastSquares->smooth (cycleCorrection, cycleProduct, MULTIGRIDLEVEL_SMOOTHING_SWEEPS, true);
+	leastSquares->smooth (cycleCorrection, cycleProduct, MULTIGRIDLEVEL_SMOOTHING_SWEEPS, false);
+	leastSquares->multiply (cycleCorrection, cycleProduct);
+
+	re  = 0.0;
+	eGe = 0.0;
+	for (i = 0; i < 2 * nofPositions; i++) {
+		re  += cycleResidual[i] * cycleCorrection[i];
+		eGe += cycleCorrection[i] * cycleProduct[i];
+	}
+	scale = eGe > 0.0 ? re / eGe : 0.0;
+	for (i = 0; i < 2 * nofPositions; i++) {
+		x[i] += scale * cycleCorrection[i];
+	}
+
+	// post-smoothing, in reverse order
+	leastSquares->smooth (x, f, MULTIGRIDLEVEL_SMOOTHING_SWEEPS, false);
+
 }
 
 // ***************
@@ -196,9 +469,12 @@ void MultiGridLevel::addRegularizationConstraints() {
 
 	uint          currentNeighbourIndex;
 
-	nNeighbours = 9;
+	const NeighbourGraph *neighbourGraph;
+	const uint    *neighbourIndices;
+
+	nNeighbours = MULTIGRIDLEVEL_NOF_NEIGHBOURS;
 
-	neighbourHood->setNofNeighbours (nNeighbours);
+	neighbourGraph = neighbourHood->getNeighbourGraph (nNeighbours);
 
 	// there is one regularization constraint per non-boundary vertex
 	//for (surfel = surfels->getFirstSurfel(); surfel != 0; surfel = surfels->getNextSurfel()) {
@@ -216,7 +492,15 @@ void MultiGridLevel::addRegularizationConstraints() {
 			// NOTE: the current surfel is returned as the neighbor 0! nNeighbours includes the 
 			// current surfel, too.
 			//neighbourHood->computeNearestPoints (surfel->getPosition(), nNeighbours);
-			neighbourHood->setSourcePoint (positions[index]);
+			neighbourIndices = &(neighbourGraph->indices[neighbourGraph->offsets[index]]);
+			// the row is shorter if the level has fewer points than neighbours
+			nNeighbours = neighbourGraph->offsets[index + 1] - neighbourGraph->offsets[index];
+			if (nNeighbours > MULTIGRIDLEVEL_NOF_NEIGHBOURS) {
+				nNeighbours = MULTIGRIDLEVEL_NOF_NEIGHBOURS;
+			}
+			else if (nNeighbours < 2) {
+				continue;
+			}
 
 			// setup the indices and the coefficients array for the current constraint. 
 			// they contain all neighbors plus the current vertex itself, given that these
@@ -233,7 +517,7 @@ void MultiGridLevel::addRegularizationConstraints() {
 
 				// compute distance between current surfel and current neighbor
 				//currentNeighbor = neighborhoodSearchStructure->getNeighbor(j);
-				currentNeighbourIndex = neighbourHood->getNeighbourPositionIndex(j);
+				currentNeighbourIndex = neighbourIndices[j];
 
 				//diff = surfel->getPosition() - currentNeighbor->getPosition();
 				diff = positions[index] - positions[currentNeighbourIndex];
@@ -294,250 +578,342 @@ void MultiGridLevel::addRegularizationConstraints() {
 
 void MultiGridLevel::addDirectionalDerivativesConstraints() {
 
-	int           nNeighbours;
+	int           nNeighbours,
+	              nofBlocks,
+	              firstBlock,
+	              nofBatchBlocks,
+	              block;
+	uint          index,
+	              endIndex,
+	              nofRowNeighbours;
+
+	const NeighbourGraph *neighbourGraph;
+	SparseLeastSquares::ConstraintBuffer *buffers;
+	std::vector<char> isGeometricBoundary;
 
-	std::vector<float> a;	// the coefficients array of the constraint
-	std::vector<int>   I;	// the index array of the constraint
+	nNeighbours = stencilSize;
+	neighbourGraph = neighbourHood->getNeighbourGraph (nNeighbours);
+
+	// the constraints of each block of points are assembled into a buffer of their own, which
+	// is independent of all other blocks. the buffers of a batch of blocks are then added to the
+	// system in the order of the points, hence the system does not depend on the number of threads
+	nofBlocks = (nofPositions + MULTIGRIDLEVEL_ASSEMBLY_BLOCK_SIZE - 1) / MULTIGRIDLEVEL_ASSEMBLY_BLOCK_SIZE;
+	buffers = new SparseLeastSquares::ConstraintBuffer[MULTIGRIDLEVEL_ASSEMBLY_BATCH_SIZE];
+	isGeometricBoundary.resize (nofPositions, 0);
+
+	for (firstBlock = 0; firstBlock < nofBlocks; firstBlock += MULTIGRIDLEVEL_ASSEMBLY_BATCH_SIZE) {
+
+		nofBatchBlocks = nofBlocks - firstBlock;
+		if (nofBatchBlocks > MULTIGRIDLEVEL_ASSEMBLY_BATCH_SIZE) {
+			nofBatchBlocks = MULTIGRIDLEVEL_ASSEMBLY_BATCH_SIZE;
+		}
+
+		#pragma omp parallel for private(index, endIndex, nofRowNeighbours) schedule(dynamic, 1)
+		for (block = 0; block < nofBatchBlocks; block++) {
+
+			buffers[block].indices.clear();
+			buffers[block].coefficients.clear();
+			buffers[block].rightHandSides.clear();
+			buffers[block].ends.clear();
+			buffers[block].addFlags.clear();
+
+			index    = (firstBlock + block) * MULTIGRIDLEVEL_ASSEMBLY_BLOCK_SIZE;
+			endIndex = index + MULTIGRIDLEVEL_ASSEMBLY_BLOCK_SIZE;
+			if (endIndex > nofPositions) {
+				endIndex = nofPositions;
+			}
+
+			// the rows of the graph have fewer than 'stencilSize' neighbours if the level has fewer points,
+			// those use the generic assembly
+			for (; index < endIndex; index++) {
+				nofRowNeighbours = neighbourGraph->offsets[index + 1] - neighbourGraph->offsets[index];
+				if (nofRowNeighbours > stencilSize) {
+					nofRowNeighbours = stencilSize;
+				}
+				if (nofRowNeighbours == MULTIGRIDLEVEL_NOF_NEIGHBOURS) {
+					isGeometricBoundary[index] = this->addDirectionalDerivativesConstraints<MULTIGRIDLEVEL_NOF_NEIGHBOURS> (index,
+					                                                                                                       &(neighbourGraph->indices[neighbourGraph->offsets[index]]),
+					                                                                                                       nofRowNeighbours, buffers[block]);
+				}
+				else {
+					isGeometricBoundary[index] = this->addDirectionalDerivativesConstraints<0> (index,
+					                                                                            &(neighbourGraph->indices[neighbourGraph->offsets[index]]),
+					                                                                            nofRowNeighbours, buffers[block]);
+				}
+			}
+		}
+
+		leastSquares->addConstraints (buffers, nofBatchBlocks);
+	}
+
+	// the flags are only set now, since the assembly reads the flags of the neighbours
+	for (index = 0; index < nofPositions; index++) {
+		if (isGeometricBoundary[index] != 0) {
+			positionFlags[index] |= GEOMETRICBOUNDARY;
+		}
+	}
+
+	delete[] buffers;
+}
+
+template <int fixedStencilSize>
+bool MultiGridLevel::addDirectionalDerivativesConstraints (const uint index, const uint *neighbourIndices, const int nofNeighbours,
+                                                           SparseLeastSquares::ConstraintBuffer &buffer) {
+
+	enum { maxNofCandidates = (fixedStencilSize > 0 ? fixedStencilSize : MULTIGRIDLEVEL_MAX_NOF_NEIGHBOURS) - 1 };
+
+	// a compile time constant, unless the stencil size is not fixed
+	const int     nNeighbours = fixedStencilSize > 0 ? fixedStencilSize : nofNeighbours;
+	bool          isBoundary;
+
+	ConstraintRow<4> constraint;	// each constraint involves the center point plus three neighbors
 	float         b[2];			// u and v components of the right hand side of the constraint
 
-	Vector3D      P, Pi, Pj, Pk, Pl;
+	Vector3D      P, Pi, Pl;
 	Vector3D      P_Pj, P_Pk;					// un-normalized vectors
-	Vector3D      nPi_P, nPl_P, nP_Pj, nP_Pk;	// normalized vectors
+	Vector3D      nPi_P;						// normalized vectors
 	Vector3D      X, Y;
 	Vector3D      n, n_jk;
 	float         len_Pi_P;
 
-	float         Aj, Ak, Al;
-	float         maxAngleFromPlane     = (float)M_PI / 3.0f;
-	float         minPjPkAngleThreshold = (float)-0.99f;
-	int           i, j, k, l;
+	// the neighbours Pl of P are the candidates c = l - 1 for Pj and Pk. for the candidate scan their vectors
+	// Pl_P are stored as a structure of arrays, and instead of the angles between Pl_P and the plane through P
+	// with normal n, the squared sines of these angles are compared, which are monotonic in the angles
+	float         dx[maxNofCandidates],
+	              dy[maxNofCandidates],
+	              dz[maxNofCandidates],
+	              squaredLengths[maxNofCandidates],
+	              squaredSines[maxNofCandidates],
+	              cosines[maxNofCandidates];
+	float         dn;
+	float         maxSquaredSineFromPlane = 0.75f;	// sin^2 (60 degrees)
+	int           i, j, k, c;
 
 	float         x[3], y[3];
 	float         DX[3];
 	float         d;
 
-	int           nIndices;
-	uint          index,
-		          indexI,
-		          indexJ,
-				  indexK = 0,
-				  indexL;
+	uint          indexI,
+		          indexJ = 0,
+				  indexK = 0;
 
-	nNeighbours = 9;
+	isBoundary = false;
 
-	// set the size of the indices and the coefficients array for the constraints. each constraint
-	// involves the center point plus three neighbors
-	I.resize (nNeighbours);
-	a.resize (nNeighbours);
+	// get nearest neighbors of current surfel
+	// NOTE: the current surfel is returned as the neighbor 0! nNeighbours includes the 
+	// current surfel, too.
+	P = positions[index];
 
-	neighbourHood->setNofNeighbours (nNeighbours);
+	for (c = 0; c < nNeighbours - 1; c++) {
+		Pl = positions[neighbourIndices[c + 1]];
+		dx[c] = P[0] - Pl[0];
+		dy[c] = P[1] - Pl[1];
+		dz[c] = P[2] - Pl[2];
+		squaredLengths[c] = dx[c] * dx[c] + dy[c] * dy[c] + dz[c] * dz[c];
+	}
+	
+	b[0] = 0.f;
+	b[1] = 0.f;
+
+	// NOTE: neighbor 0 is the current surfel itself, hence start at j=1!
+	for (i = 1; i < nNeighbours; i++) {
+
+		// compute one directional derivative constraint for each neighbor
+		indexI = neighbourIndices[i];
+		Pi = positions[indexI];
+		nPi_P = P - Pi;
+		len_Pi_P = nPi_P.normalize();
+
+		// the normal of the plane through P, which defines the direction of the directional
+		// derivative
+		n = Vector3D::crossProduct (nPi_P, normals[index]);
+		n.normalize();
+
+		// for each neighbor Pl, compute the sine of the angle between Pl_P and the plane given by P and n,
+		// and the cosine of the angle between Pl_P and Pi_P, up to the positive factor |Pl_P|
+		for (c = 0; c < nNeighbours - 1; c++) {
+			dn              = dx[c] * n[0] + dy[c] * n[1] + dz[c] * n[2];
+			squaredSines[c] = dn * dn / squaredLengths[c];
+			cosines[c]      = dx[c] * nPi_P[0] + dy[c] * nPi_P[1] + dz[c] * nPi_P[2];
+		}
 
-	for (index = 0; index < nofPositions; index++) {
+		// select the two neighbors with the smallest angle, under the condition that the angle
+		// between Pi_P and Pl_P is bigger than 90 degrees
+		MultiGridLevel::selectNeighbours<fixedStencilSize> (nNeighbours, i - 1, dx, dy, dz, squaredLengths, squaredSines, cosines, j, k);
 
-		// get nearest neighbors of current surfel
-		// NOTE: the current surfel is returned as the neighbor 0! nNeighbours includes the 
-		// current surfel, too.
-		P = positions[index];
-		
-		//neighborhoodSearchStructure->computeNearestPoints(P, nNeighbours);
-		neighbourHood->setSourcePoint(P);
-
-		b[0] = 0.f;
-		b[1] = 0.f;
-
-		// NOTE: neighbor 0 is the current surfel itself, hence start at j=1!
-		for (i = 1; i < nNeighbours; i++) {
-
-			// compute one directional derivative constraint for each neighbor
-			indexI = neighbourHood->getNeighbourPositionIndex(i);
-			Pi = positions[indexI];
-			nPi_P = P - Pi;
-			len_Pi_P = nPi_P.normalize();
-
-			// the normal of the plane through P, which defines the direction of the directional
-			// derivative
-			n = Vector3D::crossProduct (nPi_P, normals[index]);
-			n.normalize();
-
-			// for each neighbor Pl, compute the angle between Pl_P and the plane given by P and n.
-			// select the two neighbors with the smallest angle, under the condition that the angle
-			// between Pi_P and Pl_P is bigger than 90 degrees
-			j = k = -1;
-			Aj = Ak = (float)M_PI;
-			Pj = Vector3D(0,0,0);	// init to avoid compiler warnings
-
-			indexJ = UINT_MAX;
-			nP_Pj = Vector3D(0,0,0);
-			
-			for (l = 1; l < nNeighbours; l++) {
-				
-				if (l != i) {
-
-					// compute the angle between Pl_P and the plane
-					indexL = neighbourHood->getNeighbourPositionIndex(l);
-					Pl = positions[indexL];
-					nPl_P = P - Pl;
-					nPl_P.normalize();
-					Al = fabs (asin (Vector3D::dotProduct (nPl_P, n)));
-
-					// check that Pl lies on the other side of the plane given by P and the normal Pi_P 
-					// than Pi itself
-					// NOTE: just check that the angle between Pi_P and Pl_P is bigger than 90 degrees
-					if (acos(Vector3D::dotProduct(nPl_P, nPi_P)) > M_PI/2) {
-						
-						if (Al < Aj) {
-							// guarantee that Aj < Ak by setting *k = *j
-							k = j;
-							Ak = Aj;
-							Pk = Pj;
-							//Sk = Sj;
-							indexK = indexJ;
-							nP_Pk = nP_Pj;
-
-							// set new *j
-							j = l;
-							Aj = Al;
-							Pj = Pl;
-							//Sj = Sl;
-							indexJ = indexL;
-							nP_Pj = Pj - P;
-							nP_Pj.normalize();
-						} else if (Al < Ak && Vector3D::dotProduct(nPl_P, nP_Pj) > minPjPkAngleThreshold) {
-							// reject Pk if the angle between Pk and Pj is too small (to guarantee that P,Pk,Pj define a plane properly)!
-							// set new *k, we still guarantee Aj < Ak
-							k = l;
-							Ak = Al;
-							Pk = Pl;
-							//Sk = Sl;
-							indexK = indexL;
-							nP_Pk = Pk - P;
-							nP_Pk.normalize();
-						}
-					}
-				}
+		// vectors from P to Pj and Pk respectively
+		if (j != -1) {
+			indexJ = neighbourIndices[j + 1];
+			P_Pj   = positions[indexJ] - P;
+		}
+		if (k != -1) {
+			indexK = neighbourIndices[k + 1];
+			P_Pk   = positions[indexK] - P;
+		}
+
+		// check if we found two neighbors that are sufficiently close to the plane
+		// also check that P, Pj, and Pk are not colinear!
+		if(j!=-1 && k!=-1 && squaredSines[j]<maxSquaredSineFromPlane && squaredSines[k]<maxSquaredSineFromPlane && 
+		   fabs(Vector3D::dotProduct(P_Pj, P_Pk)/(P_Pj.getLength()*P_Pk.getLength())) < 0.99) {
+
+			// find the intersection line of the plane given by P, Pj, and Pk, and the
+			// plane given by P and the surface normal at P
+			n_jk = Vector3D::crossProduct(P_Pj, P_Pk);
+			n_jk.normalize();
+
+			// compute the local X,Y coordinate system
+			// NOTE: X must be oriented such that the angle between X and Pi_P is smaller
+			// than 90 degrees (X must point away from P)
+			X = Vector3D::crossProduct(n, n_jk);
+			X.normalize();
+			if(Vector3D::dotProduct(X, nPi_P) < 0.f) {
+				// flip direction of X
+				X = -X;
 			}
+			// the direction of Y does not matter
+			Y = Vector3D::crossProduct(n_jk, X);
+
+			// compute the coordinates of Pj and Pk in local coordinates
+			x[0] = 0;
+			x[1] = Vector3D::dotProduct(P_Pj, X);
+			x[2] = Vector3D::dotProduct(P_Pk, X);
+			y[0] = 0;
+			y[1] = Vector3D::dotProduct(P_Pj, Y);
+			y[2] = Vector3D::dotProduct(P_Pk, Y);
+			
+			// compute the coefficients for the directional derivative along X
+			d = (x[1]-x[0])*(y[2]-y[0]) - (x[2]-x[0])*(y[1]-y[0]);
+			DX[0] = (y[1]-y[2])/d;
+			DX[1] = (y[2]-y[0])/d;
+			DX[2] = (y[0]-y[1])/d;
+			
+			// add constraint
+			constraint.nofIndices = 0;
 
-			// vectors from P to Pj and Pk respectively
-			P_Pj = Pj - P;
-			P_Pk = Pk - P;
-
-			// check if we found two neighbors that are sufficiently close to the plane
-			// also check that P, Pj, and Pk are not colinear!
-			if(j!=-1 && k!=-1 && Aj<maxAngleFromPlane && Ak<maxAngleFromPlane && 
-			   fabs(Vector3D::dotProduct(P_Pj, P_Pk)/(P_Pj.getLength()*P_Pk.getLength())) < 0.99) {
-
-				// find the intersection line of the plane given by P, Pj, and Pk, and the
-				// plane given by P and the surface normal at P
-				n_jk = Vector3D::crossProduct(P_Pj, P_Pk);
-				n_jk.normalize();
-
-				// compute the local X,Y coordinate system
-				// NOTE: X must be oriented such that the angle between X and Pi_P is smaller
-				// than 90 degrees (X must point away from P)
-				X = Vector3D::crossProduct(n, n_jk);
-				X.normalize();
-				if(Vector3D::dotProduct(X, nPi_P) < 0.f) {
-					// flip direction of X
-					X = -X;
-				}
-				// the direction of Y does not matter
-				Y = Vector3D::crossProduct(n_jk, X);
-
-				// compute the coordinates of Pj and Pk in local coordinates
-				x[0] = 0;
-				x[1] = Vector3D::dotProduct(P_Pj, X);
-				x[2] = Vector3D::dotProduct(P_Pk, X);
-				y[0] = 0;
-				y[1] = Vector3D::dotProduct(P_Pj, Y);
-				y[2] = Vector3D::dotProduct(P_Pk, Y);
-				
-				// compute the coefficients for the directional derivative along X
-				d = (x[1]-x[0])*(y[2]-y[0]) - (x[2]-x[0])*(y[1]-y[0]);
-				DX[0] = (y[1]-y[2])/d;
-				DX[1] = (y[2]-y[0])/d;
-				DX[2] = (y[0]-y[1])/d;
-				
-				// add constraint
-				nIndices = 0;
+			if ((positionFlags[indexJ] & UVBOUNDARY) == 0) {
 
-				if ((positionFlags[indexJ] & UVBOUNDARY) == 0) {
+				// free texture surfel
+				constraint.indices[constraint.nofIndices] = indexJ;
+				constraint.coefficients[constraint.nofIndices] = DX[1];
+				constraint.nofIndices++;
 
-					// free texture surfel
-					I.at (nIndices) = indexJ;
-					a.at(nIndices) = DX[1];
-					nIndices++;
+			} else {
 
-				} else {
+				// texture boundary surfel, hence move contribution from left to right
+				// hand side. note that there is a u and a v texture coordinate component
+				b[0] -= DX[1] * uvCoordinates[indexJ];
+				b[1] -= DX[1] * uvCoordinates[indexJ + nofPositions];
 
-					// texture boundary surfel, hence move contribution from left to right
-					// hand side. note that there is a u and a v texture coordinate component
-					b[0] -= DX[1] * uvCoordinates[indexJ];
-					b[1] -= DX[1] * uvCoordinates[indexJ + nofPositions];
+			}
 
-				}
+			// SK
+			if ((positionFlags[indexK] & UVBOUNDARY) == 0) {
+				// free texture surfel
+				//constraint.indices[constraint.nofIndices] = Sk->getIndex();
+				constraint.indices[constraint.nofIndices] = indexK;
+				constraint.coefficients[constraint.nofIndices] = DX[2];
+				constraint.nofIndices++;
 
-				// SK
-				if ((positionFlags[indexK] & UVBOUNDARY) == 0) {
-					// free texture surfel
-					//I.at(nIndices) = Sk->getIndex();
-					I.at (nIndices) = indexK;
-					a.at(nIndices) = DX[2];
-					nIndices++;
+			} else {
 
-				} else {
+				// texture boundary surfel
+				b[0] -= DX[1] * uvCoordinates[indexK];
+				b[1] -= DX[1] * uvCoordinates[indexK + nofPositions];
 
-					// texture boundary surfel
-					b[0] -= DX[1] * uvCoordinates[indexK];
-					b[1] -= DX[1] * uvCoordinates[indexK + nofPositions];
+			}
 
-				}
+			// S
+			if ((positionFlags[index] & UVBOUNDARY) == 0) {
+				// free texture surfel
+				constraint.indices[constraint.nofIndices] = index;
+				constraint.coefficients[constraint.nofIndices] = DX[0] - 1 / len_Pi_P;
+				constraint.nofIndices++;
 
-				// S
-				if ((positionFlags[index] & UVBOUNDARY) == 0) {
-					// free texture surfel
-					I.at (nIndices) = index;
-					a.at(nIndices) = DX[0] - 1 / len_Pi_P;
-					nIndices++;
+			} else {
 
-				} else {
+				// texture boundary surfel
+				b[0] -= DX[1] * uvCoordinates[index];
+				b[1] -= DX[1] * uvCoordinates[index + nofPositions];
 
-					// texture boundary surfel
-					b[0] -= DX[1] * uvCoordinates[index];
-					b[1] -= DX[1] * uvCoordinates[index + nofPositions];
+			}	
 
-				}	
+			// Si
+			if ((positionFlags[indexI] & UVBOUNDARY) == 0) {
+				// free texture surfel
+				constraint.indices[constraint.nofIndices] = indexI;
+				constraint.coefficients[constraint.nofIndices] = 1 / len_Pi_P;
+				constraint.nofIndices++;
 
-				// Si
-				if ((positionFlags[indexI] & UVBOUNDARY) == 0) {
-					// free texture surfel
-					I.at (nIndices) = indexI;
-					a.at(nIndices) = 1 / len_Pi_P;
-					nIndices++;
+			} else {
+				// texture boundary surfel
+				b[0] -= DX[1] * uvCoordinates[indexI];
+				b[1] -= DX[1] * uvCoordinates[indexI + nofPositions];
+			}
 
-				} else {
-					// texture boundary surfel
-					b[0] -= DX[1] * uvCoordinates[indexI];
-					b[1] -= DX[1] * uvCoordinates[indexI + nofPositions];
-				}
+			// normalize constraint and add to least squares system
+			this->normalizeAndAddConstraint (constraint, b, 1.0, true, &buffer);
+
+		} else {
+			// we did not find any two neighbors complying with our criteria,
+			// hence the current center point is a point on the boundary of
+			// the selection. this flag is used to reject unbalanced regularization
+			// constraints later.
+			isBoundary = true;
+		}
+	}
 
-				// normalize constraint and add to least squares system
-				I.resize(nIndices);	
-				a.resize(nIndices);
-				normalizeAndAddConstraint(I, a, b, 1.0);
+	return isBoundary;
+}
 
-			} else {
-				// we did not find any two neighbors complying with our criteria,
-				// hence the current center point is a point on the boundary of
-				// the selection. this flag is used to reject unbalanced regularization
-				// constraints later.
-				positionFlags[index] |= GEOMETRICBOUNDARY;
+
+// NOTE: the original formulation compared the angles asin (nPl_P * n) and required acos (nPl_P * nPi_P) > PI / 2, with
+// normalized float vectors. it selects the same neighbours as the squared sines, except where rounding decides: neighbours
+// whose angles are equal up to rounding used to be tie-broken by their order, now by their squared sines, and neighbours
+// exactly opposite to Pi used to be rejected if their rounded dot product was below -1 (acos is NaN), now they are accepted.
+// neighbours exactly perpendicular to Pi_P are accepted, as before. on regular grids this changes some of the selected
+// neighbours, and hence the assembled system. tests/NeighbourSelectionTest.cpp compares both formulations
+template <int fixedStencilSize>
+void MultiGridLevel::selectNeighbours (const int nofNeighbours, const int skipped, const float *dx, const float *dy, const float *dz,
+									   const float *squaredLengths, const float *squaredSines, const float *cosines, int &j, int &k) {
+
+	const int nofCandidates = (fixedStencilSize > 0 ? fixedStencilSize : nofNeighbours) - 1;
+	int       c;
+	float     d;
+	float     minPjPkSquaredCosineThreshold = 0.99f * 0.99f;
+
+	j = k = -1;
+	for (c = 0; c < nofCandidates; c++) {
+
+		// check that Pc does not lie on the same side of the plane given by P and the normal Pi_P as Pi
+		// itself, i.e. that the angle between Pi_P and Pc_P is at least 90 degrees. neighbours at the
+		// position of P are rejected
+		if (c == skipped || !(cosines[c] <= 0.0f) || squaredLengths[c] == 0.0f) {
+			continue;
+		}
+
+		if (j == -1 || squaredSines[c] < squaredSines[j]) {
+			// guarantee that the angle of Pj is smaller than the one of Pk
+			k = j;
+			j = c;
+		} else if (k == -1 || squaredSines[c] < squaredSines[k]) {
+			// reject Pc if the angle between Pc_P and P_Pj is too small (to guarantee that P,Pk,Pj define a plane
+			// properly), i.e. if the cosine of the angle between Pc_P and Pj_P is not smaller than 0.99
+			d = dx[c] * dx[j] + dy[c] * dy[j] + dz[c] * dz[j];
+			if (d <= 0.0f || d * d < minPjPkSquaredCosineThreshold * squaredLengths[c] * squaredLengths[j]) {
+				k = c;
 			}
 		}
 	}
 }
 
 
-void MultiGridLevel::normalizeAndAddConstraint(std::vector<int>& I, std::vector<float>& a, float b[2], const float w, bool addFlag) {
+// the generic selection is also used outside of this file
+template void MultiGridLevel::selectNeighbours<0> (const int nofNeighbours, const int skipped, const float *dx, const float *dy, const float *dz,
+                                                  const float *squaredLengths, const float *squaredSines, const float *cosines, int &j, int &k);
+
+
+void MultiGridLevel::normalizeAndAddConstraint(std::vector<int>& I, std::vector<float>& a, float b[2], const float w, bool addFlag,
+                                               SparseLeastSquares::ConstraintBuffer *buffer) {
 
 	int j;
 	int nIndices = I.size();
@@ -566,7 +942,11 @@ void MultiGridLevel::normalizeAndAddConstraint(std::vector<int>& I, std::vector<
 	b[0] = b[0] / sumC[0] * w;
 
 	// add u component
-	leastSquares->addConstraint(b[0], I, a, addFlag);
+	if (buffer != 0) {
+		SparseLeastSquares::bufferConstraint (*buffer, b[0], I, a, addFlag);
+	} else {
+		leastSquares->addConstraint(b[0], I, a, addFlag);
+	}
 
 	// v component
 	// normalize v component (first, undo u normalization, then apply v normalization)
@@ -582,8 +962,58 @@ void MultiGridLevel::normalizeAndAddConstraint(std::vector<int>& I, std::vector<
 	}
 
 	// add v component
-	leastSquares->addConstraint(b[1], I, a, addFlag);
+	if (buffer != 0) {
+		SparseLeastSquares::bufferConstraint (*buffer, b[1], I, a, addFlag);
+	} else {
+		leastSquares->addConstraint(b[1], I, a, addFlag);
+	}
+
+}
+
+
+template <int maxNofIndices>
+void MultiGridLevel::normalizeAndAddConstraint (ConstraintRow<maxNofIndices> &row, float b[2], const float w, bool addFlag,
+                                                SparseLeastSquares::ConstraintBuffer *buffer) {
+
+	int   j;
+	float sumC[2];
+
+	// NOTE: same as the std::vector variant, see there
+	sumC[0] = sumC[1] = 0.f;
+	for (j = 0; j < row.nofIndices; j++) {
+		sumC[0] += (float)fabs(row.coefficients[j]);
+		sumC[1] += (float)fabs(row.coefficients[j]);
+	}
+	sumC[0] += (float)fabs(b[0]);
+	sumC[1] += (float)fabs(b[1]);
+
+	// normalize and add u component
+	for (j = 0; j < row.nofIndices; j++) {
+		row.coefficients[j] = row.coefficients[j] / sumC[0] * w;
+	}
+	b[0] = b[0] / sumC[0] * w;
+
+	if (buffer != 0) {
+		SparseLeastSquares::bufferConstraint (*buffer, b[0], row.indices, row.coefficients, row.nofIndices, addFlag);
+	} else {
+		leastSquares->addConstraint (b[0], row.indices, row.coefficients, row.nofIndices, addFlag);
+	}
 
+	// normalize and add v component, with independent indices
+	for (j = 0; j < row.nofIndices; j++) {
+		row.coefficients[j] *= sumC[0] / sumC[1];
+	}
+	b[1] = b[1] / sumC[1] * w;
+
+	for (j = 0; j < row.nofIndices; j++) {
+		row.indices[j] += nofPositions;
+	}
+
+	if (buffer != 0) {
+		SparseLeastSquares::bufferConstraint (*buffer, b[1], row.indices, row.coefficients, row.nofIndices, addFlag);
+	} else {
+		leastSquares->addConstraint (b[1], row.indices, row.coefficients, row.nofIndices, addFlag);
+	}
 }
 
 void MultiGridLevel::resetFlags() {
@@ -34,10 +34,29 @@
 #include <vector>
 //#include "../../../../Core/DataStructures/src/SurfelCollection.h"
 #include "../../../../Core/DataStructures/src/NeighbourHood.h"
+#include "../../../../Core/DataStructures/src/Cluster.h"
 #include "../../../../DataTypes/src/Vector3D.h"
 //#include "../../../../Core/MarkerManager/src/MarkerManager.h"
 #include "SparseLeastSquares.h"
 
+// the default number of neighbours, including the point itself, used for the directional derivatives
+// constraints. the assembly is specialized for this stencil size
+#define MULTIGRIDLEVEL_NOF_NEIGHBOURS 9
+// the minimum stencil size: the point itself, the neighbour Pi and the two neighbours Pj and Pk
+#define MULTIGRIDLEVEL_MIN_NOF_NEIGHBOURS 4
+// the maximum stencil size
+#define MULTIGRIDLEVEL_MAX_NOF_NEIGHBOURS 32
+// the number of points whose constraints are assembled together by one thread
+#define MULTIGRIDLEVEL_ASSEMBLY_BLOCK_SIZE 256
+// the number of blocks which are buffered before they are added to the system
+#define MULTIGRIDLEVEL_ASSEMBLY_BATCH_SIZE 64
+// the number of Gauss-Seidel sweeps before and after the coarse correction of a multigrid cycle
+#define MULTIGRIDLEVEL_SMOOTHING_SWEEPS 2
+// the relative precision to which the correction is solved on the coarsest level of a multigrid cycle
+#define MULTIGRIDLEVEL_COARSEST_PRECISION 0.01f
+// the maximum number of multigrid cycles, or preconditioned conjugate gradient iterations, per solution
+#define MULTIGRIDLEVEL_MAX_NOF_CYCLES 500
+
 /**
  * Multigrid level.
  *
@@ -48,6 +67,15 @@ class MultiGridLevel {
 
 public:
 
+	/**
+	 * The multigrid cycles used by <code>generateUVCoordinates</code>.
+	 */
+	typedef enum cycleType {
+		NO_CYCLE = 0,	// solve this level by conjugate gradients only, coarse levels just provide the initial solution
+		V_CYCLE  = 1,	// one coarse correction per cycle
+		W_CYCLE  = 2	// two coarse corrections per cycle
+	} CycleType;
+
 	/**
 	 * Creates this <code>MultiGridLevel</code> with a given <code>neighbourHood</code> search structure,
 	 * which also contains the points where this <code>MultiGridLevel</code> operates on, and the initial
@@ -68,10 +96,16 @@ public:
 	 *        structure; the first <em>n</em> contain the U <code>float</code> values, the second <em>n</em> entries
 	 *        the V <code>float</code> value, where <em>n</em> is the number of points in the <code>neighbourHood</code>;
 	 *        will contain the updated UV coordinates later on, the old values being overwritten
+	 * @param stencilSize
+	 *        the number of neighbours, including the point itself, which are used for the directional derivatives
+	 *        constraints of each point; clamped to <code>MULTIGRIDLEVEL_MIN_NOF_NEIGHBOURS</code> ..
+	 *        <code>MULTIGRIDLEVEL_MAX_NOF_NEIGHBOURS</code> and to the number of points. The assembly is
+	 *        fastest for the default <code>MULTIGRIDLEVEL_NOF_NEIGHBOURS</code>, other sizes are meant for experiments
 	 * @see NeighbourHood#getNofPositions
 	 * @see NeighbourHood#getPositions
 	 */
-	MultiGridLevel (NeighbourHood *neighbourHood, const Vector3D *normals, float *uvCoordinates);
+	MultiGridLevel (NeighbourHood *neighbourHood, const Vector3D *normals, float *uvCoordinates,
+	                const uint stencilSize = MULTIGRIDLEVEL_NOF_NEIGHBOURS);
 	virtual ~MultiGridLevel();
 
 	/**
@@ -141,22 +175,123 @@ public:
 	float getPrecision() const;
 
 	/**
-	 * Add fitting constraints to the least squares system.
+	 * Returns the relative residual of the least squares problem for the current UV coordinates.
+	 *
+	 * @see SparseLeastSquares#getRelativeResidual
+	 */
+	float getRelativeResidual() const;
+
+	/**
+	 * set the conjugate gradient variant used for solving the least squares problem
+	 *
+	 * @see SparseLeastSquares#setSolverVariant
+	 */
+	void setSolverVariant (const SparseLeastSquares::SolverVariant newSolverVariant);
+
+	/**
+	 * get the conjugate gradient variant
+	 */
+	SparseLeastSquares::SolverVariant getSolverVariant() const;
+
+	/**
+	 * get the number of neighbours, including the point itself, used for the directional derivatives constraints
+	 */
+	uint getStencilSize() const;
+
+	/**
+	 * Sets the next coarser level, whose points are the clusters of the points of this level, for the
+	 * multigrid cycles. The coarse level must have its fitting constraints when this level is solved.
+	 *
+	 * @param newCoarseLevel
+	 *        the next coarser <code>MultiGridLevel</code>, or 0 if this is the coarsest level
+	 * @param newCluster
+	 *        the <code>Cluster</code> which maps the points of this level to the points of the coarse level
+	 * @see Cluster#getParentPositionIndex
+	 */
+	void setCoarseLevel (MultiGridLevel *newCoarseLevel, Cluster *newCluster);
+
+	/**
+	 * returns the next coarser level, or 0
+	 */
+	MultiGridLevel *getCoarseLevel() const;
+
+	/**
+	 * Sets the multigrid cycle used to solve the least squares problem. A cycle smoothes the solution with
+	 * Gauss-Seidel sweeps, restricts the residual to the coarse level by summing it over the points of each
+	 * cluster, solves for the coarse correction with cycles on the coarse level (by conjugate gradients on the
+	 * coarsest level) and adds it to the points of each cluster. Default is <code>NO_CYCLE</code>.
+	 *
+	 * @see #setCoarseLevel
+	 */
+	void setCycleType (const CycleType newCycleType);
+
+	/**
+	 * get the multigrid cycle
+	 */
+	CycleType getCycleType() const;
+
+	/**
+	 * Enables the use of one multigrid cycle as preconditioner of conjugate gradients, instead of
+	 * repeating the cycles until the precision is reached.
+	 */
+	void setCyclePreconditioningEnabled (const bool enable);
+
+	/**
+	 * returns true if the multigrid cycle is used as preconditioner
+	 */
+	bool isCyclePreconditioningEnabled() const;
+
+	/**
+	 * Add fitting constraints to the least squares system. They are kept as a separate diagonal term,
+	 * the assembled directional derivatives matrix is not modified.
+	 *
+	 * @see SparseLeastSquares#addDiagonalConstraint
 	 */
 	void addFittingConstraints (const float *fittingConstraintsU, const float *fittingConstraintsV,
 								const uint *fittingConstraintsIndex, const uint nofConstraints, float weight);
 
 	/**
-	 * Remove the fitting constraints from the least squares system.
+	 * Remove the fitting constraints from the least squares system, in O(number of fitting constraints).
 	 */
-	void removeFittingConstraints();					// remove the fitting constraints currently stored in the fittingConstraints* arrays
+	void removeFittingConstraints();
 
 	
 	/**
-	 * Generate UV coordinates by solving the least squares system.
+	 * Generate UV coordinates by solving the least squares system, with conjugate gradients or multigrid
+	 * cycles.
+	 *
+	 * @see #setCycleType
 	 */
 	void generateUVCoordinates();
 
+	/**
+	 * Selects the two neighbours Pj and Pk of a point P which define the directional derivative along the plane
+	 * through P and Pi with normal <code>n</code>: among the neighbours on the other side of the plane through P
+	 * with normal Pi_P, the two with the smallest angles to the plane, where Pk is not colinear with Pj. Neighbour
+	 * <em>l</em> of P is candidate <code>c = l - 1</code>, the candidate of Pi is skipped.
+	 *
+	 * @param nofNeighbours
+	 *        the number of neighbours of P, including P itself; must be <code>fixedStencilSize</code> unless it is 0
+	 * @param skipped
+	 *        the candidate of Pi
+	 * @param dx
+	 *        the x coordinates of the vectors Pl_P = P - Pl of the candidates, <code>dy</code> and <code>dz</code>
+	 *        likewise
+	 * @param squaredLengths
+	 *        the squared lengths of the vectors Pl_P
+	 * @param squaredSines
+	 *        the squared sines of the angles between the vectors Pl_P and the plane
+	 * @param cosines
+	 *        the dot products of the vectors Pl_P and the normalized vector Pi_P
+	 * @param j
+	 *        returns the candidate of Pj, or -1
+	 * @param k
+	 *        returns the candidate of Pk, or -1
+	 */
+	template <int fixedStencilSize>
+	static void selectNeighbours (const int nofNeighbours, const int skipped, const float *dx, const float *dy, const float *dz,
+	                              const float *squaredLengths, const float *squaredSines, const float *cosines, int &j, int &k);
+
 private:
 
 	typedef enum positionFlag {
@@ -169,6 +304,13 @@ private:
 	} PositionFlag;
 
 	typedef int PositionFlags;
+
+	// a constraint on at most 'maxNofIndices' unknowns, which lives on the stack
+	template <int maxNofIndices> struct ConstraintRow {
+		int   indices[maxNofIndices];		// the indices I of the unknowns
+		float coefficients[maxNofIndices];	// the corresponding coefficients a
+		int   nofIndices;
+	};
 	
 	float              precision;
 	NeighbourHood      *neighbourHood;	                // a search structure to do nearest neighbor queries
@@ -179,23 +321,47 @@ private:
 	const Vector3D     *positions;                      // the positions, as stored in the 'neighbourHood'
 	const Vector3D     *normals;                        // the corresponding normals
 	uint               nofPositions;
+	uint               stencilSize;                     // number of neighbours of the directional derivatives constraints
 	float              *uvCoordinates;
 	PositionFlags      *positionFlags;                  // an array which holds flags for each position
 
 	SparseLeastSquares *leastSquares;
 
-	std::vector<float>      fittingConstraintsU;				// U coordinates of the currently active fitting constraints
-	std::vector<float>      fittingConstraintsV;				// V coordinates of the currently active fitting constraints
-	std::vector<int>        fittingConstraintsIndex;			// indices of the surfels in the currently active fitting constraints			
-
-	
+	MultiGridLevel     *coarseLevel;                    // the next coarser level, or 0
+	Cluster            *cluster;                        // maps the points to the points of the coarse level
+	CycleType          cycleType;
+	bool               cyclePreconditioning;
+	double             *cycleSolution,                  // the correction of this level while cycling
+		               *cycleRightHandSide,             // the restricted residual of the finer level
+		               *cycleResidual,                  // the residual of this level
+		               *cycleCorrection,                // the prolongated correction of the coarse level
+		               *cycleProduct;                   // G * cycleCorrection
 
 	// the sparse least squares optimization problem	
 	void solveLeastSquares();
 
+	// solves the least squares optimization problem with multigrid cycles, returns the number of cycles
+	int solveWithCycles();
+	// prepares the systems and allocates the vectors of this level and all coarser levels for cycling, and releases them
+	void prepareCycles();
+	void releaseCycles();
+	// does one cycle of the given type on the system G * x = f of this level
+	void cycle (double *x, const double *f, const CycleType type);
+
 	void addRegularizationConstraints();
 	void addDirectionalDerivativesConstraints();
-	void normalizeAndAddConstraint (std::vector<int> &I, std::vector<float> &a, float b[2], const float w, bool addFlag = true);
+	// records the directional derivatives constraints of the point 'index' in the 'buffer', returns true
+	// if the point lies on the geometric boundary. the stencil size is the template parameter, or the
+	// number of neighbours 'nofNeighbours' of the point if the template parameter is 0
+	template <int fixedStencilSize>
+	bool addDirectionalDerivativesConstraints (const uint index, const uint *neighbourIndices, const int nofNeighbours,
+	                                           SparseLeastSquares::ConstraintBuffer &buffer);
+	// adds the constraint to the least squares system, or records it in the 'buffer' if given
+	void normalizeAndAddConstraint (std::vector<int> &I, std::vector<float> &a, float b[2], const float w, bool addFlag = true,
+	                                SparseLeastSquares::ConstraintBuffer *buffer = 0);
+	template <int maxNofIndices>
+	void normalizeAndAddConstraint (ConstraintRow<maxNofIndices> &row, float b[2], const float w, bool addFlag = true,
+	                                SparseLeastSquares::ConstraintBuffer *buffer = 0);
 
 	// resets all the position flags to NO_FLAGS
 	void resetFlags();
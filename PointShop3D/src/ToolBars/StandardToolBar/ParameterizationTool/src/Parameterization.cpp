@@ -52,6 +52,10 @@
 #include "Parameterization.h"
 #include "../../../../DataTypes/src/MyDataTypes.h" // for MyDataTypes::TextureCoordinate
 //#include "SplatBuffer.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 // #define PERFMEASURING
 
 #ifdef PERFMEASURING
@@ -102,30 +106,34 @@ Parameterization::Parameterization() {
 	nofLevels           = 4;
 	// set cluster size for generating multigrid levels
 	clusterSize         = 3;
+	// the number of levels is fixed
+	coarsestLevelSize   = 0;
 
 	precision           = 0.001f;
+	levelResidualReduction = 0.0f;
 	coverageThreshold   = 0.3f;
 	displacementScaling = 10.0f;
 	lowPassFilter       = 0.f;
 	fittingConstrWeights = 1.f;
+	solverVariant       = SparseLeastSquares::STANDARD_CG;
+	cycleType           = MultiGridLevel::NO_CYCLE;
+	cyclePreconditioning = false;
+	pipelinedConstruction = false;
+	nofProlongationNeighbours = 1;
+	stencilSize         = MULTIGRIDLEVEL_NOF_NEIGHBOURS;
+	coarseNeighbourApproximation = 0.0f;
+	indexOnlyTrees      = false;
+	neighbourSearchStructure = NeighbourHood::KD_TREE;
+	treeSnapshotPrefix  = "";
 
 	applyTexture           = true;
 	applyTextureAlpha      = false;
 	applyDisplacement      = false;
 	applyDisplacementAlpha = false;
 
-	levelSizes                = 0;
 	nofFittingConstraints     = 0;
-	multiGridLevels           = 0;
-	positions                 = 0;
-	normals                   = 0;
+	levels                    = 0;
 //	selectedSurfels           = 0;
-	uvCoordinates             = 0;                
-	neighbourHoods            = 0;
-	clusters                  = 0;
-	fittingConstraintsU       = 0;
-	fittingConstraintsV       = 0;
-	fittingConstraintIndices  = 0;
 
 	filterBrush = false;
 
@@ -154,6 +162,121 @@ float Parameterization::getPrecision() const {
 	return precision;
 }
 
+void Parameterization::setLevelResidualReduction (const float newLevelResidualReduction) {
+	levelResidualReduction = newLevelResidualReduction;
+}
+
+float Parameterization::getLevelResidualReduction() const {
+	return levelResidualReduction;
+}
+
+void Parameterization::setSolverVariant (const SparseLeastSquares::SolverVariant newSolverVariant) {
+	solverVariant = newSolverVariant;
+}
+
+SparseLeastSquares::SolverVariant Parameterization::getSolverVariant() const {
+	return solverVariant;
+}
+
+void Parameterization::setMultiGridCycle (const MultiGridLevel::CycleType newCycleType) {
+	cycleType = newCycleType;
+}
+
+MultiGridLevel::CycleType Parameterization::getMultiGridCycle() const {
+	return cycleType;
+}
+
+void Parameterization::setCyclePreconditioningEnabled (const bool enable) {
+	cyclePreconditioning = enable;
+}
+
+bool Parameterization::isCyclePreconditioningEnabled() const {
+	return cyclePreconditioning;
+}
+
+void Parameterization::setPipelinedConstructionEnabled (const bool enable) {
+	pipelinedConstruction = enable;
+}
+
+bool Parameterization::isPipelinedConstructionEnabled() const {
+	return pipelinedConstruction;
+}
+
+void Parameterization::setNofProlongationNeighbours (const uint newNofProlongationNeighbours) {
+	nofProlongationNeighbours = newNofProlongationNeighbours > 0 ? newNofProlongationNeighbours : 1;
+}
+
+uint Parameterization::getNofProlongationNeighbours() const {
+	return nofProlongationNeighbours;
+}
+
+void Parameterization::setStencilSize (const uint newStencilSize) {
+
+	uint validStencilSize;
+
+	// at least the point, Pi, Pj and Pk are needed for a directional derivatives constraint
+	validStencilSize = newStencilSize > MULTIGRIDLEVEL_MIN_NOF_NEIGHBOURS ? newStencilSize : MULTIGRIDLEVEL_MIN_NOF_NEIGHBOURS;
+	validStencilSize = validStencilSize < MULTIGRIDLEVEL_MAX_NOF_NEIGHBOURS ? validStencilSize : MULTIGRIDLEVEL_MAX_NOF_NEIGHBOURS;
+
+	if (stencilSize != validStencilSize) {
+		this->clearMultiGrid();
+		stencilSize = validStencilSize;
+	}
+
+}
+
+uint Parameterization::getStencilSize() const {
+	return stencilSize;
+}
+
+void Parameterization::setCoarseNeighbourApproximation (const float newEpsilon) {
+
+	if (coarseNeighbourApproximation != newEpsilon) {
+		this->clearMultiGrid();
+		coarseNeighbourApproximation = newEpsilon;
+	}
+
+}
+
+float Parameterization::getCoarseNeighbourApproximation() const {
+	return coarseNeighbourApproximation;
+}
+
+void Parameterization::setIndexOnlyTrees (const bool enable) {
+
+	if (indexOnlyTrees != enable) {
+		this->clearMultiGrid();
+		indexOnlyTrees = enable;
+	}
+
+}
+
+bool Parameterization::getIndexOnlyTrees() const {
+	return indexOnlyTrees;
+}
+
+void Parameterization::setNeighbourSearchStructure (const NeighbourHood::SearchStructure newSearchStructure) {
+
+	if (neighbourSearchStructure != newSearchStructure) {
+		this->clearMultiGrid();
+		neighbourSearchStructure = newSearchStructure;
+	}
+
+}
+
+NeighbourHood::SearchStructure Parameterization::getNeighbourSearchStructure() const {
+	return neighbourSearchStructure;
+}
+
+void Parameterization::setTreeSnapshotPrefix (const char *newPrefix) {
+	// the snapshots only replace building the same trees, the multigrid stays valid
+	treeSnapshotPrefix = newPrefix;
+}
+
+const char *Parameterization::getTreeSnapshotPrefix() const {
+	return treeSnapshotPrefix.c_str();
+}
+
 void Parameterization::setFittingConstrWeights(const float newWeigths) {
     fittingConstrWeights = newWeigths;
 }
@@ -212,6 +335,19 @@ uint Parameterization::getClusterSize() const {
 	return clusterSize;
 }
 
+void Parameterization::setCoarsestLevelSize (const uint newCoarsestLevelSize) {
+
+	if (coarsestLevelSize != newCoarsestLevelSize) {
+		this->clearMultiGrid();
+		coarsestLevelSize = newCoarsestLevelSize;
+	}
+
+}
+
+uint Parameterization::getCoarsestLevelSize() const {
+	return coarsestLevelSize;
+}
+
 
 void Parameterization::setDisplacementScaling (const float scaling) {
 	displacementScaling = scaling;
@@ -225,6 +361,7 @@ void Parameterization::generateUVCoordinates(bool resampleAtTextureResolutionFla
 
 //	StatusBar *statusBar;
 	uint i;
+	float levelPrecision;
 /*
 COMMENT_PERFMEASURING("Multigrid_levels",nofLevels);
 COMMENT_PERFMEASURING("Clustersize_levels",clusterSize);
@@ -245,21 +382,35 @@ COMMENT_PERFMEASURING("Clustersize_levels",clusterSize);
 
 //	statusBar->showMessage ("Adding fitting constraints...", -1);
 
-	for (i = 0; i < nofLevels; i++) {
-		multiGridLevels[i]->addFittingConstraints (fittingConstraintsU[i], fittingConstraintsV[i], fittingConstraintIndices[i], nofFittingConstraints, fittingConstrWeights);
+	for (i = 0; i < multiGrid.getNofLevels(); i++) {
+		levels[i].multiGridLevel->addFittingConstraints (levels[i].fittingConstraintsU, levels[i].fittingConstraintsV, levels[i].fittingConstraintIndices, nofFittingConstraints, fittingConstrWeights);
 	}
 
-	// solve levels, start at lowest level and propagate solution to higher levels
+	// solve levels, start at lowest level and propagate solution to higher levels. with multigrid cycles,
+	// each level is solved by cycles over all lower levels (full multigrid)
 //	statusBar->showMessage ("Solving equations...", -1);
 
 START_PERFMEASURING;
-	for (i = 0; i < nofLevels - 1; i++) {
-		multiGridLevels[i]->setPrecision (precision * (float)levelSizes[i] / (float)levelSizes[nofLevels - 1]);
-		multiGridLevels[i]->generateUVCoordinates();
+	for (i = 0; i < multiGrid.getNofLevels(); i++) {
+		levels[i].multiGridLevel->setSolverVariant (solverVariant);
+		levels[i].multiGridLevel->setCycleType (cycleType);
+		levels[i].multiGridLevel->setCyclePreconditioningEnabled (cyclePreconditioning);
+	}
+	for (i = 0; i < multiGrid.getNofLevels() - 1; i++) {
+		if (levelResidualReduction > 0.0f) {
+			// the level only provides the initial solution of the next level, hence it just reduces the residual
+			// it starts with, i.e. the one measured after the prolongation from the level below, by a fixed factor
+			levelPrecision = levelResidualReduction * levels[i].multiGridLevel->getRelativeResidual();
+			levels[i].multiGridLevel->setPrecision (levelPrecision > precision ? levelPrecision : precision);
+		}
+		else {
+			levels[i].multiGridLevel->setPrecision (precision * (float)levels[i].nofPositions / (float)levels[multiGrid.getNofLevels() - 1].nofPositions);
+		}
+		levels[i].multiGridLevel->generateUVCoordinates();
 		this->initSolutionFromLowerLevel (i + 1);
 	}
-	multiGridLevels[nofLevels-1]->setPrecision (precision);
-	multiGridLevels[nofLevels-1]->generateUVCoordinates();
+	levels[multiGrid.getNofLevels()-1].multiGridLevel->setPrecision (precision);
+	levels[multiGrid.getNofLevels()-1].multiGridLevel->generateUVCoordinates();
 STOP_PERFMEASURING("Multigrid_solution");
 	
 	if (resampleAtTextureResolutionFlag == false) {
@@ -271,18 +422,18 @@ STOP_PERFMEASURING("Multigrid_solution");
 		////////////////////////////////////////////////////////////
 		// export data
 		////////////////////////////////////////////////////////////
-		uint nofPositions = levelSizes[nofLevels - 1];
+		uint nofPositions = levels[multiGrid.getNofLevels() - 1].nofPositions;
 		finalUV.resize(nofPositions);
 
 		for (i = 0; i < nofPositions; i++) {
-			float u = uvCoordinates[nofLevels - 1][i];
-			float v = uvCoordinates[nofLevels - 1][i + nofPositions];
+			float u = levels[multiGrid.getNofLevels() - 1].uvCoordinates[i];
+			float v = levels[multiGrid.getNofLevels() - 1].uvCoordinates[i + nofPositions];
 			finalUV[i].x = u;
 			finalUV[i].y = v;
 		}
 
-		for (i = 0; i < nofLevels; i++) {
-			multiGridLevels[i]->removeFittingConstraints();
+		for (i = 0; i < multiGrid.getNofLevels(); i++) {
+			levels[i].multiGridLevel->removeFittingConstraints();
 		}
 	}
 	else {
@@ -342,22 +493,8 @@ void Parameterization::initializeFittingConstraints() {
 //*/
 	nofFittingConstraints = glm::max(markers2D.size(), markers3Dindex.size());
 
-	// remove the old fittingConstraint coordinates and indices, if there are any
-	if (fittingConstraintsU[nofLevels -1] != 0) {
-		delete[] fittingConstraintsU[nofLevels -1];
-	}
-
-	if (fittingConstraintsV[nofLevels -1] != 0) {
-		delete[] fittingConstraintsV[nofLevels -1];
-	}
-
-	if (fittingConstraintIndices[nofLevels - 1] != 0) {
-		delete[] fittingConstraintIndices[nofLevels - 1];
-	}
-
-	fittingConstraintsU[nofLevels - 1]      = new float[nofFittingConstraints];
-	fittingConstraintsV[nofLevels - 1]      = new float[nofFittingConstraints];
-	fittingConstraintIndices[nofLevels - 1] = new  uint[nofFittingConstraints];
+	// the arrays of the old fittingConstraint coordinates and indices are reused, if they are large enough
+	multiGrid.allocateFittingConstraints (nofFittingConstraints);
 	
 	nofSelectedSurfels = 0;
 	for (i = 0; i < nofFittingConstraints; i++) {
@@ -372,12 +509,12 @@ void Parameterization::initializeFittingConstraints() {
 
 			// store all fitting constraints in an internal table
 			/*
-			fittingConstraintsU[nofLevels - 1][nofSelectedSurfels] = currentMarker2D->getNormalX();
-			fittingConstraintsV[nofLevels - 1][nofSelectedSurfels] = currentMarker2D->getNormalY();
+			levels[multiGrid.getNofLevels() - 1].fittingConstraintsU[nofSelectedSurfels] = currentMarker2D->getNormalX();
+			levels[multiGrid.getNofLevels() - 1].fittingConstraintsV[nofSelectedSurfels] = currentMarker2D->getNormalY();
 			surfelPosition = surfel->getPosition();
 			//*/
-			fittingConstraintsU[nofLevels - 1][nofSelectedSurfels] = markers2D[i].x;
-			fittingConstraintsV[nofLevels - 1][nofSelectedSurfels] = markers2D[i].y;;
+			levels[multiGrid.getNofLevels() - 1].fittingConstraintsU[nofSelectedSurfels] = markers2D[i].x;
+			levels[multiGrid.getNofLevels() - 1].fittingConstraintsV[nofSelectedSurfels] = markers2D[i].y;;
 
 			// search the position in the 'positions' array, which yields the index
 /*
@@ -385,7 +522,7 @@ void Parameterization::initializeFittingConstraints() {
 			index      = 0;
 			while (indexFound == false) {
 
-				position = positions[nofLevels - 1][index];
+				position = levels[multiGrid.getNofLevels() - 1].positions[index];
 				if (position == surfelPosition) {
 					indexFound = true;
 				}
@@ -394,9 +531,9 @@ void Parameterization::initializeFittingConstraints() {
 				}
 
 			}
-			fittingConstraintIndices[nofLevels - 1][nofSelectedSurfels] = index;
+			levels[multiGrid.getNofLevels() - 1].fittingConstraintIndices[nofSelectedSurfels] = index;
 //*/
-			fittingConstraintIndices[nofLevels - 1][nofSelectedSurfels] = markers3Dindex[i];
+			levels[multiGrid.getNofLevels() - 1].fittingConstraintIndices[nofSelectedSurfels] = markers3Dindex[i];
 			nofSelectedSurfels++;
 
 		}
@@ -411,32 +548,16 @@ void Parameterization::initializeFittingConstraints() {
 	nofFittingConstraints = nofSelectedSurfels;
 
 	// propagate fitting constraints to lower levels
-	for (l = nofLevels - 1; l > 0; l--) {
-
-		// remove the old fittingConstraint coordinates and indices, if there are any
-		if (fittingConstraintsU[l - 1] != 0) {
-			delete[] fittingConstraintsU[l - 1];
-		}
-
-		if (fittingConstraintsV[l - 1] != 0) {
-			delete[] fittingConstraintsV[l - 1];
-		}
-
-		if (fittingConstraintIndices[l - 1] != 0) {
-			delete[] fittingConstraintIndices[l - 1];
-		}
-		fittingConstraintsU[l - 1]      = new float[nofFittingConstraints];
-		fittingConstraintsV[l - 1]      = new float[nofFittingConstraints];
-		fittingConstraintIndices[l - 1] = new  uint[nofFittingConstraints];
+	for (l = multiGrid.getNofLevels() - 1; l > 0; l--) {
 
 		for (i = 0; i < nofFittingConstraints; i++) {
 			
 			// copy U and V values
-			fittingConstraintsU[l - 1][i] = fittingConstraintsU[l][i];
-			fittingConstraintsV[l - 1][i] = fittingConstraintsV[l][i];
+			levels[l - 1].fittingConstraintsU[i] = levels[l].fittingConstraintsU[i];
+			levels[l - 1].fittingConstraintsV[i] = levels[l].fittingConstraintsV[i];
 			// assign the constraint to the parent surfel of the higher level surfel
-			index = clusters[l]->getParentPositionIndex (fittingConstraintIndices[l][i]);
-			fittingConstraintIndices[l - 1][i] = index;
+			index = levels[l].cluster->getParentPositionIndex (levels[l].fittingConstraintIndices[i]);
+			levels[l - 1].fittingConstraintIndices[i] = index;
 
 		}
 
@@ -474,7 +595,7 @@ void Parameterization::assignTexture () {
 
 	Painter *painter = new Painter (brush);
 
-	nofPositions = levelSizes[nofLevels - 1];
+	nofPositions = levels[multiGrid.getNofLevels() - 1].nofPositions;
 
 	textureCoordinates.resize (nofPositions);
 	texturedSurfels.resize (nofPositions);
@@ -488,8 +609,8 @@ void Parameterization::assignTexture () {
 	numOfTexturedSurfels = 0;
 	for (i = 0; i < nofPositions; i++) {
 
-		u = uvCoordinates[nofLevels - 1][i];
-		v = uvCoordinates[nofLevels - 1][i + nofPositions];
+		u = levels[multiGrid.getNofLevels() - 1].uvCoordinates[i];
+		v = levels[multiGrid.getNofLevels() - 1].uvCoordinates[i + nofPositions];
 
 		texCoord.u = u;
 		texCoord.v = v;
@@ -579,7 +700,7 @@ void Parameterization::resampleAtTextureResolution() {
 	// rasterize original surfels into splat buffer
 	splatBuffer->clearBuffer();
 
-	nofPositions = levelSizes[nofLevels - 1];
+	nofPositions = levels[multiGrid.getNofLevels() - 1].nofPositions;
 
 	// speciality: we use the alpha component of the position brush channel for 
 	// modulating the low pass filter
@@ -600,8 +721,8 @@ void Parameterization::resampleAtTextureResolution() {
 		surfel = selectedSurfels[i];
 		
 		// uv = surfel->getTextureCoordinate();
-		uv.u = uvCoordinates[nofLevels - 1][i];
-		uv.v = uvCoordinates[nofLevels - 1][i + nofPositions];
+		uv.u = levels[multiGrid.getNofLevels() - 1].uvCoordinates[i];
+		uv.v = levels[multiGrid.getNofLevels() - 1].uvCoordinates[i + nofPositions];
 
 		// splat all surfels. clipping to texture domain is performed during rasterization
 		// writes J, localX, localY
@@ -678,7 +799,7 @@ void Parameterization::resampleAtTextureResolution() {
 //*/
 bool Parameterization::computeJacobian (int positionIndex, float J[4], Vector3D& X, Vector3D& Y) {
 
-	NeighbourHood                  *neighbourHood = neighbourHoods[nofLevels - 1];
+	NeighbourHood                  *neighbourHood = levels[multiGrid.getNofLevels() - 1].neighbourHood;
 	Vector3D                       p,
 		                           p0,
 					               p0_p,
@@ -695,14 +816,23 @@ bool Parameterization::computeJacobian (int positionIndex, float J[4], Vector3D&
 	int                            i;
 	
 	int                            nofNeighbours = 7;
+	const NeighbourGraph           *neighbourGraph;
+	const uint                     *neighbourIndices;
 
-	p0 = positions[nofLevels - 1][positionIndex];
-	uv0.u = uvCoordinates[nofLevels - 1][positionIndex];
-	uv0.v = uvCoordinates[nofLevels - 1][positionIndex + levelSizes[nofLevels - 1]];
+	p0 = levels[multiGrid.getNofLevels() - 1].positions[positionIndex];
+	uv0.u = levels[multiGrid.getNofLevels() - 1].uvCoordinates[positionIndex];
+	uv0.v = levels[multiGrid.getNofLevels() - 1].uvCoordinates[positionIndex + levels[multiGrid.getNofLevels() - 1].nofPositions];
 
 	// neighbourHood->computeNearestPoints (p0, nNeighbors);
-	neighbourHood->setNofNeighbours (nofNeighbours);
-	neighbourHood->setSourcePoint (p0);
+	neighbourGraph   = neighbourHood->getNeighbourGraph (nofNeighbours);
+	neighbourIndices = &(neighbourGraph->indices[neighbourGraph->offsets[positionIndex]]);
+	// the row is shorter if the level has fewer points than neighbours
+	if (neighbourGraph->offsets[positionIndex + 1] - neighbourGraph->offsets[positionIndex] < (uint)nofNeighbours) {
+		nofNeighbours = neighbourGraph->offsets[positionIndex + 1] - neighbourGraph->offsets[positionIndex];
+		if (nofNeighbours < 2) {
+			return false;
+		}
+	}
 	
 	// initialize least squares matrix
 	for (i = 0; i < 4; i++) {
@@ -714,13 +844,13 @@ bool Parameterization::computeJacobian (int positionIndex, float J[4], Vector3D&
 	}
 
 	// compute local coordinate system (i.e. basis vectors X,Y) on the surfel tangent plane
-	indexS = neighbourHood->getNeighbourPositionIndex (nofNeighbours - 1);
+	indexS = neighbourIndices[nofNeighbours - 1];
 
 	// p = s->getPosition();
-	p = positions[nofLevels - 1][indexS];
+	p = levels[multiGrid.getNofLevels() - 1].positions[indexS];
 	p0_p = p - p0;
 	// n = surfel->getNormal();
-	n = normals[nofLevels - 1][indexS];
+	n = levels[multiGrid.getNofLevels() - 1].normals[indexS];
 	X = Vector3D::crossProduct(p0_p, n);
 	X.normalize();
 	Y = Vector3D::crossProduct(n, X);
@@ -729,9 +859,9 @@ bool Parameterization::computeJacobian (int positionIndex, float J[4], Vector3D&
 	// add the constraints for each neighbor to the least squares matrix
 	for (i = 1; i < nofNeighbours; i++) {
 
-		indexS = neighbourHood->getNeighbourPositionIndex (i);
+		indexS = neighbourIndices[i];
 
-		p = positions[nofLevels - 1][indexS];
+		p = levels[multiGrid.getNofLevels() - 1].positions[indexS];
 		p0_p = p - p0;
 
 		// compute local coordinates of the neighbor position
@@ -744,8 +874,8 @@ bool Parameterization::computeJacobian (int positionIndex, float J[4], Vector3D&
 		G[3] += y*y;
 
 		// s->getTextureCoords(uv);
-		uv[0] = uvCoordinates[nofLevels - 1][indexS];
-		uv[1] = uvCoordinates[nofLevels - 1][indexS + levelSizes[nofLevels - 1]];
+		uv[0] = levels[multiGrid.getNofLevels() - 1].uvCoordinates[indexS];
+		uv[1] = levels[multiGrid.getNofLevels() - 1].uvCoordinates[indexS + levels[multiGrid.getNofLevels() - 1].nofPositions];
 		c[0] += x * (uv[0]-uv0.u);
 		c[1] += y * (uv[0]-uv0.u);
 		c[2] += x * (uv[1]-uv0.v);
@@ -771,7 +901,7 @@ bool Parameterization::computeJacobian (int positionIndex, float J[4], Vector3D&
 /*
 bool Parameterization::computeJacobianUnstable(SurfelInterface* surfel, float J[4], Vector3D& X, Vector3D& Y) {
 	
-	NeighbourHood *neighbourHood = neighbourHoods[nofLevels - 1];
+	NeighbourHood *neighbourHood = levels[multiGrid.getNofLevels() - 1].neighbourHood;
 
 	SurfelInterface *S;
 	uint            index1,
@@ -810,7 +940,7 @@ bool Parameterization::computeJacobianUnstable(SurfelInterface* surfel, float J[
 
 	index1 = neighbourHood->getNeighbourPositionIndex(1);
 
-	P[1] = positions[nofLevels - 1][index1];
+	P[1] = levels[multiGrid.getNofLevels() - 1].positions[index1];
 
 	P0_P1 = P[1] - P[0];
 	X = P0_P1;
@@ -821,7 +951,7 @@ bool Parameterization::computeJacobianUnstable(SurfelInterface* surfel, float J[
 
 		index2 = neighbourHood->getNeighbourPositionIndex(i);
 
-		P[2] = positions[nofLevels - 1][index2];
+		P[2] = levels[multiGrid.getNofLevels() - 1].positions[index2];
 
 		P0_P2 = P[2] - P[0];
 		nP0_P2 = P0_P2;
@@ -849,11 +979,11 @@ bool Parameterization::computeJacobianUnstable(SurfelInterface* surfel, float J[
 	
 	uv0 = S->getTextureCoordinate();
 
-	uv1.u = uvCoordinates[nofLevels - 1][index1];
-	uv1.v = uvCoordinates[nofLevels - 1][index1 + levelSizes[nofLevels - 1]];
+	uv1.u = levels[multiGrid.getNofLevels() - 1].uvCoordinates[index1];
+	uv1.v = levels[multiGrid.getNofLevels() - 1].uvCoordinates[index1 + levels[multiGrid.getNofLevels() - 1].nofPositions];
 
-	uv2.u = uvCoordinates[nofLevels - 1][index2];
-	uv2.v = uvCoordinates[nofLevels - 1][index2 + levelSizes[nofLevels - 1]];
+	uv2.u = levels[multiGrid.getNofLevels() - 1].uvCoordinates[index2];
+	uv2.v = levels[multiGrid.getNofLevels() - 1].uvCoordinates[index2 + levels[multiGrid.getNofLevels() - 1].nofPositions];
 
 	du_dx = inv[0] * (uv1.u - uv0.u) + inv[1] * (uv2.u - uv0.u);
 	du_dy = inv[2] * (uv1.u - uv0.u) + inv[3] * (uv2.u - uv0.u);
@@ -876,26 +1006,162 @@ void Parameterization::initSolutionFromLowerLevel (const uint levelIndex) {
 		                           nofParentPositions,
 		                           i;
 
+	if (nofProlongationNeighbours > 1) {
+		this->interpolateSolutionFromLowerLevel (levelIndex);
+		return;
+	}
+
 	// propagate solution from parent surfels to their children
 	
-	nofPositions       = levelSizes[levelIndex];
-	nofParentPositions = levelSizes[levelIndex - 1];
+	nofPositions       = levels[levelIndex].nofPositions;
+	nofParentPositions = levels[levelIndex - 1].nofPositions;
 	for (i = 0; i < nofPositions; i++) {
 
-		parentIndex = clusters[levelIndex]->getParentPositionIndex (i);
-		uvCoordinates[levelIndex][i]                = uvCoordinates[levelIndex - 1][parentIndex];
-		uvCoordinates[levelIndex][i + nofPositions] = uvCoordinates[levelIndex - 1][parentIndex + nofParentPositions];
+		parentIndex = levels[levelIndex].cluster->getParentPositionIndex (i);
+		levels[levelIndex].uvCoordinates[i]                = levels[levelIndex - 1].uvCoordinates[parentIndex];
+		levels[levelIndex].uvCoordinates[i + nofPositions] = levels[levelIndex - 1].uvCoordinates[parentIndex + nofParentPositions];
 		
 	}
 
 }
 
+void Parameterization::interpolateSolutionFromLowerLevel (const uint levelIndex) {
+
+	const NeighbourHood *parentNeighbourHood;
+	const float         *parentUVCoordinates;
+	float               *levelUVCoordinates;
+	uint                nofPositions,
+		                nofParentPositions;
+	int                 i;
+
+	// the uv of each surfel is blended from the uvs of the nearest surfels of the lower level, weighted by
+	// their inverse squared distances. unlike the uv of the parent alone, this is continuous between clusters
+
+	nofPositions        = levels[levelIndex].nofPositions;
+	nofParentPositions  = levels[levelIndex - 1].nofPositions;
+	parentNeighbourHood = levels[levelIndex - 1].neighbourHood;
+	parentUVCoordinates = levels[levelIndex - 1].uvCoordinates;
+	levelUVCoordinates  = levels[levelIndex].uvCoordinates;
+
+	#pragma omp parallel
+	{
+		// each thread uses its own query context, the neighbourhood itself is only read
+		KdQueryContext         context;
+		std::vector<Neighbour> neighbours (nofProlongationNeighbours);
+		uint                   nofFound,
+			                   parentIndex,
+			                   j;
+		float                  weight,
+			                   sumWeights,
+			                   u,
+			                   v;
+
+		context.queue.setSize (nofProlongationNeighbours);
+		context.neighbours = &neighbours[0];
+
+		#pragma omp for schedule(dynamic, 1024)
+		for (i = 0; i < (int)nofPositions; i++) {
+
+			nofFound = parentNeighbourHood->queryNeighbours (levels[levelIndex].positions[i], context);
+			if (nofFound == 0 || neighbours[0].weight == 0.0f) {
+				// no neighbour within the maximum query distance, or one at the same position: take its uv
+				parentIndex = nofFound == 0 ? levels[levelIndex].cluster->getParentPositionIndex (i) : neighbours[0].index;
+				levelUVCoordinates[i]                = parentUVCoordinates[parentIndex];
+				levelUVCoordinates[i + nofPositions] = parentUVCoordinates[parentIndex + nofParentPositions];
+				continue;
+			}
+
+			sumWeights = 0.0f;
+			u = 0.0f;
+			v = 0.0f;
+			for (j = 0; j < nofFound; j++) {
+				weight = 1.0f / neighbours[j].weight;
+				parentIndex = neighbours[j].index;
+				u += weight * parentUVCoordinates[parentIndex];
+				v += weight * parentUVCoordinates[parentIndex + nofParentPositions];
+				sumWeights += weight;
+			}
+			levelUVCoordinates[i]                = u / sumWeights;
+			levelUVCoordinates[i + nofPositions] = v / sumWeights;
+		}
+	}
+
+}
+
+NeighbourHood *Parameterization::createNeighbourHood (const uint levelIndex) {
+
+	NeighbourHood *neighbourHood = new NeighbourHood (10, indexOnlyTrees);
+	neighbourHood->setSearchStructure (neighbourSearchStructure);
+
+	if (treeSnapshotPrefix.empty() == true) {
+		neighbourHood->setPositions (levels[levelIndex].positions, levels[levelIndex].nofPositions);
+	}
+	else {
+		// a snapshot of other positions is replaced by the tree of the current ones
+		char fileName[32];
+		sprintf (fileName, "level%u.kdt", levelIndex);
+		std::string snapshotFileName = treeSnapshotPrefix + fileName;
+		if (neighbourHood->setPositions (levels[levelIndex].positions, levels[levelIndex].nofPositions, snapshotFileName.c_str()) == false) {
+			neighbourHood->saveSnapshot (snapshotFileName.c_str());
+		}
+	}
+
+	return neighbourHood;
+
+}
+
+void Parameterization::createNeighbourGraph (const uint levelIndex) {
+
+	uint nofGraphNeighbours;
+
+	// the MultiGridLevel and the cluster of the level share the graph, hence it has enough neighbours for both and
+	// none of them changes it (see NeighbourHood::getNeighbourGraph)
+	nofGraphNeighbours = stencilSize;
+	if (clusterSize > nofGraphNeighbours) {
+		nofGraphNeighbours = clusterSize;
+	}
+	levels[levelIndex].neighbourHood->getNeighbourGraph (nofGraphNeighbours);
+
+}
+
+void Parameterization::createCoarseLevel (const uint levelIndex) {
+
+	uint i,
+		 nofClusters;
+
+	// cluster surfels to generate surfels of new level
+	// NOTE: the clustering algorithm generates indices for the new surfels, too
+	levels[levelIndex + 1].cluster = new Cluster (levels[levelIndex + 1].neighbourHood, levels[levelIndex + 1].normals, clusterSize);
+	
+	// initialize positions and normals - the arrays are allocated for the maximum number of clusters
+	levels[levelIndex].positions = multiGrid.allocateVectors (levels[levelIndex + 1].cluster->getMaximumNofClusters());
+	levels[levelIndex].normals   = multiGrid.allocateVectors (levels[levelIndex + 1].cluster->getMaximumNofClusters());
+	levels[levelIndex + 1].cluster->calculate (levels[levelIndex].positions, levels[levelIndex].normals, &nofClusters);
+	levels[levelIndex].nofPositions = nofClusters;
+
+	// the coarse levels only guide the solution of the finest level, approximate neighbours do
+	levels[levelIndex].neighbourHood = this->createNeighbourHood (levelIndex);
+	levels[levelIndex].neighbourHood->setApproximationError (coarseNeighbourApproximation);
+	this->createNeighbourGraph (levelIndex);
+
+	levels[levelIndex].uvCoordinates = multiGrid.allocateFloats (2 * nofClusters);
+	for (i = 0; i < 2 * nofClusters; i++) levels[levelIndex].uvCoordinates[i] = 0.f;
+
+	// the fitting constraints are allocated and initialized later on in the algorithm
+
+}
+
 void Parameterization::initializeMultiGrid() {
 
-	uint                         i,j,
+	uint                         i,
 		                         baseLevel,
-		                         nofSelectedSurfels,
-					             nofClusters;
+		                         nofHierarchyLevels,
+		                         nofSelectedSurfels;
+	size_t                       nofBytes;
+	bool                         isCoarsestLevel;
+#ifdef _OPENMP
+	int                          nofActiveLevels;
+#endif
 /*
 	std::vector<SurfelInterface*> *selection;
 	SurfelInterface              *surfel;
@@ -907,17 +1173,32 @@ void Parameterization::initializeMultiGrid() {
 		this->clearMultiGrid();
 	}
 
-	levelSizes                = new uint[nofLevels];                      
-	multiGridLevels           = new MultiGridLevel*[nofLevels];
-	positions                 = new Vector3D*[nofLevels];
-	normals                   = new Vector3D*[nofLevels];
-	uvCoordinates             = new float*[nofLevels * 2];  // 2 floats per uv-coordinate                
-	neighbourHoods            = new NeighbourHood*[nofLevels];
-	clusters                  = new Cluster*[nofLevels];
-	fittingConstraintsU       = new float*[nofLevels];
-	fittingConstraintsV       = new float*[nofLevels];
-	fittingConstraintIndices  = new uint*[nofLevels];
+	if (coarsestLevelSize > 0) {
+		// the levels are allocated for the maximum number of levels, and those which are not needed are
+		// removed again below. the number of levels set with setNofLevels is kept for later
+		nofHierarchyLevels = PARAMETERIZATION_MAX_NOF_LEVELS;
+	}
+	else {
+		nofHierarchyLevels = nofLevels;
+	}
+
+//	selection = CoreTools::getInstance()->getSelectionTool()->getSelection();
 
+//	nofSelectedSurfels = selection->size();
+	nofSelectedSurfels = targetCloudPoints.size();
+
+	// all arrays of the levels are allocated from one block: the positions, normals and uvs of the base level, the
+	// same for the coarser levels, which have at most 1 / clusterSize as many points as the next finer one, and the
+	// fitting constraints
+	nofBytes = (2 * sizeof (Vector3D) + 2 * sizeof (float)) * (size_t)nofSelectedSurfels;
+	if (clusterSize > 1) {
+		nofBytes += nofBytes / (clusterSize - 1);
+	}
+	nofBytes += nofHierarchyLevels * (sizeof (MultiGridHierarchy::Level) + (2 * sizeof (float) + sizeof (uint)) * glm::max (markers2D.size(), markers3Dindex.size()) +
+	                         6 * MULTIGRIDHIERARCHY_ALIGNMENT);
+	multiGrid.reserve (nofBytes);
+	multiGrid.setNofLevels (nofHierarchyLevels);
+	levels = multiGrid.getLevels();
 
 	// find out whether we are working with elliptical surfels. note that we cannot 
 	// find out from the selection, since the selection is a std::vector<SurfelInterface*> of surfels, 
@@ -938,28 +1219,24 @@ void Parameterization::initializeMultiGrid() {
 	// initialize the base level
 	// *************************
 
-	baseLevel = nofLevels - 1;
+	baseLevel = nofHierarchyLevels - 1;
 
 	// initialise the "pyramid base" level with the positions and normals of the selected surfels,
 	// the multiGridLevel, the neighbourHood and the uvCoordinates
 	// (the fitting constraints are allocated and initialized later on in this algorithm)
 	
-//	selection = CoreTools::getInstance()->getSelectionTool()->getSelection();
-
-//	nofSelectedSurfels = selection->size();
-	nofSelectedSurfels = targetCloudPoints.size();
-	levelSizes[baseLevel] = nofSelectedSurfels;
+	levels[baseLevel].nofPositions = nofSelectedSurfels;
 	
 	// positions and normals from selected surfels
-	positions[baseLevel] = new Vector3D[nofSelectedSurfels];
-	normals[baseLevel]   = new Vector3D[nofSelectedSurfels];
+	levels[baseLevel].positions = multiGrid.allocateVectors (nofSelectedSurfels);
+	levels[baseLevel].normals   = multiGrid.allocateVectors (nofSelectedSurfels);
 //	selectedSurfels      = new SurfelInterface*[nofSelectedSurfels];
 	/*
 	for (i = 0 ; i < selection->size(); i++) {
 		
 		surfel = selection->at(i);
-		positions[baseLevel][i] = surfel->getPosition();
-		normals[baseLevel][i]   = surfel->getNormal();
+		levels[baseLevel].positions[i] = surfel->getPosition();
+		levels[baseLevel].normals[i]   = surfel->getNormal();
 		selectedSurfels[i]      = surfel;
 	
 	}
@@ -980,220 +1257,97 @@ void Parameterization::initializeMultiGrid() {
 		Vector3D p = Vector3D(px, py, pz);
 		Vector3D n = Vector3D(nx, ny, nz);
 
-		positions[baseLevel][i] = p;
-		normals[baseLevel][i] = n;
+		levels[baseLevel].positions[i] = p;
+		levels[baseLevel].normals[i] = n;
 	}
 
 
-	neighbourHoods[baseLevel]  = new NeighbourHood (positions[baseLevel], nofSelectedSurfels);
+	levels[baseLevel].neighbourHood  = this->createNeighbourHood (baseLevel);
+	this->createNeighbourGraph (baseLevel);
 
-	uvCoordinates[baseLevel]   = new float[2 * nofSelectedSurfels];
-	for(i = 0; i < 2*nofSelectedSurfels; i++) uvCoordinates[baseLevel][i] = 0.f;
-START_PERFMEASURING;
-	multiGridLevels[baseLevel] = new MultiGridLevel (neighbourHoods[baseLevel], normals[baseLevel], uvCoordinates[baseLevel]);
+	levels[baseLevel].uvCoordinates   = multiGrid.allocateFloats (2 * nofSelectedSurfels);
+	for(i = 0; i < 2*nofSelectedSurfels; i++) levels[baseLevel].uvCoordinates[i] = 0.f;
 	
-	// these are allocated and initialized later on in the algorithm
-	fittingConstraintsU[baseLevel]      = 0;
-	fittingConstraintsV[baseLevel]      = 0;
-	fittingConstraintIndices[baseLevel] = 0;
-
-	// ***************************
-	// initialize the upper levels
-	// ***************************
-
-	i = baseLevel;
-	while (i > 0) {
-		i--;
-		
-		// cluster surfels to generate surfels of new level
-		// NOTE: the clustering algorithm generates indices for the new surfels, too
-		clusters[i + 1] = new Cluster (neighbourHoods[i + 1], normals[i + 1], clusterSize);		
-		
-		// initialize positions and normals - note again that these arrays are deleted by
-		// the cluster itself
-		clusters[i + 1]->calculate (&(positions[i]), &(normals[i]), &nofClusters);
-		levelSizes[i] = nofClusters;
-
-		neighbourHoods[i]  = new NeighbourHood (positions[i], nofClusters);
-		uvCoordinates[i]   = new float[2 * nofClusters];
-		for(j = 0; j < 2*nofClusters; j++) uvCoordinates[i][j] = 0.f;
-		multiGridLevels[i] = new MultiGridLevel (neighbourHoods[i], normals[i], uvCoordinates[i]);
-
-		// these are allocated and initialized later on in the algorithm
-		fittingConstraintsU[i]      = 0;
-		fittingConstraintsV[i]      = 0;
-		fittingConstraintIndices[i] = 0;
+	// the fitting constraints are allocated and initialized later on in the algorithm
+
+	// ***************************************************
+	// assemble the levels and initialize the upper levels
+	// ***************************************************
+
+	// the assembly of level i and the clustering of level i into level i - 1 only read the positions, normals
+	// and neighbour graph of level i, hence they can run concurrently (only the clustering allocates arrays from
+	// the hierarchy). each inner parallel loop of the two keeps its threads then, which requires nested parallelism
+#ifdef _OPENMP
+#if _OPENMP >= 200805
+	nofActiveLevels = omp_get_max_active_levels();
+	if (pipelinedConstruction == true && nofActiveLevels < 2) {
+		omp_set_max_active_levels (2);
 	}
-STOP_PERFMEASURING("Multigrid_initialization");
-
-	// we do not need a cluster for the lowest level
-	clusters[0] = 0;
-
-	isMultiGridValid = true;
-
-}
-
-void Parameterization::clearMultiGrid() {
-
-	uint baseLevel,
-		 i;
-
-	// **************************************
-	// delete all entries in the upper levels
-	// **************************************
-
-	baseLevel = nofLevels - 1;
-
-	for (i = 0; i < nofLevels - 1; i++) {
-
-		if (multiGridLevels != 0 && multiGridLevels[i] != 0) {
-			delete multiGridLevels[i];
-			multiGridLevels[i] = 0;
-		}
-
-		// the normals and positions of levels 0 .. nofLevels - 2
-		// are deleted by the corresponding clusters!
+#else
+	nofActiveLevels = omp_get_nested();
+	if (pipelinedConstruction == true) {
+		omp_set_nested (1);
+	}
+#endif
+#endif
 
-		if (uvCoordinates != 0 && uvCoordinates[i] != 0) {
-			delete[] uvCoordinates[i];
-			uvCoordinates[i] = 0;
-		}
+START_PERFMEASURING;
+	i = baseLevel;
+	while (true) {
 
-		if (neighbourHoods != 0 && neighbourHoods[i] != 0) {
-			delete neighbourHoods[i];
-			neighbourHoods[i] = 0;
-		}
+		isCoarsestLevel = (i == 0 || (coarsestLevelSize > 0 && levels[i].nofPositions <= coarsestLevelSize));
 
-		if (clusters != 0 && clusters[i] != 0) {
-			delete clusters[i];
-			clusters[i] = 0;
-		}
+		#pragma omp parallel sections if (pipelinedConstruction == true && isCoarsestLevel == false) num_threads(2)
+		{
+			#pragma omp section
+			{
+				levels[i].multiGridLevel = new MultiGridLevel (levels[i].neighbourHood, levels[i].normals, levels[i].uvCoordinates, stencilSize);
+			}
 
-		if (fittingConstraintsU != 0 && fittingConstraintsU[i] != 0) {
-			delete[] fittingConstraintsU[i];
-			fittingConstraintsU[i] = 0;
+			#pragma omp section
+			{
+				if (isCoarsestLevel == false) {
+					this->createCoarseLevel (i - 1);
+				}
+			}
 		}
 
-		if (fittingConstraintsV != 0 && fittingConstraintsV[i] != 0) {
-			delete[] fittingConstraintsV[i];
-			fittingConstraintsV[i] = 0;
+		if (i < baseLevel) {
+			levels[i + 1].multiGridLevel->setCoarseLevel (levels[i].multiGridLevel, levels[i + 1].cluster);
 		}
 
-		if (fittingConstraintIndices != 0 && fittingConstraintIndices[i] != 0) {
-			delete[] fittingConstraintIndices[i];
-			fittingConstraintIndices[i] = 0;
+		if (isCoarsestLevel == true) {
+			break;
 		}
+		i--;
 
 	}
+STOP_PERFMEASURING("Multigrid_initialization");
 
-	// ****************************
-	// clear the base level entries
-	// ****************************
-
-	if (multiGridLevels != 0 && multiGridLevels[baseLevel] != 0) {
-		delete multiGridLevels[baseLevel];
-		multiGridLevels[baseLevel] = 0;
-	}
-
-	// we have to delete the base level positions and normals ourselves
-	if (positions != 0 && positions[baseLevel] != 0) {
-		delete[] positions[baseLevel];
-		positions[baseLevel] = 0;
-	}
-
-	if (normals != 0 && normals[baseLevel] != 0) {
-		delete[] normals[baseLevel];
-		normals[baseLevel] = 0;
-	}
-
-	if (uvCoordinates != 0 && uvCoordinates[baseLevel] != 0) {
-		delete[] uvCoordinates[baseLevel];
-		uvCoordinates[baseLevel] = 0;
-	}
-
-	if (neighbourHoods != 0 && neighbourHoods[baseLevel] != 0) {
-		delete neighbourHoods[baseLevel];
-		neighbourHoods[baseLevel] = 0;
-	}
-
-	if (clusters != 0 && clusters[baseLevel] != 0) {
-		delete clusters[baseLevel];
-		clusters[baseLevel] = 0;
-	}
-
-	if (fittingConstraintsU != 0 && fittingConstraintsU[baseLevel] != 0) {
-		delete[] fittingConstraintsU[baseLevel];
-		fittingConstraintsU[baseLevel] = 0;
-	}
-
-	if (fittingConstraintsV != 0 && fittingConstraintsV[baseLevel] != 0) {
-		delete[] fittingConstraintsV[baseLevel];
-		fittingConstraintsV[baseLevel] = 0;
-	}
-
-	if (fittingConstraintIndices != 0 && fittingConstraintIndices[baseLevel] != 0) {
-		delete[] fittingConstraintIndices[baseLevel];
-		fittingConstraintIndices[baseLevel] = 0;
-	}
-
-	// ************************
-	// delete each level itself
-	// ************************
-
-	if (levelSizes != 0) {
-		delete[] levelSizes;
-		levelSizes = 0;
-	}
-
-	if (multiGridLevels != 0) {
-		delete[] multiGridLevels;
-		multiGridLevels = 0;
-	}
-
-	if (positions != 0) {
-		delete[] positions;
-		positions = 0;
-	}
+#ifdef _OPENMP
+#if _OPENMP >= 200805
+	omp_set_max_active_levels (nofActiveLevels);
+#else
+	omp_set_nested (nofActiveLevels);
+#endif
+#endif
 
-	if (normals != 0) {
-		delete[] normals;
-		normals = 0;
-	}
-/*
-	if (selectedSurfels != 0) {
-		delete[] selectedSurfels;
-		selectedSurfels = 0;
-	}
-//*/
-	if (uvCoordinates != 0) {
-		delete[] uvCoordinates;
-		uvCoordinates = 0;
-	}
+	// we do not need a cluster for the lowest level, none has been created for it
 
-	if (neighbourHoods != 0) {
-		delete[] neighbourHoods;
-		neighbourHoods = 0;
+	if (i > 0) {
+		// the coarsest level is small enough already: move the levels i .. baseLevel to 0 .. baseLevel - i
+		multiGrid.removeEmptyLevels (i);
 	}
 
-	if (clusters != 0) {
-		delete[] clusters;
-		clusters = 0;
-	}
+	isMultiGridValid = true;
 
-	if (fittingConstraintsU != 0) {
-		delete[] fittingConstraintsU;
-		fittingConstraintsU = 0;
-	}
+}
 
-	if (fittingConstraintsV != 0) {
-		delete[] fittingConstraintsV;
-		fittingConstraintsV = 0;
-	}
+void Parameterization::clearMultiGrid() {
 
-	if (fittingConstraintIndices != 0) {
-		delete[] fittingConstraintIndices;
-		fittingConstraintIndices = 0;
-	}
+	// deletes the objects of all levels, the memory of all arrays of the levels is released at once
+	multiGrid.clear();
+	levels = 0;
 
 	isMultiGridValid = false;
 	
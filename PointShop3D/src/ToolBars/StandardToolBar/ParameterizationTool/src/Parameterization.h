@@ -36,11 +36,16 @@
 #include "../../../../Core/DataStructures/src/Cluster.h"
 //#include "../../../../Core/MarkerManager/src/MarkerManager.h"
 #include "MultiGridLevel.h"
+#include "MultiGridHierarchy.h"
 #include "SparseLeastSquares.h"
 #include <vector>
+#include <string>
 
 #include <glm/glm.hpp>
 
+// the maximum number of multigrid levels if their number is chosen automatically
+#define PARAMETERIZATION_MAX_NOF_LEVELS 16
+
 // TODO: just use the "textureAlpha" images for the ToolPatch, textures not needed (they only define the size
 //       of the ToolPatch, which is not efficient, and very obscure for the user)
 
@@ -63,12 +68,48 @@ public:
 	void setNofLevels (const uint newNumberOfLevels);
 	uint getNofLevels() const;
 
+	void setCoarsestLevelSize (const uint newCoarsestLevelSize);
+	uint getCoarsestLevelSize() const;
+
 	void setClusterSize (const uint newClusterSize);
 	uint getClusterSize() const;
 
 	void setPrecision (const float newPrecision);
 	float getPrecision() const;	
 
+	void setLevelResidualReduction (const float newLevelResidualReduction);
+	float getLevelResidualReduction() const;
+
+	void setSolverVariant (const SparseLeastSquares::SolverVariant newSolverVariant);
+	SparseLeastSquares::SolverVariant getSolverVariant() const;
+
+	void setMultiGridCycle (const MultiGridLevel::CycleType newCycleType);
+	MultiGridLevel::CycleType getMultiGridCycle() const;
+
+	void setCyclePreconditioningEnabled (const bool enable);
+	bool isCyclePreconditioningEnabled() const;
+
+	void setPipelinedConstructionEnabled (const bool enable);
+	bool isPipelinedConstructionEnabled() const;
+
+	void setNofProlongationNeighbours (const uint newNofProlongationNeighbours);
+	uint getNofProlongationNeighbours() const;
+
+	void setStencilSize (const uint newStencilSize);
+	uint getStencilSize() const;
+
+	void setCoarseNeighbourApproximation (const float newEpsilon);
+	float getCoarseNeighbourApproximation() const;
+
+	void setIndexOnlyTrees (const bool enable);
+	bool getIndexOnlyTrees() const;
+
+	void setNeighbourSearchStructure (const NeighbourHood::SearchStructure newSearchStructure);
+	NeighbourHood::SearchStructure getNeighbourSearchStructure() const;
+
+	void setTreeSnapshotPrefix (const char *newPrefix);
+	const char *getTreeSnapshotPrefix() const;
+
 	void setFittingConstrWeights(const float newWeigths);
 	float getFittingConstrWeights() const;
 	
@@ -97,28 +138,31 @@ public:
 
 private:
 	
-	uint			   nofLevels,						// number of multigrid levels
-				       clusterSize;						// size of clusters for generating multigrid levels
+	uint			   nofLevels,						// number of multigrid levels, if coarsestLevelSize is 0
+				       clusterSize,						// size of clusters for generating multigrid levels
+					   coarsestLevelSize;				// if not 0, levels are added until the coarsest one has at most this many points
 	float			   precision,
+	                   levelResidualReduction,			// if not 0, the factor by which the levels below the finest reduce their initial residual
 	         		   coverageThreshold,				// used when resampling at texture resolution: threshold indicating full surface coverage
 	                   displacementScaling,				// scaling factor for normal displacements stored in displacement maps
 			   lowPassFilter;				// low-pass filter used during resampling
 	float		   fittingConstrWeights;			// weights for the fitting constraints (vs. the minimum distortion constraints)
-	uint               *levelSizes,                     // the number of entries at each level
-	                   nofFittingConstraints;
-	MultiGridLevel     **multiGridLevels;
-	Vector3D           **positions,
-		               **normals;
+	SparseLeastSquares::SolverVariant solverVariant;	// conjugate gradient variant used on all levels
+	MultiGridLevel::CycleType cycleType;				// multigrid cycle used on all but the coarsest level, or NO_CYCLE for the cascade
+	bool               cyclePreconditioning;			// the multigrid cycle preconditions conjugate gradients
+	bool               pipelinedConstruction;			// each level is assembled while the next coarser level is built
+	uint               nofProlongationNeighbours;		// number of coarse points whose uvs are blended into the initial uv of a point, 1: the parent only
+	uint               stencilSize;						// number of neighbours of the directional derivatives constraints on all levels
+	float              coarseNeighbourApproximation;	// allowed relative error of the neighbours on all but the finest level
+	bool               indexOnlyTrees;					// the k-d trees of the levels do not copy the positions
+	NeighbourHood::SearchStructure neighbourSearchStructure;	// search structure of the neighbourhoods of all levels
+	std::string        treeSnapshotPrefix;				// if not empty, the k-d trees of the levels are kept in snapshot files with this prefix
+	uint               nofFittingConstraints;
+	MultiGridHierarchy multiGrid;						// the multigrid levels and the memory of their arrays
+	MultiGridHierarchy::Level *levels;					// the levels of multiGrid, the coarsest one first
 //	SurfelInterface    **selectedSurfels;               // we store the pointers to the selected surfels,
 	                                                    // so the generated uv coordinates can be easily
 	                                                    // assigned to them once the solution has been calculated
-	float              **uvCoordinates;                 // the resulting uv coordinates
-	NeighbourHood      **neighbourHoods;	            
-	Cluster            **clusters;
-
-	float              **fittingConstraintsU;			// U coordinates of the currently active fitting constraints
-	float              **fittingConstraintsV;			// V coordinates of the currently active fitting constraints
-	uint               **fittingConstraintIndices;		// indices of the surfels in the currently active fitting constraints
 	
 	bool               isMultiGridValid;
 
@@ -139,6 +183,10 @@ private:
 	
 	//void clearMultiGridLevels();						// clears all data structures associated with multigrid levels
 	void initSolutionFromLowerLevel (const uint levelIndex);			// init uv solution vector from a lower multigrid level
+	void interpolateSolutionFromLowerLevel (const uint levelIndex);	// the same, but blends the uvs of the nearest points of the lower level
+	NeighbourHood *createNeighbourHood (const uint levelIndex);			// creates the neighbourhood of the positions of a multigrid level
+	void createNeighbourGraph (const uint levelIndex);					// computes the neighbour graph shared by the MultiGridLevel and the cluster of a level
+	void createCoarseLevel (const uint levelIndex);						// clusters level levelIndex + 1 and creates the positions, normals, neighbourhood and uvs of level levelIndex
 
 	// initializes the multigrid data structure, filling the nofLevels-1 (bottom) with the coordinates
 	// and normals of the surfels in the currrent selection - the other 0..nofLevels-2 levels are initialized to 0
@@ -31,6 +31,14 @@
 //#include <qdatetime.h>
 #include "../../../../Utilities/src/Common.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// number of pipelined conjugate gradient iterations after which the recursively updated
+// vectors are replaced by their true values
+#define PIPELINED_CG_REPLACEMENT_PERIOD 50
+
 
 SparseLeastSquares::SparseLeastSquares(int n) {
 
@@ -38,6 +46,7 @@ SparseLeastSquares::SparseLeastSquares(int n) {
 
 	// set the number of unknowns in the system
 	nUnknowns = n;
+	solverVariant = STANDARD_CG;
 
 	// init column indices and matrix element value arrays
 	colIndices = new std::vector<int>[n];
@@ -58,10 +67,19 @@ SparseLeastSquares::SparseLeastSquares(int n) {
 	for(i=0; i<n; i++) {
 		rightHandSide[i] = 0.f;
 	}
+
+	// the system is not prepared yet
+	preparedMatrix.values = 0;
+	preparedMatrix.colIndices = 0;
+	preparedMatrix.nCols = 0;
+	preparedMatrix.startRow = 0;
+	preparedMatrix.n = 0;
+	preparedDiagonal = 0;
 }
 
 
 SparseLeastSquares::~SparseLeastSquares() {
+	this->releaseSystem();
 	delete[] colIndices;
 	delete[] values;
 }
@@ -69,8 +87,16 @@ SparseLeastSquares::~SparseLeastSquares() {
 
 void SparseLeastSquares::addConstraint(float b, std::vector<int>& I, std::vector<float> a, bool addFlag) {
 
+	if (I.size() > 0) {
+		this->addConstraint (b, &I[0], &a[0], (int)I.size(), addFlag);
+	}
+}
+
+
+void SparseLeastSquares::addConstraint (float b, const int *I, const float *a, const int nofIndices, bool addFlag) {
+
 	int i, j;
-	int n = I.size();
+	int n = nofIndices;
 
 	for(i=0; i<n; i++) {
 
@@ -100,6 +126,222 @@ void SparseLeastSquares::addConstraint(float b, std::vector<int>& I, std::vector
 }
 
 
+void SparseLeastSquares::bufferConstraint (ConstraintBuffer &buffer, float b, const std::vector<int> &I, const std::vector<float> &a, bool addFlag) {
+
+	SparseLeastSquares::bufferConstraint (buffer, b, I.size() > 0 ? &I[0] : 0, a.size() > 0 ? &a[0] : 0, (int)I.size(), addFlag);
+}
+
+
+void SparseLeastSquares::bufferConstraint (ConstraintBuffer &buffer, float b, const int *I, const float *a, const int nofIndices, bool addFlag) {
+
+	buffer.indices.insert (buffer.indices.end(), I, I + nofIndices);
+	buffer.coefficients.insert (buffer.coefficients.end(), a, a + nofIndices);
+	buffer.rightHandSides.push_back (b);
+	buffer.ends.push_back ((int)buffer.indices.size());
+	buffer.addFlags.push_back (addFlag ? 1 : 0);
+}
+
+
+void SparseLeastSquares::addConstraints (const ConstraintBuffer *buffers, const int nofBuffers) {
+
+	int nofPartitions,
+	    partition,
+	    i;
+
+#ifdef _OPENMP
+	nofPartitions = omp_get_max_threads();
+#else
+	nofPartitions = 1;
+#endif
+
+	if (nofPartitions <= 1) {
+		for (i = 0; i < nofBuffers; i++) {
+			this->addBufferedConstraints (buffers[i], 0, nUnknowns);
+		}
+		return;
+	}
+
+	// each partition owns a contiguous range of rows, hence no two threads ever
+	// touch the same matrix row or right hand side entry. the entries of each
+	// buffer are sorted into the partitions of their rows first, so that each
+	// thread only visits the entries of its own rows
+	std::vector<std::vector<int> > entries (nofBuffers),
+	                               partitionOffsets (nofBuffers);
+
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (i = 0; i < nofBuffers; i++) {
+		this->bucketBufferedConstraints (buffers[i], nofPartitions, entries[i], partitionOffsets[i]);
+	}
+
+	#pragma omp parallel for private(i) schedule(static, 1)
+	for (partition = 0; partition < nofPartitions; partition++) {
+		for (i = 0; i < nofBuffers; i++) {
+			this->addBufferedEntries (buffers[i], &entries[i][2 * partitionOffsets[i][partition]],
+			                          partitionOffsets[i][partition + 1] - partitionOffsets[i][partition]);
+		}
+	}
+}
+
+
+void SparseLeastSquares::bucketBufferedConstraints (const ConstraintBuffer &buffer, const int nofPartitions,
+                                                    std::vector<int> &entries, std::vector<int> &partitionOffsets) const {
+
+	int constraint,
+	    begin,
+	    k,
+	    row,
+	    partition;
+	std::vector<int> nextEntry;
+
+	// the row r belongs to the partition p with nUnknowns*p/nofPartitions <= r < nUnknowns*(p+1)/nofPartitions
+	#define ROW_PARTITION(r) ((int)((((long long)(r) + 1) * nofPartitions - 1) / nUnknowns))
+
+	// count the entries of each partition, rows outside of the system are not added at all
+	partitionOffsets.assign (nofPartitions + 1, 0);
+	for (k = 0; k < (int)buffer.indices.size(); k++) {
+		row = buffer.indices[k];
+		if (row >= 0 && row < nUnknowns) {
+			partitionOffsets[ROW_PARTITION(row) + 1]++;
+		}
+	}
+	for (partition = 0; partition < nofPartitions; partition++) {
+		partitionOffsets[partition + 1] += partitionOffsets[partition];
+	}
+
+	// store the entries in the order of the constraints, as pairs (constraint, position in 'indices'),
+	// plus one spare pair, so that the entries of an empty last partition can be addressed as well
+	entries.resize (2 * partitionOffsets[nofPartitions] + 2);
+	nextEntry.assign (partitionOffsets.begin(), partitionOffsets.end() - 1);
+	begin = 0;
+	for (constraint = 0; constraint < (int)buffer.ends.size(); constraint++) {
+		for (k = begin; k < buffer.ends[constraint]; k++) {
+			row = buffer.indices[k];
+			if (row >= 0 && row < nUnknowns) {
+				partition = ROW_PARTITION(row);
+				entries[2 * nextEntry[partition]]     = constraint;
+				entries[2 * nextEntry[partition] + 1] = k;
+				nextEntry[partition]++;
+			}
+		}
+		begin = buffer.ends[constraint];
+	}
+
+	#undef ROW_PARTITION
+}
+
+
+void SparseLeastSquares::addBufferedEntries (const ConstraintBuffer &buffer, const int *entries, const int nofEntries) {
+
+	int   constraint,
+	      begin,
+	      end,
+	      e, j;
+	int   row;
+	float b,
+	      ai;
+	const int   *I;
+	const float *a;
+
+	// same order of contributions as in addConstraint, restricted to the given entries
+	for (e = 0; e < nofEntries; e++) {
+
+		constraint = entries[2 * e];
+		begin      = constraint > 0 ? buffer.ends[constraint - 1] : 0;
+		end        = buffer.ends[constraint];
+		I          = &buffer.indices[begin];
+		a          = &buffer.coefficients[begin];
+		b          = buffer.rightHandSides[constraint];
+		row        = buffer.indices[entries[2 * e + 1]];
+		ai         = buffer.coefficients[entries[2 * e + 1]];
+
+		for (j = 0; j < end - begin; j++) {
+			if (buffer.addFlags[constraint] != 0) {
+				addContributionToMatrixElement (row, I[j], ai*a[j]);
+			} else {
+				addContributionToMatrixElement (row, I[j], -ai*a[j]);
+			}
+		}
+
+		if (buffer.addFlags[constraint] != 0) {
+			addContributionToRightHand (row, -ai*b);
+		} else {
+			addContributionToRightHand (row, ai*b);
+		}
+	}
+}
+
+
+void SparseLeastSquares::addBufferedConstraints (const ConstraintBuffer &buffer, const int firstRow, const int endRow) {
+
+	int   constraint,
+	      begin,
+	      end,
+	      i, j;
+	int   row;
+	float b;
+	const int   *I;
+	const float *a;
+
+	begin = 0;
+	for (constraint = 0; constraint < (int)buffer.ends.size(); constraint++) {
+
+		end = buffer.ends[constraint];
+		if (end == begin) {
+			continue;
+		}
+		I   = &buffer.indices[begin];
+		a   = &buffer.coefficients[begin];
+		b   = buffer.rightHandSides[constraint];
+
+		// same order of contributions as in addConstraint, restricted to the given rows
+		for (i = 0; i < end - begin; i++) {
+
+			row = I[i];
+			if (row < firstRow || row >= endRow) {
+				continue;
+			}
+
+			for (j = 0; j < end - begin; j++) {
+				if (buffer.addFlags[constraint] != 0) {
+					addContributionToMatrixElement (row, I[j], a[i]*a[j]);
+				} else {
+					addContributionToMatrixElement (row, I[j], -a[i]*a[j]);
+				}
+			}
+
+			if (buffer.addFlags[constraint] != 0) {
+				addContributionToRightHand (row, -a[i]*b);
+			} else {
+				addContributionToRightHand (row, a[i]*b);
+			}
+		}
+
+		begin = end;
+	}
+}
+
+
+void SparseLeastSquares::addDiagonalConstraint (float b, int i, float a) {
+
+	diagonalIndices.push_back (i);
+	diagonalCoefficients.push_back (a);
+	diagonalRightHandSides.push_back (b);
+}
+
+
+void SparseLeastSquares::clearDiagonalConstraints() {
+
+	diagonalIndices.clear();
+	diagonalCoefficients.clear();
+	diagonalRightHandSides.clear();
+}
+
+
+int SparseLeastSquares::getNofDiagonalConstraints() const {
+	return (int)diagonalIndices.size();
+}
+
+
 void SparseLeastSquares::addContributionToMatrixElement(int i, int j, float c) {
 
 	int k;
@@ -131,6 +373,42 @@ void SparseLeastSquares::addContributionToRightHand(int i, float c) {
 	rightHandSide[i] += c;
 }
 
+float SparseLeastSquares::getRelativeResidual (const float *x) const {
+
+	double *r, *c;
+	double rr, cc, a;
+	int    i, j;
+
+	r = new double[nUnknowns];
+	c = new double[nUnknowns];
+
+	for (i = 0; i < nUnknowns; i++) {
+		c[i] = rightHandSide[i];
+		r[i] = c[i];
+		for (j = 0; j < nCols[i]; j++) {
+			r[i] += (double)values[i][j] * x[colIndices[i][j]];
+		}
+	}
+	for (i = 0; i < (int)diagonalIndices.size(); i++) {
+		a = diagonalCoefficients[i];
+		r[diagonalIndices[i]] += a * a * x[diagonalIndices[i]] - a * diagonalRightHandSides[i];
+		c[diagonalIndices[i]] -= a * diagonalRightHandSides[i];
+	}
+
+	rr = 0.0;
+	cc = 0.0;
+	for (i = 0; i < nUnknowns; i++) {
+		rr += r[i] * r[i];
+		cc += c[i] * c[i];
+	}
+
+	delete[] r;
+	delete[] c;
+
+	return cc > 0.0 ? (float)sqrt (rr / cc) : 0.0f;
+
+}
+
 /**
  * Do it yourself: Hestenes-Stiefel conjugate gradient method as described in
  * "Constrained Texture Mapping", Levy, SIGGRAPH 2001 (*)
@@ -166,6 +444,11 @@ int SparseLeastSquares::solve(float *x, const unsigned int size, float epsilon)
 		d_rightHandSide[i] = rightHandSide[i];
 	}
 
+	// add the right hand side of the separate diagonal term, the matrix part was added by copyToDoubleArray
+	for (i = 0; i < (int)diagonalIndices.size(); i++) {
+		d_rightHandSide[diagonalIndices[i]] -= (double)diagonalCoefficients[i] * diagonalRightHandSides[i];
+	}
+
 	// solve linear equations
 	threshold = epsilon*epsilon * innerProduct(nUnknowns, d_rightHandSide, d_rightHandSide);
 
@@ -185,26 +468,32 @@ int SparseLeastSquares::solve(float *x, const unsigned int size, float epsilon)
 	float debug = innerProduct(nUnknowns, g, g);
 //	qDebug("SparseLeastSquares::solve: initial error is %f", debug);
 
-	while( (debug = innerProduct(nUnknowns, g, g)) > threshold) {
-
-		// in (*): p = G*r
-		matrixVectorProduct(M, r, p);
-		rho = innerProduct(nUnknowns, p, p);
-		sigma = innerProduct(nUnknowns, r, p);
-		tau = innerProduct(nUnknowns, g, r);
-		t = tau/sigma;
-		// in (*): x = x + t*r
-		vectorScalarProduct(nUnknowns, r, t, tmp);
-		addVectors(nUnknowns, d_x, tmp, d_x);
-		// in (*): g = g - t*p
-		vectorScalarProduct(nUnknowns, p, -t, tmp);
-		addVectors(nUnknowns, g, tmp, g);
-		gamma = (t*t * rho - tau) / tau;
-		// in (*): r = gamma*r + g
-		vectorScalarProduct(nUnknowns, r, gamma, tmp);
-		addVectors(nUnknowns, tmp, g, r);
-
-		its++;
+	if (solverVariant == PIPELINED_CG) {
+		its = solvePipelined(M, d_x, d_rightHandSide, g, threshold);
+	}
+	else {
+
+		while( (debug = innerProduct(nUnknowns, g, g)) > threshold) {
+
+			// in (*): p = G*r
+			matrixVectorProduct(M, r, p);
+			rho = innerProduct(nUnknowns, p, p);
+			sigma = innerProduct(nUnknowns, r, p);
+			tau = innerProduct(nUnknowns, g, r);
+			t = tau/sigma;
+			// in (*): x = x + t*r
+			vectorScalarProduct(nUnknowns, r, t, tmp);
+			addVectors(nUnknowns, d_x, tmp, d_x);
+			// in (*): g = g - t*p
+			vectorScalarProduct(nUnknowns, p, -t, tmp);
+			addVectors(nUnknowns, g, tmp, g);
+			gamma = (t*t * rho - tau) / tau;
+			// in (*): r = gamma*r + g
+			vectorScalarProduct(nUnknowns, r, gamma, tmp);
+			addVectors(nUnknowns, tmp, g, r);
+
+			its++;
+		}
 	}
 
 //	qDebug("SparseLeastSquares::solve: reached residuum %f in %i iterations in %i milliseconds", debug, its, timer.elapsed());
@@ -233,6 +522,303 @@ int SparseLeastSquares::solve(float *x, const unsigned int size, float epsilon)
 }
 
 
+void SparseLeastSquares::prepareSystem (double *f) {
+
+	int i, j, k;
+
+	this->releaseSystem();
+	this->copyToDoubleArray (preparedMatrix);
+
+	// remember where the diagonal elements are, for the Gauss-Seidel sweeps
+	preparedDiagonal = new int[nUnknowns];
+	for (i = 0; i < nUnknowns; i++) {
+		preparedDiagonal[i] = -1;
+		k = preparedMatrix.startRow[i];
+		for (j = 0; j < preparedMatrix.nCols[i]; j++) {
+			if (preparedMatrix.colIndices[k + j] == i) {
+				preparedDiagonal[i] = k + j;
+			}
+		}
+	}
+
+	if (f != 0) {
+		// f = -c, including the right hand side of the separate diagonal term
+		for (i = 0; i < nUnknowns; i++) {
+			f[i] = -(double)rightHandSide[i];
+		}
+		for (i = 0; i < (int)diagonalIndices.size(); i++) {
+			f[diagonalIndices[i]] += (double)diagonalCoefficients[i] * diagonalRightHandSides[i];
+		}
+	}
+
+}
+
+void SparseLeastSquares::releaseSystem() {
+
+	delete[] preparedMatrix.values;
+	delete[] preparedMatrix.colIndices;
+	delete[] preparedMatrix.nCols;
+	delete[] preparedMatrix.startRow;
+	delete[] preparedDiagonal;
+
+	preparedMatrix.values = 0;
+	preparedMatrix.colIndices = 0;
+	preparedMatrix.nCols = 0;
+	preparedMatrix.startRow = 0;
+	preparedDiagonal = 0;
+
+}
+
+int SparseLeastSquares::getNofUnknowns() const {
+	return nUnknowns;
+}
+
+void SparseLeastSquares::multiply (const double *x, double *r) const {
+	this->parallelMatrixVectorProduct (preparedMatrix, x, r);
+}
+
+void SparseLeastSquares::residual (const double *x, const double *f, double *r) const {
+
+	int i;
+
+	this->parallelMatrixVectorProduct (preparedMatrix, x, r);
+	for (i = 0; i < nUnknowns; i++) {
+		r[i] = f[i] - r[i];
+	}
+
+}
+
+void SparseLeastSquares::smooth (double *x, const double *f, const int nofSweeps, const bool forward) const {
+
+	int    sweep, i, j, k, first, end, step;
+	double s;
+
+	const double *dValues = preparedMatrix.values;
+	const int *dColIndices = preparedMatrix.colIndices;
+	const int *dNCols = preparedMatrix.nCols;
+	const int *dStartRow = preparedMatrix.startRow;
+
+	if (forward == true) {
+		first = 0;
+		end = nUnknowns;
+		step = 1;
+	}
+	else {
+		first = nUnknowns - 1;
+		end = -1;
+		step = -1;
+	}
+
+	// NOTE: each unknown uses the values updated before it in the same sweep, hence the sweeps are sequential
+	for (sweep = 0; sweep < nofSweeps; sweep++) {
+		for (i = first; i != end; i += step) {
+
+			if (preparedDiagonal[i] == -1) {
+				// the unknown is not constrained at all
+				continue;
+			}
+
+			s = f[i];
+			k = dStartRow[i];
+			for (j = 0; j < dNCols[i]; j++) {
+				s -= dValues[k] * x[dColIndices[k]];
+				k++;
+			}
+			x[i] += s / dValues[preparedDiagonal[i]];
+		}
+	}
+
+}
+
+int SparseLeastSquares::solvePrepared (double *x, const double *f, const float epsilon, const int maxIterations) const {
+
+	double *r, *p, *q;
+	double rr, rrOld, pq, threshold, alpha;
+
+	int its = 0;
+	int i;
+
+	r = new double[nUnknowns];
+	p = new double[nUnknowns];
+	q = new double[nUnknowns];
+
+	threshold = 0.0;
+	for (i = 0; i < nUnknowns; i++) {
+		threshold += f[i] * f[i];
+	}
+	threshold *= (double)epsilon * epsilon;
+
+	this->residual (x, f, r);
+	rr = 0.0;
+	for (i = 0; i < nUnknowns; i++) {
+		p[i] = r[i];
+		rr += r[i] * r[i];
+	}
+
+	while (rr > threshold && its < maxIterations) {
+
+		this->parallelMatrixVectorProduct (preparedMatrix, p, q);
+		pq = 0.0;
+		for (i = 0; i < nUnknowns; i++) {
+			pq += p[i] * q[i];
+		}
+		if (pq <= 0.0) {
+			// the search direction lies in the null space of the system
+			break;
+		}
+		alpha = rr / pq;
+
+		rrOld = rr;
+		rr = 0.0;
+		for (i = 0; i < nUnknowns; i++) {
+			x[i] += alpha * p[i];
+			r[i] -= alpha * q[i];
+			rr += r[i] * r[i];
+		}
+		for (i = 0; i < nUnknowns; i++) {
+			p[i] = r[i] + (rr / rrOld) * p[i];
+		}
+
+		its++;
+	}
+
+	delete[] r;
+	delete[] p;
+	delete[] q;
+
+	return its;
+
+}
+
+
+void SparseLeastSquares::setSolverVariant (const SolverVariant newSolverVariant) {
+	solverVariant = newSolverVariant;
+}
+
+SparseLeastSquares::SolverVariant SparseLeastSquares::getSolverVariant() const {
+	return solverVariant;
+}
+
+/**
+ * Pipelined conjugate gradient method as described in "Hiding global synchronization 
+ * latency in the preconditioned Conjugate Gradient algorithm", Ghysels and Vanroose, 
+ * Parallel Computing 2014 (**)
+ *
+ * The inner products gamma = (g,g) and delta = (w,g) of an iteration are independent 
+ * of the matrix vector product q = G*w, hence all three are computed in the same sweep
+ * over the matrix rows and there is only one global reduction per iteration. The 
+ * convergence test uses gamma, so it does not need an extra reduction either.
+ *
+ * The recurrences for g, w, s and z accumulate rounding errors much faster than in the
+ * standard method, which makes the residual stagnate far above the tight thresholds used
+ * on the coarse levels. Hence the recurrences are periodically replaced by the true 
+ * values (residual replacement, see "Analyzing the effect of local rounding error 
+ * propagation on the maximal attainable accuracy of the pipelined Conjugate Gradient 
+ * method", Cools et al., SIMAX 2018).
+ *
+ * The vector g must contain the initial residual -(G*x + c), it is overwritten.
+ */
+int SparseLeastSquares::solvePipelined(const dRowCompMatrix& m, double* x, double* c, double* g, double threshold) {
+
+	double *w, *q, *z, *s, *p;
+	double gamma, gammaOld, delta, alpha, alphaOld, beta;
+
+	int its = 0;
+	int i, j;
+
+	const double* dValues = m.values;
+	const int* dColIndices = m.colIndices;
+	const int* dNCols = m.nCols;
+	const int* dStartRow = m.startRow;
+
+	w = new double[nUnknowns];
+	q = new double[nUnknowns];
+	z = new double[nUnknowns];
+	s = new double[nUnknowns];
+	p = new double[nUnknowns];
+
+	// in (**): w = A*r
+	parallelMatrixVectorProduct(m, g, w);
+
+	gammaOld = 1.0;
+	alphaOld = 1.0;
+	for(;;) {
+
+		// the single reduction of the iteration, fused with q = A*w
+		gamma = 0.0;
+		delta = 0.0;
+		#pragma omp parallel for private(j) reduction(+:gamma,delta) schedule(static)
+		for(i=0; i<nUnknowns; i++) {
+
+			double sum = 0.0;
+			int k = dStartRow[i];
+			for(j=0; j<dNCols[i]; j++) {
+				sum += dValues[k] * w[dColIndices[k]];
+				k++;
+			}
+			q[i] = sum;
+
+			gamma += g[i]*g[i];
+			delta += w[i]*g[i];
+		}
+
+		if (gamma <= threshold || delta == 0.0) {
+			break;
+		}
+
+		if (its == 0) {
+			beta = 0.0;
+			alpha = gamma / delta;
+		}
+		else {
+			beta = gamma / gammaOld;
+			alpha = gamma / (delta - beta * gamma / alphaOld);
+		}
+
+		// update all recurrences in one sweep, no reductions involved
+		#pragma omp parallel for schedule(static)
+		for(i=0; i<nUnknowns; i++) {
+
+			if (its == 0) {
+				z[i] = q[i];
+				s[i] = w[i];
+				p[i] = g[i];
+			}
+			else {
+				z[i] = q[i] + beta * z[i];
+				s[i] = w[i] + beta * s[i];
+				p[i] = g[i] + beta * p[i];
+			}
+			x[i] += alpha * p[i];
+			g[i] -= alpha * s[i];
+			w[i] -= alpha * z[i];
+		}
+
+		gammaOld = gamma;
+		alphaOld = alpha;
+		its++;
+
+		if (its % PIPELINED_CG_REPLACEMENT_PERIOD == 0) {
+			// in (*): g = -(G*x + c), then w = G*g, s = G*p, z = G*s
+			parallelMatrixVectorProduct(m, x, g);
+			addVectors(nUnknowns, g, c, g);
+			vectorScalarProduct(nUnknowns, g, -1.f, g);
+			parallelMatrixVectorProduct(m, g, w);
+			parallelMatrixVectorProduct(m, p, s);
+			parallelMatrixVectorProduct(m, s, z);
+		}
+	}
+
+	delete[] w;
+	delete[] q;
+	delete[] z;
+	delete[] s;
+	delete[] p;
+
+	return its;
+}
+
+
 float SparseLeastSquares::innerProduct(std::vector<float> &a, std::vector<float> &b) {
 
 	uint   i;
@@ -298,14 +884,25 @@ int SparseLeastSquares::copyToDoubleArray(dRowCompMatrix& m) {
 
 	int nonZeroElements;
 	int i, j, k;
+	double *diagonal;
 
 	m.n = nUnknowns;
 	m.nCols = new int[nUnknowns];
 	m.startRow = new int[nUnknowns];
 
+	// accumulate the separate diagonal term, which is added to the copy only
+	diagonal = new double[nUnknowns];
+	for (i = 0; i < nUnknowns; i++) {
+		diagonal[i] = 0.0;
+	}
+	for (i = 0; i < (int)diagonalIndices.size(); i++) {
+		diagonal[diagonalIndices[i]] += (double)diagonalCoefficients[i] * diagonalCoefficients[i];
+	}
+
+	// reserve an additional element for each row with a diagonal term
 	nonZeroElements = 0;
 	for(i=0; i<nUnknowns; i++) {
-		nonZeroElements += nCols[i];
+		nonZeroElements += nCols[i] + (diagonal[i] != 0.0 ? 1 : 0);
 	}
 
 	m.values = new double[nonZeroElements];
@@ -319,11 +916,25 @@ int SparseLeastSquares::copyToDoubleArray(dRowCompMatrix& m) {
 		for(j=0; j<nCols[i]; j++) {
 			m.values[k] = values[i].at(j);
 			m.colIndices[k] = colIndices[i].at(j);
+			if (m.colIndices[k] == i) {
+				m.values[k] += diagonal[i];
+				diagonal[i] = 0.0;
+			}
+			k++;
+		}
+
+		if (diagonal[i] != 0.0) {
+			// the row has no diagonal element yet
+			m.values[k] = diagonal[i];
+			m.colIndices[k] = i;
+			m.nCols[i]++;
 			k++;
 		}
 	}
 
-	return nonZeroElements;
+	delete[] diagonal;
+
+	return k;
 }
 
 float SparseLeastSquares::innerProduct(int n, double* a, double* b) {
@@ -367,6 +978,32 @@ void SparseLeastSquares::matrixVectorProduct(const dRowCompMatrix& m, double* b,
 
 }
 
+void SparseLeastSquares::parallelMatrixVectorProduct(const dRowCompMatrix& m, const double* b, double* r) const {
+
+	int i, j;
+
+	const double* dValues = m.values;
+	const int* dColIndices = m.colIndices;
+	const int* dNCols = m.nCols;
+	const int* dStartRow = m.startRow;
+
+	// NOTE: in contrast to matrixVectorProduct, the row sums are accumulated in double
+	// precision. the pipelined method relies on w = G*g being consistent with g, otherwise 
+	// it stagnates.
+	#pragma omp parallel for private(j) schedule(static)
+	for(i=0; i<nUnknowns; i++) {
+
+		double s = 0.0;
+		int k = dStartRow[i];
+		for(j=0; j<dNCols[i]; j++) {
+			s += dValues[k] * b[dColIndices[k]];
+			k++;
+		}
+
+		r[i] = s;
+	}
+}
+
 void SparseLeastSquares::addVectors(int n, double* a, double* b, double* r) {
 
 	int i;
@@ -58,6 +58,27 @@ class SparseLeastSquares {
 
 public:
 
+	/**
+	 * The conjugate gradient variants which can be used to solve the system.
+	 */
+	typedef enum solverVariant {
+		STANDARD_CG  = 0,	// Hestenes-Stiefel conjugate gradients, three inner products per iteration
+		PIPELINED_CG = 1	// Ghysels-Vanroose pipelined conjugate gradients, one merged reduction per iteration
+	} SolverVariant;
+
+	/**
+	 * A sequence of constraints which is recorded with <code>bufferConstraint</code> instead of
+	 * being added to the system right away, e.g. by one of several threads which assemble
+	 * constraints in parallel. The recorded constraints are added with <code>addConstraints</code>.
+	 */
+	typedef struct constraintBuffer {
+		std::vector<int>   indices;			// the index arrays I of all constraints, one after the other
+		std::vector<float> coefficients;	// the corresponding coefficient arrays a
+		std::vector<float> rightHandSides;	// the right hand side b of each constraint
+		std::vector<int>   ends;			// the end of each constraint in 'indices' and 'coefficients'
+		std::vector<char>  addFlags;		// the addFlag of each constraint
+	} ConstraintBuffer;
+
 	SparseLeastSquares (int n);
 	virtual ~SparseLeastSquares();
 
@@ -69,6 +90,66 @@ public:
 	 */
 	void addConstraint(float b, std::vector<int>& I, std::vector<float> a, bool addFlag = true);
 
+	/**
+	 * Adds the linear constraint on the <code>nofIndices</code> unknowns in the array <code>I</code>, with the
+	 * coefficients in the array <code>a</code>, to the system. Does the same as the <code>std::vector</code>
+	 * variant, but without requiring the constraint to be stored on the heap.
+	 */
+	void addConstraint (float b, const int *I, const float *a, const int nofIndices, bool addFlag = true);
+
+	/**
+	 * Records the linear constraint given as in <code>addConstraint</code> at the end of the
+	 * <code>buffer</code>, without touching any system.
+	 *
+	 * @see #addConstraints
+	 */
+	static void bufferConstraint (ConstraintBuffer &buffer, float b, const std::vector<int> &I, const std::vector<float> &a, bool addFlag = true);
+
+	/**
+	 * Records the linear constraint given as in the array variant of <code>addConstraint</code> at the end
+	 * of the <code>buffer</code>.
+	 *
+	 * @see #addConstraints
+	 */
+	static void bufferConstraint (ConstraintBuffer &buffer, float b, const int *I, const float *a, const int nofIndices, bool addFlag = true);
+
+	/**
+	 * Adds all constraints recorded in the <code>nofBuffers</code> <code>buffers</code> to the system,
+	 * buffer after buffer. The rows of the matrix are split among the available threads. The entries
+	 * of each buffer are sorted by these row partitions once, and each thread adds the contributions
+	 * of its own entries in the order of the constraints, hence the resulting
+	 * system is exactly the same as if the constraints were added one by one with <code>addConstraint</code>.
+	 *
+	 * @see #bufferConstraint
+	 */
+	void addConstraints (const ConstraintBuffer *buffers, const int nofBuffers);
+
+	/**
+	 * Adds the linear constraint a * x[i] = b on the single unknown <code>i</code> to a separate diagonal
+	 * term of the system. The matrix assembled by <code>addConstraint</code> is not modified, the diagonal
+	 * term is only added to a copy of it in <code>solve</code>. Hence constraints which change often, like
+	 * fitting constraints, can be replaced in O(number of constraints) and without any cancellation error.
+	 *
+	 * @see #clearDiagonalConstraints
+	 */
+	void addDiagonalConstraint (float b, int i, float a);
+
+	/**
+	 * Removes all constraints added with <code>addDiagonalConstraint</code>.
+	 */
+	void clearDiagonalConstraints();
+
+	/**
+	 * Returns the number of constraints added with <code>addDiagonalConstraint</code>.
+	 */
+	int getNofDiagonalConstraints() const;
+
+	/**
+	 * Returns the relative residual ||G * x + c|| / ||c|| of the normal equations of the system, including the
+	 * separate diagonal term, for the given x. This is the quantity which <code>solve</code> reduces below epsilon.
+	 */
+	float getRelativeResidual (const float *x) const;
+
 	/**
 	 * Solve the least squares optimization problem. The parameter x must contain
 	 * an initial solution, it will then be filled with the final solution.
@@ -76,6 +157,71 @@ public:
 	 */
 	int solve (float *x, const unsigned int size, const float epsilon);
 
+	/**
+	 * Sets the conjugate gradient variant used by <code>solve</code>. The pipelined variant
+	 * merges all inner products of an iteration into a single reduction which is computed
+	 * together with the matrix vector product, hence it scales better with many threads.
+	 * Default is <code>STANDARD_CG</code>.
+	 *
+	 * @param newSolverVariant
+	 *        the conjugate gradient variant
+	 * @see #solve
+	 */
+	void setSolverVariant (const SolverVariant newSolverVariant);
+
+	/**
+	 * Returns the conjugate gradient variant used by <code>solve</code>.
+	 */
+	SolverVariant getSolverVariant() const;
+
+	/**
+	 * Copies the system, including the separate diagonal term, to the double precision representation which
+	 * is used by <code>multiply</code>, <code>residual</code>, <code>smooth</code> and <code>solvePrepared</code>,
+	 * e.g. by the cycles of a multigrid solver. These operate on the normal equations G * x = f, where f = -c
+	 * (see <code>solve</code>). Must be called again whenever constraints were added or removed.
+	 *
+	 * @param f
+	 *        an array of as many <code>double</code>s as there are unknowns which receives the right hand side f;
+	 *        may be 0
+	 * @see #releaseSystem
+	 */
+	void prepareSystem (double *f);
+
+	/**
+	 * Releases the representation created by <code>prepareSystem</code>.
+	 */
+	void releaseSystem();
+
+	/**
+	 * Returns the number of unknowns of the system.
+	 */
+	int getNofUnknowns() const;
+
+	/**
+	 * Computes r = G * x with the prepared system.
+	 */
+	void multiply (const double *x, double *r) const;
+
+	/**
+	 * Computes the residual r = f - G * x of the prepared system.
+	 */
+	void residual (const double *x, const double *f, double *r) const;
+
+	/**
+	 * Does <code>nofSweeps</code> Gauss-Seidel sweeps on G * x = f with the prepared system, visiting the unknowns
+	 * in increasing order if <code>forward</code> is true, else in decreasing order. A forward sweep followed
+	 * by a backward sweep is a symmetric smoother.
+	 */
+	void smooth (double *x, const double *f, const int nofSweeps, const bool forward) const;
+
+	/**
+	 * Solves G * x = f with the prepared system by conjugate gradients, starting with the given x, until
+	 * ||f - G * x|| <= epsilon * ||f|| or <code>maxIterations</code> iterations are done.
+	 *
+	 * @return the number of iterations
+	 */
+	int solvePrepared (double *x, const double *f, const float epsilon, const int maxIterations) const;
+
 	/**
 	 * prints the matrix (e.g. for debug purposes)
 	 */
@@ -84,10 +230,20 @@ public:
 private:
 
 	int nUnknowns;
+	SolverVariant solverVariant;
 
 	void addContributionToMatrixElement(int i, int j, float c);
 	void addContributionToRightHand(int i, float c);
 
+	// adds the contributions of the buffered constraints to the rows firstRow..endRow-1
+	void addBufferedConstraints (const ConstraintBuffer &buffer, const int firstRow, const int endRow);
+	// sorts the entries of the buffered constraints into the nofPartitions row partitions of addConstraints: the
+	// entries of partition p are the pairs (constraint, position in buffer.indices) partitionOffsets[p]..partitionOffsets[p+1]-1
+	void bucketBufferedConstraints (const ConstraintBuffer &buffer, const int nofPartitions,
+	                                std::vector<int> &entries, std::vector<int> &partitionOffsets) const;
+	// adds the contributions of the nofEntries buffered entries, given as pairs (constraint, position in buffer.indices)
+	void addBufferedEntries (const ConstraintBuffer &buffer, const int *entries, const int nofEntries);
+
 	// the row compressed sparse matrix data structure
 	std::vector<int>* colIndices;
 	std::vector<float>* values;
@@ -96,6 +252,16 @@ private:
 	// the right hand side vector
 	std::vector<float> rightHandSide;
 
+	// the separate diagonal term: one constraint a * x[i] = b per entry
+	std::vector<int>   diagonalIndices;
+	std::vector<float> diagonalCoefficients;
+	std::vector<float> diagonalRightHandSides;
+
+	// the double precision copy of the system created by prepareSystem, and the position of the diagonal
+	// element of each row in it, or -1
+	dRowCompMatrix     preparedMatrix;
+	int                *preparedDiagonal;
+
 	// utility methods for the conjugate gradient method which is usedto solve 
 	// the linear equation system
 	float innerProduct(std::vector<float> &a, std::vector<float> &b);
@@ -106,9 +272,13 @@ private:
 	int copyToDoubleArray(dRowCompMatrix& m);
 	inline float innerProduct(int n, double* a, double* b);
 	inline void matrixVectorProduct(const dRowCompMatrix& m, double* b, double* r);
+	inline void parallelMatrixVectorProduct(const dRowCompMatrix& m, const double* b, double* r) const;
 	inline void addVectors(int n, double* a, double* b, double* r);
 	inline void vectorScalarProduct(int n, double* a, double s, double* r);
 
+	// pipelined conjugate gradient iterations, starting with the residual g = -(G*x + c)
+	int solvePipelined(const dRowCompMatrix& m, double* x, double* c, double* g, double threshold);
+
 };
 
 #endif  // __SPARSELEASTSQUARES_H_
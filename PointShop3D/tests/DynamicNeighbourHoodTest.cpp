@@ -0,0 +1,251 @@
+///////////////////////////////////////////////////////////////////////////////
+// inserts and removes random positions in a NeighbourHood with a dynamic k-d
+// tree and compares its kNN, range, radius and count queries and its neighbour
+// graph with a brute force search over the positions which are not removed.
+//
+// the points lie on a coarse lattice, so there are many equal distances. the
+// k nearest neighbours are compared by their squared distances, the radius
+// queries by their indices.
+//
+// part of the PointShop3D_tests project, see TestMain.cpp.
+///////////////////////////////////////////////////////////////////////////////
+#include "src/Core/DataStructures/src/NeighbourHood.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+// a linear congruential generator, so the test is the same on all platforms
+static unsigned int nextRandom(unsigned int &seed)
+{
+	seed = seed * 1664525u + 1013904223u;
+	return seed >> 8;
+}
+
+static Vector3D randomPosition(unsigned int &seed)
+{
+	// 20 x 20 x 4 lattice points
+	float x = (nextRandom(seed) % 20) * 0.05f,
+		  y = (nextRandom(seed) % 20) * 0.05f,
+		  z = (nextRandom(seed) % 4) * 0.05f;
+	return Vector3D(x, y, z);
+}
+
+static bool isLessIndex(const Neighbour &a, const Neighbour &b)
+{
+	return a.index < b.index;
+}
+
+// the squared distances of all positions which are not removed, in increasing order
+static void bruteForceDistances(const std::vector<Vector3D> &positions, const std::vector<bool> &isRemoved,
+								const Vector3D &queryPoint, std::vector<float> &sqrDistances)
+{
+	sqrDistances.clear();
+	for (unsigned int i = 0; i < positions.size(); i++) {
+		if (!isRemoved[i]) {
+			sqrDistances.push_back((positions[i] - queryPoint).getSquaredLength());
+		}
+	}
+	std::sort(sqrDistances.begin(), sqrDistances.end());
+}
+
+// compares all queries of neighbourHood at queryPoint with the brute force search, returns the number of failures
+static int compareQueries(NeighbourHood &neighbourHood, const std::vector<Vector3D> &positions, const std::vector<bool> &isRemoved,
+						  const Vector3D &queryPoint, const unsigned int nofNeighbours, const float sqrRadius)
+{
+	std::vector<float> sqrDistances;
+	std::vector<Neighbour> neighbours, expected;
+	unsigned int nofExpected, count, i;
+	int nofFailures = 0;
+
+	bruteForceDistances(positions, isRemoved, queryPoint, sqrDistances);
+
+	// kNN query
+	neighbourHood.setNofNeighbours(nofNeighbours);
+	neighbourHood.clearMaxQueryDistance();
+	neighbourHood.setSourcePoint(queryPoint);
+	nofExpected = nofNeighbours < sqrDistances.size() ? nofNeighbours : (unsigned int)sqrDistances.size();
+	if (neighbourHood.getNofFoundNeighbours() != nofExpected) {
+		nofFailures++;
+	}
+	else {
+		for (i = 0; i < nofExpected; i++) {
+			unsigned int index = neighbourHood.getNeighbourPositionIndex(i);
+			if (neighbourHood.getSquaredDistance(i) != sqrDistances[i] || index >= positions.size() || isRemoved[index] ||
+				(positions[index] - queryPoint).getSquaredLength() != sqrDistances[i]) {
+				nofFailures++;
+				break;
+			}
+		}
+	}
+
+	// range query, the neighbours must be closer than the maximum distance
+	neighbourHood.setMaxQuerySqrDistance(sqrRadius);
+	for (count = 0; count < sqrDistances.size() && count < nofNeighbours && sqrDistances[count] < sqrRadius; count++) {
+	}
+	if (neighbourHood.getNofFoundNeighbours() != count) {
+		nofFailures++;
+	}
+	else {
+		for (i = 0; i < count; i++) {
+			if (neighbourHood.getSquaredDistance(i) != sqrDistances[i]) {
+				nofFailures++;
+				break;
+			}
+		}
+	}
+
+	// radius query
+	for (i = 0; i < positions.size(); i++) {
+		Neighbour neighbour;
+		neighbour.index = i;
+		neighbour.weight = (positions[i] - queryPoint).getSquaredLength();
+		if (!isRemoved[i] && neighbour.weight <= sqrRadius) {
+			expected.push_back(neighbour);
+		}
+	}
+	neighbourHood.queryRadius(queryPoint, sqrRadius, neighbours);
+	std::sort(neighbours.begin(), neighbours.end(), isLessIndex);
+	if (neighbours.size() != expected.size()) {
+		nofFailures++;
+	}
+	else {
+		for (i = 0; i < expected.size(); i++) {
+			if (neighbours[i].index != expected[i].index || neighbours[i].weight != expected[i].weight) {
+				nofFailures++;
+				break;
+			}
+		}
+	}
+
+	// count query, with and without reaching the maximum count
+	count = neighbourHood.countNeighboursInRadius(queryPoint, sqrRadius, UINT_MAX);
+	if (count != expected.size()) {
+		nofFailures++;
+	}
+	count = neighbourHood.countNeighboursInRadius(queryPoint, sqrRadius, 3);
+	if (count != (expected.size() < 3 ? expected.size() : 3)) {
+		nofFailures++;
+	}
+
+	return nofFailures;
+}
+
+// compares the neighbour graph with the brute force search, returns the number of failures
+static int compareNeighbourGraph(NeighbourHood &neighbourHood, const std::vector<Vector3D> &positions, const std::vector<bool> &isRemoved,
+								 const unsigned int nofLive, const unsigned int nofNeighbours)
+{
+	const NeighbourGraph *graph = neighbourHood.getNeighbourGraph(nofNeighbours);
+	std::vector<float> sqrDistances;
+	unsigned int nofFound = nofNeighbours < nofLive ? nofNeighbours : nofLive;
+	unsigned int i, j;
+
+	if (graph->offsets.size() != positions.size() + 1) {
+		return 1;
+	}
+	for (i = 0; i < positions.size(); i++) {
+		unsigned int rowLength = graph->offsets[i + 1] - graph->offsets[i];
+		if (isRemoved[i]) {
+			if (rowLength != 0) {
+				return 1;
+			}
+			continue;
+		}
+		if (rowLength != nofFound) {
+			return 1;
+		}
+		bruteForceDistances(positions, isRemoved, positions[i], sqrDistances);
+		for (j = 0; j < nofFound; j++) {
+			unsigned int index = graph->indices[graph->offsets[i] + j];
+			if (graph->sqrDistances[graph->offsets[i] + j] != sqrDistances[j] || isRemoved[index]) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+// inserts and removes positions in rounds, starting with nofInitial positions, returns the number of failures
+static int runEditSequence(const unsigned int nofInitial, const NeighbourHood::SearchStructure initialSearchStructure, unsigned int seed)
+{
+	std::vector<Vector3D> positions;
+	std::vector<bool> isRemoved;
+	std::vector<unsigned int> live;
+	NeighbourHood neighbourHood(4);
+	unsigned int round, i, nofFailures = 0;
+
+	for (i = 0; i < nofInitial; i++) {
+		positions.push_back(randomPosition(seed));
+		isRemoved.push_back(false);
+		live.push_back(i);
+	}
+	// without positions, the first insertion creates the dynamic tree
+	neighbourHood.setSearchStructure(initialSearchStructure);
+	if (nofInitial > 0) {
+		neighbourHood.setPositions(&positions[0], nofInitial);
+	}
+
+	for (round = 0; round < 40; round++) {
+		// grow in the first rounds, then shrink, so that levels are merged and compacted
+		unsigned int nofEdits = 1 + nextRandom(seed) % 150;
+		unsigned int insertPercentage = round < 25 ? 70 : 25;
+		for (i = 0; i < nofEdits; i++) {
+			if (live.size() == 0 || nextRandom(seed) % 100 < insertPercentage) {
+				Vector3D position = randomPosition(seed);
+				unsigned int index = neighbourHood.insertPosition(position);
+				if (index != positions.size()) {
+					return nofFailures + 1;
+				}
+				positions.push_back(position);
+				isRemoved.push_back(false);
+				live.push_back(index);
+			}
+			else {
+				unsigned int j = nextRandom(seed) % live.size();
+				neighbourHood.removePosition(live[j]);
+				isRemoved[live[j]] = true;
+				live[j] = live.back();
+				live.pop_back();
+			}
+		}
+
+		if (neighbourHood.getSearchStructure() != NeighbourHood::DYNAMIC_KD_TREE ||
+			neighbourHood.getNofPositions() != positions.size()) {
+			return nofFailures + 1;
+		}
+		for (i = 0; i < positions.size(); i++) {
+			if (neighbourHood.getPositions()[i] != positions[i]) {
+				return nofFailures + 1;
+			}
+		}
+
+		for (i = 0; i < 20; i++) {
+			const unsigned int nofNeighbours[] = { 1, 6, 9, 30 };
+			// every other query point lies between the lattice points
+			Vector3D queryPoint = randomPosition(seed) + Vector3D(0.01f * (i % 2), 0.0f, 0.0f);
+			nofFailures += compareQueries(neighbourHood, positions, isRemoved, queryPoint, nofNeighbours[i % 4], 0.0125f * (1 + i % 3));
+		}
+		if (round % 8 == 7) {
+			nofFailures += compareNeighbourGraph(neighbourHood, positions, isRemoved, (unsigned int)live.size(), 9);
+		}
+	}
+
+	return nofFailures;
+}
+
+// returns the number of failures
+int runDynamicNeighbourHoodTest()
+{
+	int nofFailures = 0;
+	unsigned int seed;
+
+	for (seed = 1; seed <= 6; seed++) {
+		int n = runEditSequence(seed % 3 == 0 ? 0 : 200 * seed, seed % 2 == 0 ? NeighbourHood::DYNAMIC_KD_TREE : NeighbourHood::KD_TREE, seed);
+		if (n > 0) {
+			fprintf(stderr, "FAILED: edit sequence %u, %d differences\n", seed, n);
+			nofFailures += n;
+		}
+	}
+
+	return nofFailures;
+}
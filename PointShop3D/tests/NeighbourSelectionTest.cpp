@@ -0,0 +1,213 @@
+///////////////////////////////////////////////////////////////////////////////
+// compares the neighbours Pj and Pk which MultiGridLevel::selectNeighbours
+// selects for the directional derivative constraints with the ones of the
+// original, trigonometric formulation, on exact and jittered grids.
+//
+// the selections may only differ where the angles of the candidates, or the
+// angle between Pj and Pk and its threshold, are equal up to rounding, or where
+// rounding decides whether the original formulation accepts a neighbour (see
+// MultiGridLevel::selectNeighbours). any other difference is a failure.
+//
+// part of the PointShop3D_tests project, see TestMain.cpp.
+///////////////////////////////////////////////////////////////////////////////
+#include "src/ToolBars/StandardToolBar/ParameterizationTool/src/MultiGridLevel.h"
+#include "src/Core/DataStructures/src/kdTree.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// the sines of the angles of two candidates, or a cosine and a threshold, are considered
+// equal if they differ by less than this
+#define ROUNDING_TOLERANCE 1e-5
+
+// selects the neighbours j and k as the original implementation did, using the angles
+// between the vectors Pl_P and the plane through P with normal n
+static void selectNeighboursTrigonometric(const Vector3D *positions, const uint index, const uint *neighbourIndices, const int nNeighbours,
+										  const int i, const Vector3D &n, const Vector3D &nPi_P, int &j, int &k, float &Aj, float &Ak)
+{
+	Vector3D P, Pl, nPl_P, nP_Pj;
+	float    Al;
+	int      l;
+
+	P = positions[index];
+	j = k = -1;
+	Aj = Ak = (float)M_PI;
+	nP_Pj = Vector3D(0, 0, 0);
+
+	for (l = 1; l < nNeighbours; l++) {
+
+		if (l != i) {
+
+			Pl = positions[neighbourIndices[l]];
+			nPl_P = P - Pl;
+			nPl_P.normalize();
+			Al = fabs(asin(Vector3D::dotProduct(nPl_P, n)));
+
+			if (acos(Vector3D::dotProduct(nPl_P, nPi_P)) > M_PI / 2) {
+				if (Al < Aj) {
+					k = j;
+					Ak = Aj;
+					j = l;
+					Aj = Al;
+					nP_Pj = Pl - P;
+					nP_Pj.normalize();
+				} else if (Al < Ak && Vector3D::dotProduct(nPl_P, nP_Pj) > -0.99f) {
+					k = l;
+					Ak = Al;
+				}
+			}
+		}
+	}
+}
+
+// returns true if rounding decides whether the original formulation accepts candidate c: if the dot product of two
+// normalized vectors is rounded beyond -1 or 1, i.e. asin or acos is NaN, or if the candidate is perpendicular to Pi_P
+static bool isDecidedByRounding(const Vector3D *positions, const uint index, const uint *neighbourIndices, const int c,
+								const Vector3D &n, const Vector3D &nPi_P)
+{
+	if (c == -1) {
+		return false;
+	}
+	Vector3D nPl_P = positions[index] - positions[neighbourIndices[c + 1]];
+	nPl_P.normalize();
+	return fabs(Vector3D::dotProduct(nPl_P, n)) > 1.0f || fabs(Vector3D::dotProduct(nPl_P, nPi_P)) > 1.0f ||
+		   fabs(Vector3D::dotProduct(nPl_P, nPi_P)) < ROUNDING_TOLERANCE;
+}
+
+// returns true if the cosine of the angle between candidates c and j is the colinearity threshold up to rounding
+static bool isColinearityTie(const int c, const int j, const float *dx, const float *dy, const float *dz, const float *squaredLengths)
+{
+	if (c == -1 || j == -1) {
+		return false;
+	}
+	return fabs((dx[c] * dx[j] + dy[c] * dy[j] + dz[c] * dz[j]) / sqrt(squaredLengths[c] * squaredLengths[j]) - 0.99) < ROUNDING_TOLERANCE;
+}
+
+// compares the selections of all points of a n x n grid, returns the number of unexplained differences
+static int compareSelections(const int n, const float jitter, int &nofSelections, int &nofTies, int &nofRounded)
+{
+	const int nNeighbours = MULTIGRIDLEVEL_NOF_NEIGHBOURS;
+	std::vector<Vector3D> positions, normals;
+	NeighbourGraph graph;
+	float dx[nNeighbours - 1], dy[nNeighbours - 1], dz[nNeighbours - 1],
+		  squaredLengths[nNeighbours - 1], squaredSines[nNeighbours - 1], cosines[nNeighbours - 1];
+	int nofFailures = 0;
+	int index, i, c, j, k, checkJ, checkK;
+	float checkAj, checkAk;
+
+	srand(1);
+	for (i = 0; i < n * n; i++) {
+		float x = (i / n + jitter * (rand() / (float)RAND_MAX)) / n;
+		float y = (i % n + jitter * (rand() / (float)RAND_MAX)) / n;
+		positions.push_back(Vector3D(x, y, 0.0f));
+		normals.push_back(Vector3D(0.0f, 0.0f, 1.0f));
+	}
+	KdTree tree(&positions[0], n * n, 8);
+	tree.computeNeighbourGraph(nNeighbours, graph);
+
+	for (index = 0; index < n * n; index++) {
+
+		const uint *neighbourIndices = &graph.indices[graph.offsets[index]];
+		Vector3D P = positions[index];
+
+		for (c = 0; c < nNeighbours - 1; c++) {
+			Vector3D Pl = positions[neighbourIndices[c + 1]];
+			dx[c] = P[0] - Pl[0];
+			dy[c] = P[1] - Pl[1];
+			dz[c] = P[2] - Pl[2];
+			squaredLengths[c] = dx[c] * dx[c] + dy[c] * dy[c] + dz[c] * dz[c];
+		}
+
+		for (i = 1; i < nNeighbours; i++) {
+
+			// the same vectors as in MultiGridLevel::addDirectionalDerivativesConstraints
+			Vector3D nPi_P = P - positions[neighbourIndices[i]];
+			nPi_P.normalize();
+			Vector3D nrm = Vector3D::crossProduct(nPi_P, normals[index]);
+			nrm.normalize();
+			for (c = 0; c < nNeighbours - 1; c++) {
+				float dn = dx[c] * nrm[0] + dy[c] * nrm[1] + dz[c] * nrm[2];
+				squaredSines[c] = dn * dn / squaredLengths[c];
+				cosines[c] = dx[c] * nPi_P[0] + dy[c] * nPi_P[1] + dz[c] * nPi_P[2];
+			}
+
+			MultiGridLevel::selectNeighbours<0>(nNeighbours, i - 1, dx, dy, dz, squaredLengths, squaredSines, cosines, j, k);
+			selectNeighboursTrigonometric(&positions[0], index, neighbourIndices, nNeighbours, i, nrm, nPi_P, checkJ, checkK, checkAj, checkAk);
+			nofSelections++;
+
+			// the candidates are the neighbours without the point itself
+			if (checkJ != -1) checkJ--;
+			if (checkK != -1) checkK--;
+
+			if (j == checkJ && k == checkK) {
+				// the same neighbours are selected, and accepted if they are close enough to the plane, i.e. if
+				// their angles are smaller than 60 degrees, unless an angle is 60 degrees up to rounding
+				if (j != -1 && k != -1 &&
+					(checkAj < (float)M_PI / 3.0f && checkAk < (float)M_PI / 3.0f) != (squaredSines[j] < 0.75f && squaredSines[k] < 0.75f)) {
+					if (fabs(sqrt(squaredSines[j]) - sqrt(0.75)) < ROUNDING_TOLERANCE || fabs(sqrt(squaredSines[k]) - sqrt(0.75)) < ROUNDING_TOLERANCE) {
+						nofTies++;
+					}
+					else {
+						fprintf(stderr, "%d x %d points, jitter %g: point %d, neighbour %d: j = %d, k = %d are accepted differently\n",
+								n, n, jitter, index, i, j, k);
+						nofFailures++;
+					}
+				}
+			}
+			else if (isDecidedByRounding(&positions[0], index, neighbourIndices, j, nrm, nPi_P) ||
+					 isDecidedByRounding(&positions[0], index, neighbourIndices, k, nrm, nPi_P) ||
+					 isDecidedByRounding(&positions[0], index, neighbourIndices, checkJ, nrm, nPi_P) ||
+					 isDecidedByRounding(&positions[0], index, neighbourIndices, checkK, nrm, nPi_P)) {
+				// a neighbour exactly opposite or perpendicular to Pi, or perpendicular to the plane, is accepted
+				// or rejected by the original formulation depending on rounding
+				nofRounded++;
+			}
+			else if (j != -1 && checkJ != -1 && j != checkJ &&
+					 fabs(sqrt(squaredSines[j]) - sqrt(squaredSines[checkJ])) < ROUNDING_TOLERANCE) {
+				// Pj is tie-broken differently, Pk follows from it
+				nofTies++;
+			}
+			else if (j == checkJ &&
+					 ((k != -1 && checkK != -1 && fabs(sqrt(squaredSines[k]) - sqrt(squaredSines[checkK])) < ROUNDING_TOLERANCE) ||
+					  isColinearityTie(k, j, dx, dy, dz, squaredLengths) || isColinearityTie(checkK, j, dx, dy, dz, squaredLengths))) {
+				// Pk is tie-broken differently
+				nofTies++;
+			}
+			else {
+				fprintf(stderr, "%d x %d points, jitter %g: point %d, neighbour %d: j = %d, k = %d instead of %d, %d\n",
+						n, n, jitter, index, i, j, k, checkJ, checkK);
+				nofFailures++;
+			}
+		}
+	}
+
+	return nofFailures;
+}
+
+// returns the number of failures
+int runNeighbourSelectionTest()
+{
+	const float jitters[] = { 0.0f, 0.001f, 0.3f, 1.0f };
+	int nofFailures = 0;
+	int nofSelections, nofTies, nofRounded;
+	int n, i;
+
+	for (n = 37; n <= 150; n += 113 / 2) {
+		for (i = 0; i < 4; i++) {
+			nofSelections = 0;
+			nofTies = 0;
+			nofRounded = 0;
+			nofFailures += compareSelections(n, jitters[i], nofSelections, nofTies, nofRounded);
+			printf("%d x %d points, jitter %g: %d selections, %d tie-broken differently, %d with rounded neighbours\n",
+				   n, n, jitters[i], nofSelections, nofTies, nofRounded);
+		}
+	}
+
+	return nofFailures;
+}
@@ -0,0 +1,69 @@
+///////////////////////////////////////////////////////////////////////////////
+// regression test of the parameterization on very small point clouds, where
+// the levels of the multigrid hierarchy have fewer points than the stencil
+// and the cluster size (the rows of their neighbour graphs are shorter).
+// a grid fails if any of its uv coordinates is not finite.
+//
+// part of the PointShop3D_tests project, see TestMain.cpp.
+///////////////////////////////////////////////////////////////////////////////
+#include "src/ToolBars/StandardToolBar/ParameterizationTool/src/Parameterization.h"
+
+#include <stdio.h>
+#include <math.h>
+
+// parameterizes a n x n grid on a bumpy surface, with the corners as markers
+static bool parameterizeGrid(const int n, const uint nofLevels, const NeighbourHood::SearchStructure searchStructure)
+{
+	Parameterization parameterization;
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < n; j++) {
+			float x = (i + 0.25f * ((i * 7 + j * 3) % 5) / 5.0f) / n;
+			float y = (j + 0.25f * ((i * 3 + j * 11) % 7) / 7.0f) / n;
+			parameterization.targetCloudPoints.push_back(glm::vec3(x, y, 0.1f * sinf(6.0f * x) * cosf(5.0f * y)));
+			parameterization.targetCloudNormals.push_back(glm::vec3(0.0f, 0.0f, 1.0f));
+		}
+	}
+
+	parameterization.markers3Dindex.push_back(0);
+	parameterization.markers2D.push_back(glm::vec2(0.0f, 0.0f));
+	parameterization.markers3Dindex.push_back(n * n - 1);
+	parameterization.markers2D.push_back(glm::vec2(1.0f, 1.0f));
+
+	parameterization.setNofLevels(nofLevels);
+	parameterization.setNeighbourSearchStructure(searchStructure);
+	parameterization.generateUVCoordinates(false);
+
+	if (parameterization.finalUV.size() != (size_t)(n * n)) {
+		return false;
+	}
+	for (i = 0; i < n * n; i++) {
+		if (!(fabsf(parameterization.finalUV[i].x) < 1e6f) || !(fabsf(parameterization.finalUV[i].y) < 1e6f)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// returns the number of failures
+int runSmallCloudTest()
+{
+	int nofFailures = 0;
+	int n;
+	uint nofLevels;
+
+	// 4 to 225 points, in hierarchies which end with a single point or two
+	for (n = 2; n <= 15; n++) {
+		for (nofLevels = 1; nofLevels <= 6; nofLevels++) {
+			if (!parameterizeGrid(n, nofLevels, NeighbourHood::KD_TREE) ||
+				!parameterizeGrid(n, nofLevels, NeighbourHood::UNIFORM_GRID) ||
+				!parameterizeGrid(n, nofLevels, NeighbourHood::FLAT_KD_TREE)) {
+				fprintf(stderr, "FAILED: %d x %d points, %u levels\n", n, n, nofLevels);
+				nofFailures++;
+			}
+		}
+	}
+
+	return nofFailures;
+}
@@ -0,0 +1,31 @@
+///////////////////////////////////////////////////////////////////////////////
+// runs the regression tests of the PointShop3D library and returns 0 if all
+// of them pass.
+//
+// the tests are built by the PointShop3D_tests project of PointShop3D.sln,
+// which links the PointShop3D library. like the other projects, it expects
+// glm (included by Parameterization.h and PointShop3D.h as <glm/glm.hpp>)
+// in 3rdParty/glm next to the solution directory, i.e. $(SolutionDir)../3rdParty/glm.
+// the include paths are the PointShop3D directory and the glm directory.
+///////////////////////////////////////////////////////////////////////////////
+#include <stdio.h>
+
+int runSmallCloudTest();
+int runNeighbourSelectionTest();
+int runDynamicNeighbourHoodTest();
+
+int main()
+{
+	int nofFailures, n;
+
+	nofFailures = runSmallCloudTest();
+	printf("SmallCloudTest: %d failures\n", nofFailures);
+	n = runNeighbourSelectionTest();
+	printf("NeighbourSelectionTest: %d failures\n", n);
+	nofFailures += n;
+	n = runDynamicNeighbourHoodTest();
+	printf("DynamicNeighbourHoodTest: %d failures\n", n);
+	nofFailures += n;
+
+	return nofFailures == 0 ? 0 : 1;
+}